@@ -21,6 +21,7 @@
 #include <string.h>
 #include <gtk/gtk.h>
 #include <glib/gstdio.h>
+#include <zlib.h>
 #include <libgnomecanvas/libgnomecanvas.h>
 
 #include "xournal.h"
@@ -31,6 +32,7 @@
 #include "xo-file.h"
 #include "xo-paint.h"
 #include "xo-shapes.h"
+#include "xo-image.h"
 
 GtkWidget *winMain;
 GnomeCanvas *canvas;
@@ -55,12 +57,15 @@ void init_stuff (int argc, char *argv[])
 
   // create some data structures needed to populate the preferences
   ui.default_page.bg = g_new(struct Background, 1);
+  ui.default_page.bg->serial = new_serial();
 
   // initialize config file names
   tmppath = g_build_filename(g_get_home_dir(), CONFIG_DIR, NULL);
   g_mkdir(tmppath, 0700); // safer (MRU data may be confidential)
   ui.mrufile = g_build_filename(tmppath, MRU_FILE, NULL);
   ui.configfile = g_build_filename(tmppath, CONFIG_FILE, NULL);
+  ui.pdfcachedir = g_build_filename(tmppath, PDFCACHE_DIR, NULL);
+  g_mkdir(ui.pdfcachedir, 0700);
   g_free(tmppath);
 
   // initialize preferences
@@ -348,6 +353,13 @@ main (int argc, char *argv[])
   textdomain (GETTEXT_PACKAGE);
 #endif
   
+#if !GLIB_CHECK_VERSION(2,32,0)
+  if (!g_thread_supported()) g_thread_init(NULL); // for the PDF render threads
+#endif
+  // parser benchmark on a document's stroke data, without opening a window
+  if (argc == 3 && !strcmp(argv[1], "--benchmark-numbers"))
+    return benchmark_number_parsing_file(argv[2]);
+
   gtk_set_locale ();
   gtk_init (&argc, &argv);
 
@@ -375,6 +387,8 @@ main (int argc, char *argv[])
   gtk_main ();
   
   if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
+  shutdown_parse_pool();
+  shutdown_image_decodes();
 
   save_mru_list();
   autosave_cleanup(&ui.autosave_filename_list);
@@ -25,6 +25,7 @@
 #include <time.h>
 #include <glib/gstdio.h>
 #include <gdk/gdkkeysyms.h>
+#include <zlib.h>
 
 #include "xournal.h"
 #include "xo-callbacks.h"
@@ -153,6 +154,7 @@ on_fileOpen_activate                   (GtkMenuItem     *menuitem,
   filt_xoj = gtk_file_filter_new();
   gtk_file_filter_set_name(filt_xoj, _("Xournal files"));
   gtk_file_filter_add_pattern(filt_xoj, "*.xoj");
+  gtk_file_filter_add_pattern(filt_xoj, "*.xojb");
   gtk_file_chooser_add_filter(GTK_FILE_CHOOSER (dialog), filt_xoj);
   gtk_file_chooser_add_filter(GTK_FILE_CHOOSER (dialog), filt_all);
 
@@ -238,6 +240,7 @@ on_fileSaveAs_activate                 (GtkMenuItem     *menuitem,
   filt_xoj = gtk_file_filter_new();
   gtk_file_filter_set_name(filt_xoj, _("Xournal files"));
   gtk_file_filter_add_pattern(filt_xoj, "*.xoj");
+  gtk_file_filter_add_pattern(filt_xoj, "*.xojb");
   gtk_file_chooser_add_filter(GTK_FILE_CHOOSER (dialog), filt_xoj);
   gtk_file_chooser_add_filter(GTK_FILE_CHOOSER (dialog), filt_all);
   
@@ -464,6 +467,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   reset_selection(); // safer
   reset_recognizer(); // safer
   if (undo->type == ITEM_STROKE || undo->type == ITEM_TEXT || undo->type == ITEM_IMAGE) {
+    invalidate_save_cache(undo->layer);
     // we're keeping the stroke info, but deleting the canvas item
     gtk_object_destroy(GTK_OBJECT(undo->item->canvas_item));
     undo->item->canvas_item = NULL;
@@ -472,6 +476,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     undo->layer->nitems--;
   }
   else if (undo->type == ITEM_ERASURE || undo->type == ITEM_RECOGNIZER) {
+    invalidate_save_cache(undo->layer);
     for (list = undo->erasurelist; list!=NULL; list = list->next) {
       erasure = (struct UndoErasureData *)list->data;
       // delete all the created items
@@ -502,6 +507,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       tmp_bg = undo->page->bg;
       undo->page->bg = undo->bg;
       undo->bg = tmp_bg;
+      bgpdf_index_page(undo->page);
       undo->page->bg->canvas_item = undo->bg->canvas_item;
       undo->bg->canvas_item = NULL;
     }
@@ -536,6 +542,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     undo->page->bg->canvas_item = NULL;
     journal.pages = g_list_remove(journal.pages, undo->page);
     journal.npages--;
+    bgpdf_unindex_page(undo->page);
     if (ui.cur_page == undo->page) ui.cur_page = NULL;
         // so do_switch_page() won't try to remap the layers of the defunct page
     if (ui.pageno >= undo->val) ui.pageno--;
@@ -545,6 +552,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   else if (undo->type == ITEM_DELETE_PAGE) {
     journal.pages = g_list_insert(journal.pages, undo->page, undo->val);
     journal.npages++;
+    bgpdf_index_page(undo->page);
     make_canvas_items(); // re-create the canvas items
     do_switch_page(undo->val, TRUE, TRUE);
   }
@@ -561,11 +569,13 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
                             undo->layer2, undo->layer, undo->auxlist);
   }
   else if (undo->type == ITEM_RESIZESEL) {
+    invalidate_save_cache(undo->layer);
     resize_journal_items_by(undo->itemlist, 
       1/undo->scaling_x, 1/undo->scaling_y,
       -undo->val_x/undo->scaling_x, -undo->val_y/undo->scaling_y);
   }
   else if (undo->type == ITEM_PASTE) {
+    invalidate_save_cache(undo->layer);
     for (itemlist = undo->itemlist; itemlist != NULL; itemlist = itemlist->next) {
       it = (struct Item *)itemlist->data;
       gtk_object_destroy(GTK_OBJECT(it->canvas_item));
@@ -607,6 +617,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     do_switch_page(ui.pageno, FALSE, FALSE); // show the restored layer & others...
   }
   else if (undo->type == ITEM_REPAINTSEL) {
+    invalidate_save_cache(undo->layer);
     for (itemlist = undo->itemlist, list = undo->auxlist; itemlist!=NULL;
            itemlist = itemlist->next, list = list->next) {
       it = (struct Item *)itemlist->data;
@@ -625,6 +636,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     }
   }
   else if (undo->type == ITEM_TEXT_EDIT) {
+    invalidate_save_cache(undo->layer);
     tmpstr = undo->str;
     undo->str = undo->item->text;
     undo->item->text = tmpstr;
@@ -632,6 +644,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     update_item_bbox(undo->item);
   }
   else if (undo->type == ITEM_TEXT_ATTRIB) {
+    invalidate_save_cache(undo->layer);
     tmpstr = undo->str;
     undo->str = undo->item->font_name;
     undo->item->font_name = tmpstr;
@@ -679,6 +692,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
   reset_selection(); // safer
   reset_recognizer(); // safer
   if (redo->type == ITEM_STROKE || redo->type == ITEM_TEXT || redo->type == ITEM_IMAGE) {
+    invalidate_save_cache(redo->layer);
     // re-create the canvas_item
     make_canvas_item_one(redo->layer->group, redo->item);
     // reinsert the item on its layer
@@ -686,6 +700,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     redo->layer->nitems++;
   }
   else if (redo->type == ITEM_ERASURE || redo->type == ITEM_RECOGNIZER) {
+    invalidate_save_cache(redo->layer);
     for (list = redo->erasurelist; list!=NULL; list = list->next) {
       erasure = (struct UndoErasureData *)list->data;
       target = g_list_find(redo->layer->items, erasure->item);
@@ -711,6 +726,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       tmp_bg = redo->page->bg;
       redo->page->bg = redo->bg;
       redo->bg = tmp_bg;
+      bgpdf_index_page(redo->page);
       redo->page->bg->canvas_item = redo->bg->canvas_item;
       redo->bg->canvas_item = NULL;
     }
@@ -750,6 +766,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     
     journal.pages = g_list_insert(journal.pages, redo->page, redo->val);
     journal.npages++;
+    bgpdf_index_page(redo->page);
     do_switch_page(redo->val, TRUE, TRUE);
   }
   else if (redo->type == ITEM_DELETE_PAGE) {
@@ -765,6 +782,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     }
     journal.pages = g_list_remove(journal.pages, redo->page);
     journal.npages--;
+    bgpdf_unindex_page(redo->page);
     if (ui.pageno > redo->val || ui.pageno == journal.npages) ui.pageno--;
     ui.cur_page = NULL;
       // so do_switch_page() won't try to remap the layers of the defunct page
@@ -783,10 +801,12 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
                             redo->layer, redo->layer2, NULL);
   }
   else if (redo->type == ITEM_RESIZESEL) {
+    invalidate_save_cache(redo->layer);
     resize_journal_items_by(redo->itemlist, 
           redo->scaling_x, redo->scaling_y, redo->val_x, redo->val_y);
   }
   else if (redo->type == ITEM_PASTE) {
+    invalidate_save_cache(redo->layer);
     for (itemlist = redo->itemlist; itemlist != NULL; itemlist = itemlist->next) {
       it = (struct Item *)itemlist->data;
       make_canvas_item_one(redo->layer->group, it);
@@ -821,6 +841,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     do_switch_page(ui.pageno, FALSE, FALSE);
   }
   else if (redo->type == ITEM_REPAINTSEL) {
+    invalidate_save_cache(redo->layer);
     for (itemlist = redo->itemlist, list = redo->auxlist; itemlist!=NULL;
            itemlist = itemlist->next, list = list->next) {
       it = (struct Item *)itemlist->data;
@@ -845,6 +866,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     }
   }
   else if (redo->type == ITEM_TEXT_EDIT) {
+    invalidate_save_cache(redo->layer);
     tmpstr = redo->str;
     redo->str = redo->item->text;
     redo->item->text = tmpstr;
@@ -852,6 +874,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     update_item_bbox(redo->item);
   }
   else if (redo->type == ITEM_TEXT_ATTRIB) {
+    invalidate_save_cache(redo->layer);
     tmpstr = redo->str;
     redo->str = redo->item->font_name;
     redo->item->font_name = tmpstr;
@@ -1091,6 +1114,7 @@ on_journalNewPageBefore_activate       (GtkMenuItem     *menuitem,
   pg = new_page(ui.cur_page);
   journal.pages = g_list_insert(journal.pages, pg, ui.pageno);
   journal.npages++;
+  bgpdf_index_page(pg);
   do_switch_page(ui.pageno, TRUE, TRUE);
   
   prepare_new_undo();
@@ -1111,6 +1135,7 @@ on_journalNewPageAfter_activate        (GtkMenuItem     *menuitem,
   pg = new_page(ui.cur_page);
   journal.pages = g_list_insert(journal.pages, pg, ui.pageno+1);
   journal.npages++;
+  bgpdf_index_page(pg);
   do_switch_page(ui.pageno+1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1131,6 +1156,7 @@ on_journalNewPageEnd_activate          (GtkMenuItem     *menuitem,
   pg = new_page((struct Page *)g_list_last(journal.pages)->data);
   journal.pages = g_list_append(journal.pages, pg);
   journal.npages++;
+  bgpdf_index_page(pg);
   do_switch_page(journal.npages-1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1169,6 +1195,7 @@ on_journalDeletePage_activate          (GtkMenuItem     *menuitem,
   
   journal.pages = g_list_remove(journal.pages, ui.cur_page);
   journal.npages--;
+  bgpdf_unindex_page(ui.cur_page);
   if (ui.pageno == journal.npages) ui.pageno--;
   ui.cur_page = NULL;
      // so do_switch_page() won't try to remap the layers of the defunct page
@@ -1187,6 +1214,9 @@ on_journalNewLayer_activate            (GtkMenuItem     *menuitem,
   l = g_new(struct Layer, 1);
   l->items = NULL;
   l->nitems = 0;
+  l->save_cache = NULL;
+  l->dirty = TRUE;
+  l->serial = new_serial();
   l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
     ui.cur_page->group, gnome_canvas_group_get_type(), NULL);
   lower_canvas_item_to(ui.cur_page->group, GNOME_CANVAS_ITEM(l->group),
@@ -1239,6 +1269,9 @@ on_journalDeleteLayer_activate         (GtkMenuItem     *menuitem,
     ui.cur_layer = g_new(struct Layer, 1);
     ui.cur_layer->items = NULL;
     ui.cur_layer->nitems = 0;
+    ui.cur_layer->save_cache = NULL;
+    ui.cur_layer->dirty = TRUE;
+    ui.cur_layer->serial = new_serial();
     ui.cur_layer->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
       ui.cur_page->group, gnome_canvas_group_get_type(), NULL);
     ui.cur_page->layers = g_list_append(NULL, ui.cur_layer);
@@ -1541,6 +1574,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
               gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale);
       journal.pages = g_list_append(journal.pages, pg);
       journal.npages++;
+      bgpdf_index_page(pg);
       undo->val = pageno;
       undo->page = pg;
     } else
@@ -1554,6 +1588,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       undo->val_x = pg->width;
       undo->val_y = pg->height;
       pg->bg = bg;
+      bgpdf_index_page(pg);
       pg->width = gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale;
       pg->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
       make_page_clipbox(pg);
@@ -1603,6 +1638,7 @@ on_journalScreenshot_activate          (GtkMenuItem     *menuitem,
   undo->val_y = ui.cur_page->height;
 
   ui.cur_page->bg = bg;
+  bgpdf_index_page(ui.cur_page);
   ui.cur_page->width = gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale;
   ui.cur_page->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
 
@@ -1649,6 +1685,7 @@ on_journalApplyAllPages_activate       (GtkMenuItem     *menuitem,
     if (pglist->next!=NULL) undo->multiop |= MULTIOP_CONT_REDO;
     if (pglist->prev!=NULL) undo->multiop |= MULTIOP_CONT_UNDO;
     page->bg = (struct Background *)g_memdup(ui.cur_page->bg, sizeof(struct Background));
+    bgpdf_index_page(page);
     page->width = ui.cur_page->width;
     page->height = ui.cur_page->height;
     page->bg->canvas_item = undo->bg->canvas_item;
@@ -2192,7 +2229,7 @@ on_toolsDefaultText_activate           (GtkMenuItem     *menuitem,
   ui.font_name = g_strdup(ui.default_font_name);
   ui.font_size = ui.default_font_size;
   if (ui.cur_item_type == ITEM_TEXT) {
-    refont_text_item(ui.cur_item, ui.font_name, ui.font_size);
+    refont_text_item(ui.cur_item, ui.cur_layer, ui.font_name, ui.font_size);
   }
   update_font_button();
   update_mapping_linkings(-1);
@@ -2706,6 +2743,7 @@ on_canvas_expose_event                 (GtkWidget       *widget,
                                         GdkEventExpose  *event,
                                         gpointer         user_data)
 {
+  load_visible_pages();
   if (ui.view_continuous!=0 && ui.progressive_bg) rescale_bg_pixmaps();
   return FALSE;
 }
@@ -3008,9 +3046,11 @@ on_vscroll_changed                     (GtkAdjustment   *adjustment,
   double viewport_top, viewport_bottom;
   struct Page *tmppage;
   
+  if (ui.view_continuous==VIEW_MODE_CONTINUOUS && ui.progressive_bg) 
+    rescale_bg_pixmaps();
+  else bgpdf_update_visible_tiles(); // when zoomed in, in any view mode
   if (ui.view_continuous!=VIEW_MODE_CONTINUOUS) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
   need_update = FALSE;
   viewport_top = adjustment->value / ui.zoom;
   viewport_bottom = (adjustment->value + adjustment->page_size) / ui.zoom;
@@ -3041,9 +3081,11 @@ on_hscroll_changed                     (GtkAdjustment   *adjustment,
   double viewport_left, viewport_right;
   struct Page *tmppage;
   
+  if (ui.view_continuous==VIEW_MODE_HORIZONTAL && ui.progressive_bg) 
+    rescale_bg_pixmaps();
+  else bgpdf_update_visible_tiles(); // when zoomed in, in any view mode
   if (ui.view_continuous!=VIEW_MODE_HORIZONTAL) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
   need_update = FALSE;
   viewport_left = adjustment->value / ui.zoom;
   viewport_right = (adjustment->value + adjustment->page_size) / ui.zoom;
@@ -3120,6 +3162,7 @@ on_journalDefaultBackground_activate   (GtkMenuItem     *menuitem,
     undo->val_x = pg->width;
     undo->val_y = pg->height; 
     pg->bg = (struct Background *)g_memdup(ui.default_page.bg, sizeof(struct Background));
+    bgpdf_index_page(pg);
     pg->width = ui.default_page.width;
     pg->height = ui.default_page.height;
     pg->bg->canvas_item = undo->bg->canvas_item;
@@ -115,8 +115,7 @@ void selection_to_clip(void)
     else if (item->type == ITEM_IMAGE) {
       if (item->image_png == NULL) {
         set_cursor_busy(TRUE);
-        if (!gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL))
-          item->image_png_len = 0;       // failed for some reason, so forget it
+        encode_image_png(item);
         set_cursor_busy(FALSE);
       }
       bufsz+= sizeof(int) // type
@@ -171,7 +170,7 @@ void selection_to_clip(void)
       if (item->image_png_len > 0) {
         g_memmove(p, item->image_png, item->image_png_len); p+= item->image_png_len;
       }
-      if (nitems==1) sel->image_data = gdk_pixbuf_copy(item->image); // single image
+      if (nitems==1) sel->image_data = gdk_pixbuf_copy(item_image(item)); // single image
     }
   }
   
@@ -246,6 +245,7 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
     ui.selection->items = g_list_append(ui.selection->items, item);
     ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
     ui.cur_layer->nitems++;
+    invalidate_save_cache(ui.cur_layer);
     g_memmove(&item->type, p, sizeof(int)); p+= sizeof(int);
     if (item->type == ITEM_STROKE) {
       g_memmove(&item->brush, p, sizeof(struct Brush)); p+= sizeof(struct Brush);
@@ -291,8 +291,9 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
       item->bbox.bottom += voffset;
       g_memmove(&item->image_png_len, p, sizeof(gsize)); p+= sizeof(gsize);
       if (item->image_png_len > 0) {
-        item->image_png = g_memdup(p, item->image_png_len);
-        item->image = pixbuf_from_buffer(item->image_png, item->image_png_len);
+        item->image_png = store_image_png(g_memdup(p, item->image_png_len), 
+                                          item->image_png_len);
+        item->image = stored_image_pixbuf(item->image_png, item->image_png_len);
         p+= item->image_png_len;
       } else {
         item->image = NULL;
@@ -334,6 +335,7 @@ void clipboard_paste_text(gchar *text)
   ui.selection->items = g_list_append(ui.selection->items, item);
   ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
   ui.cur_layer->nitems++;
+  invalidate_save_cache(ui.cur_layer);
   item->type = ITEM_TEXT;
   g_memmove(&(item->brush), &(ui.brushes[ui.cur_mapping][TOOL_PEN]), sizeof(struct Brush));
   item->text = text; // text was newly allocated, we keep it
@@ -18,6 +18,7 @@
 #endif
 
 #include <signal.h>
+#include <sys/stat.h>
 #include <memory.h>
 #include <string.h>
 #include <stdio.h>
@@ -31,6 +32,15 @@
 #include <glib/gstdio.h>
 #include <poppler/glib/poppler.h>
 
+#ifndef WIN32
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/ioctl.h>
+#endif
+#ifdef __linux__
+ #include <linux/fs.h> // for FICLONE
+#endif
+
 #ifdef GDK_WINDOWING_X11
  #include <gdk/gdkx.h>
  #include <X11/Xlib.h>
@@ -72,13 +82,401 @@ gzFile gzopen_wrapper(const char *path, const char *mode)
 #endif
 }
 
+// buffered output for save_journal(): everything is formatted into a
+// large buffer without any locale dependence, and compressed in blocks.
+// The file is a sequence of gzip members (which gzread() reads as a single
+// stream), so that members saved earlier can be copied back verbatim.
+// With the compression_threads option, each block becomes a member of its
+// own, compressed by a worker thread; the members are written out in order
+// as they become ready.
+
+GThreadPool *deflate_pool;
+G_LOCK_DEFINE_STATIC(deflate_pool);
+
+// the compression level is ui.compression_level, unless changed before 
+// anything gets written (auto-saves use ui.autosave_compression_level)
+
+void xoj_writer_init(XojWriter *w, FILE *f)
+{
+  w->f = f;
+  w->buf = g_string_sized_new(XOJ_WRITER_BLOCK + 4096);
+  w->ok = TRUE;
+  w->total = 0;
+  w->level = ui.compression_level;
+  w->in_member = FALSE;
+  w->capture = NULL;
+  w->shared_images = NULL;
+  w->jobs = NULL;
+  w->finished = NULL;
+  // only worth it when writing a file (not for the auto-save log)
+  if (f == NULL || ui.compression_threads <= 0 || !g_thread_supported()) return;
+  G_LOCK(deflate_pool); // auto-saves may get here from their own thread
+  if (deflate_pool == NULL)
+    deflate_pool = g_thread_pool_new(xoj_deflate_thread, NULL, 
+                                     ui.compression_threads, FALSE, NULL);
+  G_UNLOCK(deflate_pool);
+  if (deflate_pool == NULL) return;
+  w->jobs = g_queue_new();
+  w->finished = g_async_queue_new();
+  w->max_jobs = XOJ_WRITER_JOBS_PER_THREAD * ui.compression_threads;
+}
+
+void xoj_writer_output(XojWriter *w, const void *data, gsize len)
+{
+  if (len == 0) return;
+  if (w->f != NULL && fwrite(data, 1, len, w->f) != len) w->ok = FALSE;
+  if (w->capture != NULL) g_byte_array_append(w->capture, data, len);
+}
+
+// compress the buffer into the current gzip member (starting one if needed)
+
+void xoj_writer_deflate(XojWriter *w, int flush)
+{
+  guchar out[XOJ_WRITER_CHUNK];
+  int ret;
+  
+  if (!w->in_member) {
+    w->zs.zalloc = Z_NULL;
+    w->zs.zfree = Z_NULL;
+    w->zs.opaque = Z_NULL;
+    // 16+MAX_WBITS: gzip header and trailer rather than zlib ones
+    if (deflateInit2(&w->zs, w->level, Z_DEFLATED, 16+MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) 
+      { w->ok = FALSE; g_string_truncate(w->buf, 0); return; }
+    w->in_member = TRUE;
+  }
+  w->zs.next_in = (Bytef *)w->buf->str;
+  w->zs.avail_in = w->buf->len;
+  do {
+    w->zs.next_out = out;
+    w->zs.avail_out = sizeof(out);
+    ret = deflate(&w->zs, flush);
+    if (ret == Z_STREAM_ERROR) { w->ok = FALSE; break; }
+    xoj_writer_output(w, out, sizeof(out) - w->zs.avail_out);
+  } while (w->zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+  w->total += w->buf->len;
+  g_string_truncate(w->buf, 0);
+  if (flush == Z_FINISH) {
+    deflateEnd(&w->zs);
+    w->in_member = FALSE;
+  }
+}
+
+// compress data into a complete gzip member, appended to out
+
+gboolean gzip_member(const void *data, gsize len, int level, GByteArray *out)
+{
+  z_stream zs;
+  guint start;
+  int ret;
+  
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  if (deflateInit2(&zs, level, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return FALSE;
+  start = out->len;
+  // older versions of zlib leave out the gzip header and trailer
+  g_byte_array_set_size(out, start + deflateBound(&zs, len) + 32);
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  zs.next_out = out->data + start;
+  zs.avail_out = out->len - start;
+  ret = deflate(&zs, Z_FINISH);
+  g_byte_array_set_size(out, out->len - zs.avail_out);
+  deflateEnd(&zs);
+  return (ret == Z_STREAM_END);
+}
+
+// in a worker thread
+
+void xoj_deflate_thread(gpointer data, gpointer user_data)
+{
+  XojDeflateJob *job = (XojDeflateJob *)data;
+  GAsyncQueue *finished = job->finished;
+  
+  job->ok = gzip_member(job->text->str, job->text->len, job->level, job->out);
+  g_atomic_int_set(&job->done, TRUE); // the writer may free the job from now on
+  g_async_queue_push(finished, data);
+  g_async_queue_unref(finished);
+}
+
+// hand the buffer over to a worker thread, as a gzip member of its own
+
+void xoj_writer_submit(XojWriter *w)
+{
+  XojDeflateJob *job;
+  
+  if (w->buf->len == 0) return;
+  job = g_new0(XojDeflateJob, 1);
+  job->text = w->buf;
+  job->out = g_byte_array_new();
+  job->capture = w->capture;
+  job->level = w->level;
+  job->finished = g_async_queue_ref(w->finished);
+  w->total += w->buf->len;
+  w->buf = g_string_sized_new(XOJ_WRITER_BLOCK + 4096);
+  g_queue_push_tail(w->jobs, job);
+  g_thread_pool_push(deflate_pool, job, NULL);
+  xoj_writer_drain(w, w->max_jobs); // don't get too far ahead of the threads
+}
+
+// write out the members that are ready, in order, then wait until at most
+// max_jobs remain
+
+void xoj_writer_drain(XojWriter *w, guint max_jobs)
+{
+  XojDeflateJob *job;
+  
+  while (!g_queue_is_empty(w->jobs)) {
+    job = (XojDeflateJob *)g_queue_peek_head(w->jobs);
+    if (!g_atomic_int_get(&job->done)) {
+      if (g_queue_get_length(w->jobs) <= max_jobs) return;
+      g_async_queue_pop(w->finished); // until some job is done
+      continue;
+    }
+    g_queue_pop_head(w->jobs);
+    if (!job->ok) w->ok = FALSE;
+    if (w->f != NULL && fwrite(job->out->data, 1, job->out->len, w->f) != job->out->len)
+      w->ok = FALSE;
+    if (job->capture != NULL) 
+      g_byte_array_append(job->capture, job->out->data, job->out->len);
+    if (job->text != NULL) g_string_free(job->text, TRUE);
+    g_byte_array_free(job->out, TRUE);
+    g_free(job);
+  }
+}
+
+void xoj_writer_flush(XojWriter *w)
+{
+  if (w->buf->len == 0) return;
+  if (w->f == NULL && w->capture == NULL) return; // just collecting text
+  if (w->jobs != NULL) xoj_writer_submit(w);
+  else xoj_writer_deflate(w, Z_NO_FLUSH);
+}
+
+// close the current gzip member, if there is anything in it
+
+void xoj_writer_end_member(XojWriter *w)
+{
+  if (w->jobs != NULL) xoj_writer_submit(w);
+  else if (w->buf->len > 0 || w->in_member) xoj_writer_deflate(w, Z_FINISH);
+}
+
+// copy a gzip member saved earlier
+
+void xoj_writer_put_member(XojWriter *w, GByteArray *member)
+{
+  XojDeflateJob *job;
+  
+  xoj_writer_end_member(w);
+  if (w->jobs == NULL) {
+    xoj_writer_output(w, member->data, member->len);
+    return;
+  }
+  // it goes in line behind the blocks being compressed
+  job = g_new0(XojDeflateJob, 1);
+  job->out = g_byte_array_sized_new(member->len);
+  g_byte_array_append(job->out, member->data, member->len);
+  job->capture = w->capture;
+  job->ok = job->done = TRUE;
+  g_queue_push_tail(w->jobs, job);
+  xoj_writer_drain(w, w->max_jobs);
+}
+
+// keep a copy of the member written from now on, until xoj_writer_end_capture()
+// (with worker threads, the copy is only complete after xoj_writer_close())
+
+void xoj_writer_start_capture(XojWriter *w)
+{
+  xoj_writer_end_member(w);
+  w->capture = g_byte_array_new();
+}
+
+GByteArray *xoj_writer_end_capture(XojWriter *w)
+{
+  GByteArray *member;
+  
+  xoj_writer_end_member(w);
+  member = w->capture;
+  w->capture = NULL;
+  // don't keep anything that may be incomplete (with worker threads, the
+  // caller finds out from xoj_writer_close() instead)
+  if (!w->ok && w->jobs == NULL) {
+    g_byte_array_free(member, TRUE);
+    return NULL;
+  }
+  return member;
+}
+
+// finish writing: returns FALSE if anything went wrong along the way
+// (a writer without a file only produces captured members)
+
+gboolean xoj_writer_close(XojWriter *w)
+{
+  xoj_writer_end_member(w);
+  if (w->jobs != NULL) {
+    xoj_writer_drain(w, 0);
+    g_queue_free(w->jobs);
+    g_async_queue_unref(w->finished);
+  }
+  if (w->f != NULL && fclose(w->f) != 0) w->ok = FALSE;
+  g_string_free(w->buf, TRUE);
+  return w->ok;
+}
+
+// uncompress a sequence of complete gzip members, or return NULL
+// (straight into the string, which grows as needed)
+
+GString *gunzip_members(const guchar *data, gsize len)
+{
+  z_stream zs;
+  GString *text;
+  gsize used, room;
+  int ret;
+  
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  if (inflateInit2(&zs, 16+MAX_WBITS) != Z_OK) return NULL;
+  text = g_string_new(NULL);
+  g_string_set_size(text, 2*len + XOJ_WRITER_CHUNK); // a guess, XML compresses well
+  used = 0;
+  ret = Z_STREAM_END;
+  while (zs.avail_in > 0) {
+    if (used == text->len) g_string_set_size(text, 2*text->len);
+    room = MIN(text->len - used, G_MAXUINT);
+    zs.next_out = (Bytef *)text->str + used;
+    zs.avail_out = room;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    used += room - zs.avail_out;
+    if (ret == Z_STREAM_END) inflateReset(&zs); // on to the next member
+    else if (ret != Z_OK) break;
+  }
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END) { g_string_free(text, TRUE); return NULL; }
+  g_string_truncate(text, used);
+  return text;
+}
+
+/* read a whole .xoj file for parse_xoj_document(), without going through
+   gzread() in small pieces: an uncompressed file is just mapped in memory,
+   and a compressed one is inflated from its mapping in one go. The gzip
+   reader f is only used for the files that can't be mapped, or that
+   gunzip_members() rejects (truncated, or with garbage at the end) */
+
+gboolean read_xoj_file(const char *filename, gzFile f, XojInput *in)
+{
+  const guchar *data;
+  gsize len;
+  int n;
+  gboolean ok;
+
+  in->buf = NULL;
+  in->mapping = g_mapped_file_new(filename, FALSE, NULL);
+  if (in->mapping != NULL) {
+    data = (const guchar *)g_mapped_file_get_contents(in->mapping);
+    len = g_mapped_file_get_length(in->mapping);
+    if (len < 2 || data[0] != 0x1f || data[1] != 0x8b) { // no gzip header
+      in->text = (len > 0) ? (const gchar *)data : "";
+      in->len = len;
+      return TRUE;
+    }
+    in->buf = gunzip_members(data, len);
+    free_mapped_file(in->mapping);
+    in->mapping = NULL;
+    if (in->buf != NULL) {
+      in->text = in->buf->str;
+      in->len = in->buf->len;
+      return TRUE;
+    }
+  }
+  
+  in->buf = g_string_new(NULL);
+  ok = TRUE;
+  do {
+    len = in->buf->len;
+    g_string_set_size(in->buf, len + XOJ_READ_BLOCK);
+    n = gzread(f, in->buf->str + len, XOJ_READ_BLOCK);
+    if (n < 0) ok = FALSE;
+    g_string_truncate(in->buf, len + MAX(n, 0));
+  } while (n > 0);
+  in->text = in->buf->str;
+  in->len = in->buf->len;
+  return ok;
+}
+
+void free_xoj_input(XojInput *in)
+{
+  if (in->buf != NULL) g_string_free(in->buf, TRUE);
+  if (in->mapping != NULL) free_mapped_file(in->mapping);
+}
+
+void xoj_put_str(XojWriter *w, const char *s)
+{
+  g_string_append(w->buf, s);
+  if (w->buf->len >= XOJ_WRITER_BLOCK) xoj_writer_flush(w);
+}
+
+// same output as "%.2f" in the C locale; the rare values that sit too close
+// to a rounding tie (or are huge or not finite) go through g_ascii_formatd()
+
+void xoj_put_fixed2(XojWriter *w, double x)
+{
+  char tmp[G_ASCII_DTOSTR_BUF_SIZE], *p;
+  double r, frac;
+  guint64 m;
+  
+  r = fabs(x)*100;
+  if (!(r < 1e12)) {
+    xoj_put_str(w, g_ascii_formatd(tmp, sizeof(tmp), "%.2f", x));
+    return;
+  }
+  m = (guint64)r;
+  frac = r - m;
+  if (fabs(frac - 0.5) < 1e-3) {
+    xoj_put_str(w, g_ascii_formatd(tmp, sizeof(tmp), "%.2f", x));
+    return;
+  }
+  if (frac > 0.5) m++;
+  p = tmp + sizeof(tmp);
+  *(--p) = '0' + m%10; m /= 10;
+  *(--p) = '0' + m%10; m /= 10;
+  *(--p) = '.';
+  do { *(--p) = '0' + m%10; m /= 10; } while (m > 0);
+  if (signbit(x)) *(--p) = '-';
+  g_string_append_len(w->buf, p, tmp + sizeof(tmp) - p);
+  if (w->buf->len >= XOJ_WRITER_BLOCK) xoj_writer_flush(w);
+}
+
+// a list of values, each one preceded by a space
+
+void xoj_put_fixed2_list(XojWriter *w, const double *vals, int n)
+{
+  for (; n>0; n--, vals++) {
+    g_string_append_c(w->buf, ' ');
+    xoj_put_fixed2(w, *vals);
+  }
+}
+
+void xoj_put_color(XojWriter *w, int color_no, guint color_rgba, const char **names)
+{
+  if (color_no >= 0) xoj_put_str(w, names[color_no]);
+  else g_string_append_printf(w->buf, "#%08x", color_rgba);
+}
+
 // creates a new empty journal
 
 void new_journal(void)
 {
   journal.npages = 1;
   journal.pages = g_list_append(NULL, new_page(&ui.default_page));
+  invalidate_bgpdf_index();
   journal.last_attach_no = 0;
+  journal.lazy_source = NULL;
+  journal.lazy_pages = 0;
   ui.pageno = 0;
   ui.layerno = 0;
   ui.cur_page = (struct Page *) journal.pages->data;
@@ -104,201 +502,594 @@ void chk_attach_names(void)
 }
 
 /* Write image to file: returns true on success, false on error.
-   The image is written as a base64 encoded PNG. */
+   The image is written as a base64 encoded PNG, a block at a time
+   straight into the writer's buffer. */
+
+void write_image_png(XojWriter *w, const gchar *png, gsize png_len)
+{
+  gint state = 0, save = 0;
+  gsize pos, n, len;
+
+  for (pos = 0; pos < png_len; pos += n) {
+    n = MIN(XOJ_WRITER_BASE64, png_len - pos);
+    len = w->buf->len;
+    g_string_set_size(w->buf, len + (n/3+1)*4 + 4);
+    len += g_base64_encode_step((guchar *)png + pos, n, FALSE, 
+                                w->buf->str + len, &state, &save);
+    g_string_truncate(w->buf, len);
+    if (w->buf->len >= XOJ_WRITER_BLOCK) xoj_writer_flush(w);
+  }
+  len = w->buf->len;
+  g_string_set_size(w->buf, len + 4);
+  len += g_base64_encode_close(FALSE, w->buf->str + len, &state, &save);
+  g_string_truncate(w->buf, len);
+}
 
-gboolean write_image(gzFile f, Item *item)
+gboolean write_image(XojWriter *w, Item *item)
 {
-  gchar *base64_str;
+  if (!encode_image_png(item)) return FALSE;
+  write_image_png(w, item->image_png, item->image_png_len);
+  return TRUE;
+}
 
-  if (item->image_png == NULL) {
-    if (!gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL)) {
-      item->image_png_len = 0;       // failed for some reason, so forget it
-      return FALSE;
+/* Images shown by several items of the journal are saved only once, in an
+   <imagedata> tag ahead of the pages, and the <image> tags refer to it.
+   Returns the list of these images (StoredImages) and sets up the writer
+   to refer to them. As the saved copy of a layer (save_cache) depends on
+   which of its images are shared, the layers with an image that became
+   shared since the last save, or stopped being, lose theirs. */
+
+GList *setup_shared_images(XojWriter *w)
+{
+  GList *shared, *list, *pagelist, *layerlist, *itemlist;
+  GHashTable *changed;
+  struct Layer *layer;
+  struct Item *item;
+  StoredImage *img;
+  
+  shared = find_shared_images();
+  changed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  mark_shared_images(shared, changed);
+  if (g_hash_table_size(changed) > 0)
+    for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next)
+      for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL;
+           layerlist = layerlist->next) {
+        layer = (struct Layer *)layerlist->data;
+        for (itemlist = layer->items; itemlist!=NULL && layer->save_cache!=NULL;
+             itemlist = itemlist->next) {
+          item = (struct Item *)itemlist->data;
+          if (item->type == ITEM_IMAGE && 
+              g_hash_table_lookup(changed, stored_image(item->image_png)) != NULL)
+            invalidate_save_cache(layer);
+        }
+      }
+  g_hash_table_destroy(changed);
+  if (shared != NULL) {
+    w->shared_images = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (list = shared; list!=NULL; list = list->next) {
+      img = (StoredImage *)list->data;
+      g_hash_table_insert(w->shared_images, img->png, GINT_TO_POINTER(img->id));
     }
   }
+  return shared;
+}
 
-  base64_str = g_base64_encode(item->image_png, item->image_png_len);
-  gzputs(f, base64_str);
-  g_free(base64_str);
-  return TRUE;
+void save_shared_images(XojWriter *w, GList *shared)
+{
+  StoredImage *img;
+  
+  for ( ; shared!=NULL; shared = shared->next) {
+    img = (StoredImage *)shared->data;
+    g_string_append_printf(w->buf, "<imagedata id=\"%d\">", img->id);
+    write_image_png(w, img->png, img->png_len);
+    xoj_put_str(w, "</imagedata>\n");
+  }
 }
 
-// create pixbuf from base64 encoded PNG, or return NULL on failure
+/* get the PNG out of base64 encoded text, or return NULL if there is none;
+   decoding it into a pixbuf is left for later, see item_image() */
 
-GdkPixbuf *read_pixbuf(const gchar *base64_str, gsize base64_strlen)
+gchar *read_image_png(const gchar *base64_str, gsize base64_strlen, gsize *png_len)
 {
-  gchar *base64_str2;
   gchar *png_buf;
-  gsize png_buflen;
-  GdkPixbuf *pixbuf;
+  gint state = 0;
+  guint save = 0;
+
+  // decoded in place, no need for a null terminated copy of the text
+  png_buf = g_malloc(base64_strlen/4*3 + 3);
+  *png_len = g_base64_decode_step(base64_str, base64_strlen, (guchar *)png_buf, 
+                                  &state, &save);
+  if (*png_len == 0) { g_free(png_buf); return NULL; }
+  return png_buf;
+}
 
-  // We have to copy the string in order to null terminate it, sigh.
-  base64_str2 = g_memdup(base64_str, base64_strlen+1);
-  base64_str2[base64_strlen] = 0;
-  png_buf = g_base64_decode(base64_str2, &png_buflen);
+/* Hash and compare bitmaps by their contents, so that backgrounds that were
+   loaded or pasted twice can be saved as clones. Only the meaningful bytes of
+   each row count, not the rowstride padding. Pixbufs never change once
+   created, so the hash is computed once and kept on the pixbuf. */
 
-  pixbuf = pixbuf_from_buffer(png_buf, png_buflen);
+guint pixbuf_content_hash(gconstpointer key)
+{
+  GdkPixbuf *pixbuf = (GdkPixbuf *)key;
+  const guchar *row;
+  guint h;
+  int y, x, rowlen;
+
+  h = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(pixbuf), "xoj-content-hash"));
+  if (h != 0) return h;
+  rowlen = gdk_pixbuf_get_width(pixbuf) * gdk_pixbuf_get_n_channels(pixbuf)
+             * gdk_pixbuf_get_bits_per_sample(pixbuf) / 8;
+  h = 2166136261U; // FNV-1a
+  for (y = 0; y < gdk_pixbuf_get_height(pixbuf); y++) {
+    row = gdk_pixbuf_get_pixels(pixbuf) + y*gdk_pixbuf_get_rowstride(pixbuf);
+    for (x = 0; x < rowlen; x++) h = (h ^ row[x]) * 16777619U;
+  }
+  if (h == 0) h = 1;
+  g_object_set_data(G_OBJECT(pixbuf), "xoj-content-hash", GUINT_TO_POINTER(h));
+  return h;
+}
 
-  g_free(png_buf);
-  g_free(base64_str2);
-  return pixbuf;
+gboolean pixbuf_content_equal(gconstpointer a, gconstpointer b)
+{
+  GdkPixbuf *pa = (GdkPixbuf *)a, *pb = (GdkPixbuf *)b;
+  int y, rowlen;
+
+  if (pa == pb) return TRUE;
+  if (gdk_pixbuf_get_width(pa) != gdk_pixbuf_get_width(pb) ||
+      gdk_pixbuf_get_height(pa) != gdk_pixbuf_get_height(pb) ||
+      gdk_pixbuf_get_n_channels(pa) != gdk_pixbuf_get_n_channels(pb) ||
+      gdk_pixbuf_get_has_alpha(pa) != gdk_pixbuf_get_has_alpha(pb) ||
+      gdk_pixbuf_get_bits_per_sample(pa) != gdk_pixbuf_get_bits_per_sample(pb) ||
+      pixbuf_content_hash(pa) != pixbuf_content_hash(pb))
+    return FALSE;
+  rowlen = gdk_pixbuf_get_width(pa) * gdk_pixbuf_get_n_channels(pa)
+             * gdk_pixbuf_get_bits_per_sample(pa) / 8;
+  for (y = 0; y < gdk_pixbuf_get_height(pa); y++)
+    if (memcmp(gdk_pixbuf_get_pixels(pa) + y*gdk_pixbuf_get_rowstride(pa),
+               gdk_pixbuf_get_pixels(pb) + y*gdk_pixbuf_get_rowstride(pb), rowlen))
+      return FALSE;
+  return TRUE;
+}
+
+/* for each page, find an earlier page that its background can be saved as a
+   clone of: returns a newly allocated array giving its index, or -1.
+   A bitmap background is a clone if an earlier page shares its pixbuf and
+   file name, or (for attached bitmaps, whose file names are ours to choose)
+   has an attached bitmap with the same contents. Every PDF background after
+   the first one is a clone of it. */
+
+int *find_bg_clones(void)
+{
+  GHashTable *by_pixbuf, *by_contents;
+  GList *list;
+  struct Page *pg;
+  struct Background **bgs;
+  gpointer orig;
+  int *clones, i, first_pdf;
+
+  clones = g_new(int, journal.npages);
+  bgs = g_new(struct Background *, journal.npages);
+  by_pixbuf = g_hash_table_new(g_direct_hash, g_direct_equal);
+  by_contents = g_hash_table_new(pixbuf_content_hash, pixbuf_content_equal);
+  first_pdf = -1;
+  for (list = journal.pages, i = 0; list!=NULL; list = list->next, i++) {
+    pg = (struct Page *)list->data;
+    bgs[i] = pg->bg;
+    clones[i] = -1;
+    if (pg->bg->type == BG_PDF) {
+      if (first_pdf < 0) first_pdf = i;
+      else clones[i] = first_pdf;
+      continue;
+    }
+    if (pg->bg->type != BG_PIXMAP || pg->bg->pixbuf == NULL) continue;
+    // the index is stored plus one, so that page 0 isn't a NULL value
+    orig = g_hash_table_lookup(by_pixbuf, pg->bg->pixbuf);
+    if (orig != NULL) {
+      if (bgs[GPOINTER_TO_INT(orig)-1]->filename == pg->bg->filename) 
+        { clones[i] = GPOINTER_TO_INT(orig)-1; continue; }
+    }
+    else g_hash_table_insert(by_pixbuf, pg->bg->pixbuf, GINT_TO_POINTER(i+1));
+    if (pg->bg->file_domain != DOMAIN_ATTACH) continue;
+    orig = g_hash_table_lookup(by_contents, pg->bg->pixbuf);
+    if (orig != NULL) clones[i] = GPOINTER_TO_INT(orig)-1;
+    else g_hash_table_insert(by_contents, pg->bg->pixbuf, GINT_TO_POINTER(i+1));
+  }
+  g_hash_table_destroy(by_pixbuf);
+  g_hash_table_destroy(by_contents);
+  g_free(bgs);
+  return clones;
+}
+
+// write out the attached file of a bitmap or PDF background next to the journal
+
+/* Attachments written so far, by file name, so that saving again doesn't
+   rewrite the ones that haven't changed, and other copies can be made by
+   cloning or linking an earlier one. A PNG is identified by its pixbuf
+   (which the record keeps a reference to), the PDF by bgpdf.file_serial;
+   the size and time stamp of the file tell if it was touched since. */
+
+GHashTable *saved_attachments;
+
+void free_saved_attachment(gpointer data)
+{
+  SavedAttachment *att = (SavedAttachment *)data;
+  
+  if (att->pixbuf != NULL) g_object_unref(att->pixbuf);
+  g_free(att->path);
+  g_free(att);
+}
+
+void forget_saved_attachments(void)
+{
+  if (saved_attachments == NULL) return;
+  g_hash_table_destroy(saved_attachments);
+  saved_attachments = NULL;
+}
+
+void remember_saved_attachment(const char *path, struct Background *bg)
+{
+  SavedAttachment *att;
+  struct stat st;
+  
+  if (saved_attachments == NULL)
+    saved_attachments = g_hash_table_new_full(g_str_hash, g_str_equal,
+                           NULL, free_saved_attachment);
+  if (g_stat(path, &st) != 0) {
+    g_hash_table_remove(saved_attachments, path);
+    return;
+  }
+  att = g_new(SavedAttachment, 1);
+  att->path = g_strdup(path);
+  att->pixbuf = NULL;
+  att->pdf_serial = -1;
+  if (bg->type == BG_PIXMAP) att->pixbuf = g_object_ref(bg->pixbuf);
+  else att->pdf_serial = bgpdf.file_serial;
+  att->size = st.st_size;
+  att->mtime = st.st_mtime;
+  g_hash_table_replace(saved_attachments, att->path, att);
+}
+
+// is this a file we wrote for this background, and left untouched since?
+
+gboolean saved_attachment_matches(SavedAttachment *att, struct Background *bg)
+{
+  struct stat st;
+  
+  if (bg->type == BG_PIXMAP && att->pixbuf != bg->pixbuf) return FALSE;
+  if (bg->type == BG_PDF && (att->pixbuf != NULL || att->pdf_serial != bgpdf.file_serial))
+    return FALSE;
+  if (g_stat(att->path, &st) != 0) return FALSE;
+  return (st.st_size == att->size && st.st_mtime == att->mtime);
+}
+
+gboolean saved_attachment_find_func(gpointer key, gpointer value, gpointer data)
+{
+  return saved_attachment_matches((SavedAttachment *)value, (struct Background *)data);
+}
+
+/* make dst a copy of src: a reflink where the filesystem supports it,
+   which shares the data until either file is modified, otherwise a plain
+   copy (not a hard link, as then editing one attachment in place would
+   change the other). Still cheaper than encoding the background again. */
+
+gboolean clone_or_copy_file(const char *src, const char *dst)
+{
+  FILE *in, *out;
+  char buf[XOJ_WRITER_CHUNK];
+  size_t n;
+  gboolean ok;
+#if !defined(WIN32) && defined(FICLONE)
+  int fdin, fdout;
+
+  ok = FALSE;
+  fdin = open(src, O_RDONLY);
+  if (fdin >= 0) {
+    fdout = open(dst, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fdout >= 0) {
+      ok = (ioctl(fdout, FICLONE, fdin) == 0);
+      close(fdout);
+      if (!ok) unlink(dst);
+    }
+    close(fdin);
+  }
+  if (ok) return TRUE;
+#endif
+
+  in = g_fopen(src, "rb");
+  if (in == NULL) return FALSE;
+  out = g_fopen(dst, "wb");
+  if (out == NULL) { fclose(in); return FALSE; }
+  ok = TRUE;
+  while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = (fwrite(buf, 1, n, out) == n);
+  if (ferror(in)) ok = FALSE;
+  fclose(in);
+  if (fclose(out) != 0) ok = FALSE;
+  if (!ok) g_unlink(dst);
+  return ok;
+}
+
+void save_bg_attachment(struct Background *bg, const char *filename, gboolean is_auto)
+{
+  char *tmpfn;
+  gboolean success;
+  FILE *tmpf;
+  GtkWidget *dialog;
+  SavedAttachment *att;
+
+  tmpfn = g_strdup_printf("%s.%s", filename, bg->filename->s);
+  success = FALSE;
+  if (bg->type == BG_PDF && bgpdf_is_mapped_file(tmpfn))
+    success = TRUE; // already there, and rewriting it would pull it from under us
+  else if (bg->type == BG_PIXMAP || 
+           (bgpdf.status != STATUS_NOT_INIT && bgpdf.file_contents != NULL))
+  {
+    if (is_auto)
+      ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
+    att = NULL;
+    if (saved_attachments != NULL)
+      att = (SavedAttachment *)g_hash_table_lookup(saved_attachments, tmpfn);
+    if (att != NULL && saved_attachment_matches(att, bg)) 
+      success = TRUE; // unchanged since we last wrote it
+    else {
+      g_unlink(tmpfn); // in case it's a reflink to another copy
+      att = NULL;
+      if (saved_attachments != NULL)
+        att = (SavedAttachment *)g_hash_table_find(saved_attachments, 
+                                    saved_attachment_find_func, bg);
+      if (att != NULL && clone_or_copy_file(att->path, tmpfn)) 
+        success = TRUE;
+      else if (bg->type == BG_PIXMAP)
+        success = gdk_pixbuf_save(bg->pixbuf, tmpfn, "png", NULL, NULL);
+      else {
+        tmpf = g_fopen(tmpfn, "wb");
+        if (tmpf != NULL && fwrite(bgpdf.file_contents, 1, bgpdf.file_length, tmpf) == bgpdf.file_length)
+          success = TRUE;
+        if (tmpf != NULL && fclose(tmpf) != 0) success = FALSE;
+      }
+      if (success) remember_saved_attachment(tmpfn, bg);
+      else if (saved_attachments != NULL) 
+        g_hash_table_remove(saved_attachments, tmpfn);
+    }
+  }
+  if (!success && !is_auto) {
+    dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+      GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
+      _("Could not write background '%s'. Continuing anyway."), tmpfn);
+    wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+  }
+  g_free(tmpfn);
+}
+
+// write out a layer in the XML format
+
+void save_layer(XojWriter *w, struct Layer *layer)
+{
+  struct Item *item;
+  GList *itemlist;
+  char *tmpstr;
+  int image_id;
+  
+  xoj_put_str(w, "<layer>\n");
+  for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
+    item = (struct Item *)itemlist->data;
+    if (item->type == ITEM_STROKE) {
+      xoj_put_str(w, "<stroke tool=\"");
+      xoj_put_str(w, tool_names[item->brush.tool_type]);
+      xoj_put_str(w, "\" color=\"");
+      xoj_put_color(w, item->brush.color_no, item->brush.color_rgba, color_names);
+      xoj_put_str(w, "\" width=\"");
+      xoj_put_fixed2(w, item->brush.thickness);
+      if (item->brush.variable_width)
+        xoj_put_fixed2_list(w, item->widths, item->path->num_points-1);
+      xoj_put_str(w, "\">\n");
+      xoj_put_fixed2(w, item->path->coords[0]);
+      xoj_put_fixed2_list(w, item->path->coords+1, 2*item->path->num_points-1);
+      xoj_put_str(w, " \n</stroke>\n");
+    }
+    if (item->type == ITEM_TEXT) {
+      tmpstr = g_markup_escape_text(item->font_name, -1);
+      xoj_put_str(w, "<text font=\"");
+      xoj_put_str(w, tmpstr);
+      g_free(tmpstr);
+      xoj_put_str(w, "\" size=\"");
+      xoj_put_fixed2(w, item->font_size);
+      xoj_put_str(w, "\" x=\"");
+      xoj_put_fixed2(w, item->bbox.left);
+      xoj_put_str(w, "\" y=\"");
+      xoj_put_fixed2(w, item->bbox.top);
+      xoj_put_str(w, "\" color=\"");
+      xoj_put_color(w, item->brush.color_no, item->brush.color_rgba, color_names);
+      xoj_put_str(w, "\">");
+      tmpstr = g_markup_escape_text(item->text, -1);
+      xoj_put_str(w, tmpstr);
+      g_free(tmpstr);
+      xoj_put_str(w, "</text>\n");
+    }
+    if (item->type == ITEM_IMAGE) {
+      xoj_put_str(w, "<image left=\"");
+      xoj_put_fixed2(w, item->bbox.left);
+      xoj_put_str(w, "\" top=\"");
+      xoj_put_fixed2(w, item->bbox.top);
+      xoj_put_str(w, "\" right=\"");
+      xoj_put_fixed2(w, item->bbox.right);
+      xoj_put_str(w, "\" bottom=\"");
+      xoj_put_fixed2(w, item->bbox.bottom);
+      image_id = 0;
+      if (w->shared_images != NULL && item->image_png != NULL)
+        image_id = GPOINTER_TO_INT(g_hash_table_lookup(w->shared_images, item->image_png));
+      if (image_id > 0) {
+        g_string_append_printf(w->buf, "\" ref=\"%d\"/>\n", image_id);
+        continue;
+      }
+      xoj_put_str(w, "\">");
+      if (!write_image(w, item)) w->ok = FALSE; // the save fails, not just the image
+      xoj_put_str(w, "</image>\n");
+    }
+  }
+  xoj_put_str(w, "</layer>\n");
+}
+
+// is the layer worth a gzip member of its own, kept in its save_cache? 
+// Smaller layers compress much better along with the text around them,
+// and take little time to save again. A rough guess of the XML size will do
+
+gboolean layer_saved_alone(struct Layer *layer)
+{
+  struct Item *item;
+  GList *itemlist;
+  gsize size;
+  
+  size = 0;
+  for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
+    item = (struct Item *)itemlist->data;
+    size += 100;
+    if (item->type == ITEM_STROKE) 
+      size += (item->brush.variable_width ? 21 : 14) * item->path->num_points;
+    if (item->type == ITEM_TEXT && item->text != NULL) size += strlen(item->text);
+    if (item->type == ITEM_IMAGE) {
+      if (item->image_png == NULL) return TRUE; // not even encoded yet
+      size += 4*item->image_png_len/3;
+    }
+    if (size >= XOJ_LAYER_MEMBER_MIN) return TRUE;
+  }
+  return FALSE;
+}
+
+// write out the <page> and <background> tags of a page
+
+void save_page_head(XojWriter *w, struct Page *pg, int clone_of, 
+                    const char *filename, gboolean is_auto)
+{
+  char *tmpstr;
+  
+  xoj_put_str(w, "<page width=\"");
+  xoj_put_fixed2(w, pg->width);
+  xoj_put_str(w, "\" height=\"");
+  xoj_put_fixed2(w, pg->height);
+  xoj_put_str(w, "\">\n<background type=\"");
+  xoj_put_str(w, bgtype_names[pg->bg->type]);
+  xoj_put_str(w, "\" ");
+  if (pg->bg->type == BG_SOLID) {
+    xoj_put_str(w, "color=\"");
+    xoj_put_color(w, pg->bg->color_no, pg->bg->color_rgba, bgcolor_names);
+    xoj_put_str(w, "\" style=\"");
+    xoj_put_str(w, bgstyle_names[pg->bg->ruling]);
+    xoj_put_str(w, "\" ");
+  }
+  else if (pg->bg->type == BG_PIXMAP) {
+    if (clone_of >= 0)
+      g_string_append_printf(w->buf, "domain=\"clone\" filename=\"%d\" ", clone_of);
+    else {
+      if (pg->bg->file_domain == DOMAIN_ATTACH)
+        save_bg_attachment(pg->bg, filename, is_auto);
+      tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
+      g_string_append_printf(w->buf, "domain=\"%s\" filename=\"%s\" ", 
+        file_domain_names[pg->bg->file_domain], tmpstr);
+      g_free(tmpstr);
+    }
+  }
+  else if (pg->bg->type == BG_PDF) {
+    if (clone_of < 0) {
+      if (pg->bg->file_domain == DOMAIN_ATTACH)
+        save_bg_attachment(pg->bg, filename, is_auto);
+      tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
+      g_string_append_printf(w->buf, "domain=\"%s\" filename=\"%s\" ", 
+        file_domain_names[pg->bg->file_domain], tmpstr);
+      g_free(tmpstr);
+    }
+    g_string_append_printf(w->buf, "pageno=\"%d\" ", pg->bg->file_page_seq);
+  }
+  xoj_put_str(w, "/>\n");
 }
 
 // saves the journal to a file: returns true on success, false on error
 
 gboolean save_journal(const char *filename, gboolean is_auto)
 {
-  gzFile f;
-  struct Page *pg, *tmppg;
+  FILE *f;
+  XojWriter w;
+  struct Page *pg;
   struct Layer *layer;
-  struct Item *item;
-  int i, is_clone;
-  char *tmpfn, *tmpstr;
   gboolean success;
-  FILE *tmpf;
-  GList *pagelist, *layerlist, *itemlist, *list;
-  GtkWidget *dialog;
+  GList *pagelist, *layerlist, *shared;
+  int *clones, i;
+#ifdef PERF_DEBUG
+  GTimer *timer;
+  double elapsed;
+  int nreused = 0;
+#endif
   
-  f = gzopen_wrapper(filename, "wb");
+  // pages not read yet get copied as they are; an auto-save has to keep
+  // them that way too, or it would load the whole journal
+  if (g_str_has_suffix(filename, ".xojb") || (is_auto && journal.lazy_pages > 0))
+    return save_binary_journal(filename, is_auto);
+  load_all_pages();
+
+#ifdef PERF_DEBUG
+  timer = g_timer_new();
+#endif
+  // the layer caches are about to change behind the auto-save log's back
+  if (!is_auto) autosave_forget_snapshot();
+  f = g_fopen(filename, "wb");
   if (f==NULL) return FALSE;
   chk_attach_names();
   if (is_auto)
     ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(filename));
 
-  setlocale(LC_NUMERIC, "C");
-  
-  gzprintf(f, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+  xoj_writer_init(&w, f);
+  if (is_auto) w.level = ui.autosave_compression_level;
+  shared = setup_shared_images(&w);
+  xoj_put_str(&w, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
      "<xournal version=\"" VERSION "\">\n"
      "<title>Xournal document - see http://math.mit.edu/~auroux/software/xournal/</title>\n");
-  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
+  save_shared_images(&w, shared);
+  g_list_free(shared);
+  clones = find_bg_clones();
+  for (pagelist = journal.pages, i = 0; pagelist!=NULL; pagelist = pagelist->next, i++) {
     pg = (struct Page *)pagelist->data;
-    gzprintf(f, "<page width=\"%.2f\" height=\"%.2f\">\n", pg->width, pg->height);
-    gzprintf(f, "<background type=\"%s\" ", bgtype_names[pg->bg->type]); 
-    if (pg->bg->type == BG_SOLID) {
-      gzputs(f, "color=\"");
-      if (pg->bg->color_no >= 0) gzputs(f, bgcolor_names[pg->bg->color_no]);
-      else gzprintf(f, "#%08x", pg->bg->color_rgba);
-      gzprintf(f, "\" style=\"%s\" ", bgstyle_names[pg->bg->ruling]);
-    }
-    else if (pg->bg->type == BG_PIXMAP) {
-      is_clone = -1;
-      for (list = journal.pages, i = 0; list!=pagelist; list = list->next, i++) {
-        tmppg = (struct Page *)list->data;
-        if (tmppg->bg->type == BG_PIXMAP && 
-            tmppg->bg->pixbuf == pg->bg->pixbuf &&
-            tmppg->bg->filename == pg->bg->filename)
-          { is_clone = i; break; }
-      }
-      if (is_clone >= 0)
-        gzprintf(f, "domain=\"clone\" filename=\"%d\" ", is_clone);
-      else {
-        if (pg->bg->file_domain == DOMAIN_ATTACH) {
-          tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
-          if (is_auto)
-            ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
-          if (!gdk_pixbuf_save(pg->bg->pixbuf, tmpfn, "png", NULL, NULL) && !is_auto) {
-            dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-              GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
-              _("Could not write background '%s'. Continuing anyway."), tmpfn);
-            wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
-          }
-          g_free(tmpfn);
-        }
-        tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
-        gzprintf(f, "domain=\"%s\" filename=\"%s\" ", 
-          file_domain_names[pg->bg->file_domain], tmpstr);
-        g_free(tmpstr);
-      }
-    }
-    else if (pg->bg->type == BG_PDF) {
-      is_clone = 0;
-      for (list = journal.pages; list!=pagelist; list = list->next) {
-        tmppg = (struct Page *)list->data;
-        if (tmppg->bg->type == BG_PDF) { is_clone = 1; break; }
-      }
-      if (!is_clone) {
-        if (pg->bg->file_domain == DOMAIN_ATTACH) {
-          tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
-          success = FALSE;
-          if (bgpdf.status != STATUS_NOT_INIT && bgpdf.file_contents != NULL)
-          {
-            tmpf = g_fopen(tmpfn, "wb");
-            if (is_auto)
-              ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
-            if (tmpf != NULL && fwrite(bgpdf.file_contents, 1, bgpdf.file_length, tmpf) == bgpdf.file_length)
-              success = TRUE;
-            fclose(tmpf);
-          }
-          if (!success && !is_auto) {
-            dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-              GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
-              _("Could not write background '%s'. Continuing anyway."), tmpfn);
-            wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
-          }
-          g_free(tmpfn);
-        }
-        tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
-        gzprintf(f, "domain=\"%s\" filename=\"%s\" ", 
-          file_domain_names[pg->bg->file_domain], tmpstr);
-        g_free(tmpstr);
-      }
-      gzprintf(f, "pageno=\"%d\" ", pg->bg->file_page_seq);
-    }
-    gzprintf(f, "/>\n");
+    save_page_head(&w, pg, clones[i], filename, is_auto);
     for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
       layer = (struct Layer *)layerlist->data;
-      gzprintf(f, "<layer>\n");
-      for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
-        item = (struct Item *)itemlist->data;
-        if (item->type == ITEM_STROKE) {
-          gzprintf(f, "<stroke tool=\"%s\" color=\"", 
-                          tool_names[item->brush.tool_type]);
-          if (item->brush.color_no >= 0)
-            gzputs(f, color_names[item->brush.color_no]);
-          else
-            gzprintf(f, "#%08x", item->brush.color_rgba);
-          gzprintf(f, "\" width=\"%.2f", item->brush.thickness);
-          if (item->brush.variable_width)
-            for (i=0;i<item->path->num_points-1;i++)
-              gzprintf(f, " %.2f", item->widths[i]);
-          gzprintf(f, "\">\n");
-          for (i=0;i<2*item->path->num_points;i++)
-            gzprintf(f, "%.2f ", item->path->coords[i]);
-          gzprintf(f, "\n</stroke>\n");
-        }
-        if (item->type == ITEM_TEXT) {
-          tmpstr = g_markup_escape_text(item->font_name, -1);
-          gzprintf(f, "<text font=\"%s\" size=\"%.2f\" x=\"%.2f\" y=\"%.2f\" color=\"",
-            tmpstr, item->font_size, item->bbox.left, item->bbox.top);
-          g_free(tmpstr);
-          if (item->brush.color_no >= 0)
-            gzputs(f, color_names[item->brush.color_no]);
-          else
-            gzprintf(f, "#%08x", item->brush.color_rgba);
-          tmpstr = g_markup_escape_text(item->text, -1);
-          gzputs(f, "\">");
-          gzputs(f, tmpstr); // gzprintf() can't handle > 4095 bytes
-          gzputs(f, "</text>\n");
-          g_free(tmpstr);
-        }
-        if (item->type == ITEM_IMAGE) {
-          gzprintf(f, "<image left=\"%.2f\" top=\"%.2f\" right=\"%.2f\" bottom=\"%.2f\">", 
-            item->bbox.left, item->bbox.top, item->bbox.right, item->bbox.bottom);
-          if (!write_image(f, item)) success = FALSE;
-          gzprintf(f, "</image>\n");
-        }
+      // don't let a quickly compressed auto-save make the file bigger
+      if (!is_auto && layer->save_cache != NULL && layer->save_cache_level < w.level)
+        invalidate_save_cache(layer);
+      if (layer->save_cache != NULL) {
+        xoj_writer_put_member(&w, layer->save_cache);
+#ifdef PERF_DEBUG
+        nreused++;
+#endif
       }
-      gzprintf(f, "</layer>\n");
+      else if (layer_saved_alone(layer)) { // save it, and keep a copy
+        xoj_writer_start_capture(&w);
+        save_layer(&w, layer);
+        layer->save_cache = xoj_writer_end_capture(&w);
+        layer->save_cache_level = w.level;
+      }
+      else save_layer(&w, layer); // in the same member as the text around it
+      layer->dirty = FALSE;
     }
-    gzprintf(f, "</page>\n");
+    xoj_put_str(&w, "</page>\n");
   }
-  gzprintf(f, "</xournal>\n");
-  gzclose(f);
-  setlocale(LC_NUMERIC, "");
+  g_free(clones);
+  xoj_put_str(&w, "</xournal>\n");
+  success = xoj_writer_close(&w);
+  if (w.shared_images != NULL) g_hash_table_destroy(w.shared_images);
+  if (!success) // the copies of the layers may be incomplete
+    for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next)
+      for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL; 
+           layerlist = layerlist->next)
+        invalidate_save_cache((struct Layer *)layerlist->data);
+#ifdef PERF_DEBUG
+  elapsed = g_timer_elapsed(timer, NULL);
+  printf("DEBUG: saved %d pages as XML in %.1f ms (%.1f MB, %.1f MB/s), "
+         "%d layers reused\n", journal.npages, elapsed*1000, w.total/1e6, 
+         elapsed>0 ? w.total/1e6/elapsed : 0., nreused);
+  g_timer_destroy(timer);
+#endif
 
-  return TRUE;
+  return success;
 }
 
 // autosave stuff
@@ -341,29 +1132,373 @@ gboolean autosave_cb(gpointer is_catchup)
     return TRUE; // can't do it right now, come back later
   }
   
-  // generate an autosave filename
-  base_filename = candidate_save_filename();
-  for (num=0; num<=AUTOSAVE_MAX; num++) {
-    test_filename = g_strdup_printf(AUTOSAVE_FILENAME_TEMPLATE, base_filename, num);
-    if (!g_file_test(test_filename, G_FILE_TEST_EXISTS)) break;
-    g_free(test_filename);
+  if (ui.autosave_running) return TRUE; // still writing the previous one
+  
+  // usually, just log the pages that changed since the last auto-save
+  if (autosave_append_log()) {
+    ui.need_autosave = FALSE;
+    return TRUE;
+  }
+  
+  // generate an autosave filename
+  base_filename = candidate_save_filename();
+  for (num=0; num<=AUTOSAVE_MAX; num++) {
+    test_filename = g_strdup_printf(AUTOSAVE_FILENAME_TEMPLATE, base_filename, num);
+    if (!g_file_test(test_filename, G_FILE_TEST_EXISTS)) break;
+    g_free(test_filename);
+  }
+  g_free(base_filename);
+  if (num > AUTOSAVE_MAX) // we ran out of autosave file names... try at the next loop iteration
+    return TRUE;
+  // keep track of old save filenames
+  old_filenames = ui.autosave_filename_list;
+  ui.autosave_filename_list = NULL;
+  if (ui.autosave_threaded && autosave_start_thread(test_filename, old_filenames)) {
+    ui.need_autosave = FALSE; // the rest happens in autosave_thread_done()
+  }
+  else if (save_journal(test_filename, TRUE)) { // non-interactive save -> success
+    ui.need_autosave = FALSE; // no longer need an auto-save
+    autosave_cleanup(&old_filenames);
+    if (is_binary_journal(test_filename)) 
+      autosave_forget_snapshot(); // the log only replays onto .xoj snapshots
+    else autosave_start_log(test_filename);
+  } else { // aborted
+    autosave_cleanup(&ui.autosave_filename_list); 
+    ui.autosave_filename_list = old_filenames;
+    autosave_forget_snapshot();
+  }
+  g_free(test_filename);
+  
+  return TRUE; // continue with the timed loop, if we're in it
+}
+
+/* Between full auto-saves, the pages whose layers changed are appended to
+   a log next to the last full auto-save (the snapshot), so that the cost
+   of an auto-save depends on the amount of editing rather than on the size
+   of the journal. Each record is a line "page <index> <npages> <size>"
+   followed by <size> bytes of gzip members holding the page as XML (with a
+   dummy background); the layers that haven't changed are copied from their
+   save_cache, if they have one (see layer_saved_alone()). Anything that changes the pages or their layout (new pages,
+   backgrounds, layers...) calls for a new snapshot instead. */
+
+// the pages, their size and background, and their layers, for comparison;
+// by serial number, as a freed page's address may be reused by a new one
+
+GByteArray *journal_structure(void)
+{
+  GByteArray *s;
+  GList *pagelist, *layerlist, *shared, *list;
+  struct Page *pg;
+  
+  s = g_byte_array_new();
+  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
+    pg = (struct Page *)pagelist->data;
+    g_byte_array_append(s, (guint8 *)&pg->serial, sizeof(pg->serial));
+    g_byte_array_append(s, (guint8 *)&pg->width, sizeof(pg->width));
+    g_byte_array_append(s, (guint8 *)&pg->height, sizeof(pg->height));
+    g_byte_array_append(s, (guint8 *)&pg->bg->serial, sizeof(pg->bg->serial));
+    g_byte_array_append(s, (guint8 *)&pg->bg->type, sizeof(pg->bg->type));
+    g_byte_array_append(s, (guint8 *)&pg->bg->color_rgba, sizeof(pg->bg->color_rgba));
+    g_byte_array_append(s, (guint8 *)&pg->bg->ruling, sizeof(pg->bg->ruling));
+    g_byte_array_append(s, (guint8 *)&pg->bg->file_page_seq, sizeof(pg->bg->file_page_seq));
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+      g_byte_array_append(s, (guint8 *)&((struct Layer *)layerlist->data)->serial, 
+                          sizeof(int));
+  }
+  // the log can't refer to images that weren't shared in the snapshot
+  shared = find_shared_images();
+  for (list = shared; list!=NULL; list = list->next)
+    g_byte_array_append(s, (guint8 *)&((StoredImage *)list->data)->id, sizeof(int));
+  g_list_free(shared);
+  return s;
+}
+
+/* Auto-saving in a worker thread (autosave_threaded option): the main
+   thread only takes a snapshot of the journal, made of the XML for the
+   page headers, the compressed layers from save_cache, and private copies
+   of the layers that changed; the worker thread does the formatting and
+   compression, and writes the file. */
+
+GThreadPool *autosave_pool;
+
+void autosave_job_add_text(AutosaveJob *job, XojWriter *tw)
+{
+  AutosavePart *part;
+  
+  if (tw->buf->len == 0) return;
+  part = g_new0(AutosavePart, 1);
+  part->text = g_string_new_len(tw->buf->str, tw->buf->len);
+  g_string_truncate(tw->buf, 0);
+  job->parts = g_list_prepend(job->parts, part);
+}
+
+// returns FALSE if the auto-save should be done the usual way instead
+
+gboolean autosave_start_thread(const char *filename, GList *old_filenames)
+{
+  AutosaveJob *job;
+  AutosavePart *part;
+  XojWriter tw;
+  FILE *f;
+  GList *pagelist, *layerlist, *shared;
+  struct Layer *layer;
+  int *clones, i;
+#ifdef PERF_DEBUG
+  GTimer *timer;
+  int ncopied = 0;
+  
+  timer = g_timer_new();
+#endif
+
+  if (!g_thread_supported()) return FALSE;
+  if (autosave_pool == NULL)
+    autosave_pool = g_thread_pool_new(autosave_thread, NULL, 1, FALSE, NULL);
+  if (autosave_pool == NULL) return FALSE;
+  if (journal.lazy_pages > 0) return FALSE; // leave it to save_binary_journal()
+  f = g_fopen(filename, "wb");
+  if (f == NULL) return FALSE;
+  chk_attach_names();
+  ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(filename));
+
+  job = g_new0(AutosaveJob, 1);
+  job->f = f;
+  job->filename = g_strdup(filename);
+  job->old_filenames = old_filenames;
+  job->generation = ui.autosave_generation;
+  xoj_writer_init(&tw, NULL); // only collects the text, see xoj_writer_flush()
+  shared = setup_shared_images(&tw);
+  job->shared_images = tw.shared_images; // for the layers saved by the thread
+  xoj_put_str(&tw, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+     "<xournal version=\"" VERSION "\">\n"
+     "<title>Xournal document - see http://math.mit.edu/~auroux/software/xournal/</title>\n");
+  save_shared_images(&tw, shared);
+  g_list_free(shared);
+  clones = find_bg_clones();
+  for (pagelist = journal.pages, i = 0; pagelist!=NULL; pagelist = pagelist->next, i++) {
+    save_page_head(&tw, (struct Page *)pagelist->data, clones[i], filename, TRUE);
+    for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL;
+         layerlist = layerlist->next) {
+      layer = (struct Layer *)layerlist->data;
+      autosave_job_add_text(job, &tw);
+      part = g_new0(AutosavePart, 1);
+      if (layer->save_cache != NULL) {
+#if GLIB_CHECK_VERSION(2,22,0)
+        part->member = g_byte_array_ref(layer->save_cache);
+#else
+        part->member = g_byte_array_sized_new(layer->save_cache->len);
+        g_byte_array_append(part->member, layer->save_cache->data, 
+                            layer->save_cache->len);
+#endif
+      }
+      else {
+        part->layer = copy_layer_for_save(layer);
+#ifdef PERF_DEBUG
+        ncopied++;
+#endif
+      }
+      job->parts = g_list_prepend(job->parts, part);
+    }
+    xoj_put_str(&tw, "</page>\n");
+  }
+  g_free(clones);
+  xoj_put_str(&tw, "</xournal>\n");
+  autosave_job_add_text(job, &tw);
+  g_string_free(tw.buf, TRUE);
+  job->parts = g_list_reverse(job->parts);
+  job->structure = journal_structure();
+  
+  ui.autosave_running = TRUE;
+  g_thread_pool_push(autosave_pool, job, NULL);
+#ifdef PERF_DEBUG
+  printf("DEBUG: auto-save snapshot of %d pages (%d layers copied) took %.2f ms\n",
+         journal.npages, ncopied, g_timer_elapsed(timer, NULL)*1000);
+  g_timer_destroy(timer);
+#endif
+  return TRUE;
+}
+
+void autosave_thread(gpointer data, gpointer user_data)
+{
+  AutosaveJob *job = (AutosaveJob *)data;
+  AutosavePart *part;
+  XojWriter w;
+  GList *list;
+  
+  xoj_writer_init(&w, job->f);
+  w.level = ui.autosave_compression_level;
+  w.shared_images = job->shared_images;
+  for (list = job->parts; list!=NULL; list = list->next) {
+    part = (AutosavePart *)list->data;
+    if (part->text != NULL) xoj_put_str(&w, part->text->str);
+    else if (part->member != NULL) xoj_writer_put_member(&w, part->member);
+    else save_layer(&w, part->layer);
+  }
+  job->ok = xoj_writer_close(&w);
+  g_idle_add(autosave_thread_done, job);
+}
+
+// back in the main thread
+
+gboolean autosave_thread_done(gpointer data)
+{
+  AutosaveJob *job = (AutosaveJob *)data;
+  AutosavePart *part;
+  
+  ui.autosave_running = FALSE;
+  if (job->generation != ui.autosave_generation) {
+    // the journal was saved or closed meanwhile: this one is obsolete
+    if (!job->ok) g_unlink(job->filename);
+    autosave_cleanup(&job->old_filenames);
+  }
+  else if (job->ok) {
+    autosave_cleanup(&job->old_filenames);
+    autosave_start_log(job->filename);
+    // the log goes on from the journal as it was in the snapshot
+    g_byte_array_free(ui.autosave_structure, TRUE);
+    ui.autosave_structure = job->structure;
+    job->structure = NULL;
+  }
+  else {
+    autosave_cleanup(&ui.autosave_filename_list); 
+    ui.autosave_filename_list = job->old_filenames;
+    ui.need_autosave = TRUE;
+  }
+  
+  while (job->parts != NULL) {
+    part = (AutosavePart *)job->parts->data;
+    if (part->text != NULL) g_string_free(part->text, TRUE);
+    free_save_cache(part->member);
+    if (part->layer != NULL) delete_layer(part->layer);
+    g_free(part);
+    job->parts = g_list_delete_link(job->parts, job->parts);
+  }
+  if (job->structure != NULL) g_byte_array_free(job->structure, TRUE);
+  if (job->shared_images != NULL) g_hash_table_destroy(job->shared_images);
+  g_free(job->filename);
+  g_free(job);
+  return FALSE;
+}
+
+// a full auto-save was just written: further changes go to its log
+
+void autosave_start_log(const char *snapshot)
+{
+  autosave_forget_snapshot();
+  ui.autosave_snapshot = g_strdup(snapshot);
+  ui.autosave_structure = journal_structure();
+  ui.autosave_log_size = 0;
+  // gets deleted along with the snapshot
+  ui.autosave_filename_list = g_list_append(ui.autosave_filename_list,
+      g_strconcat(snapshot, AUTOSAVE_LOG_SUFFIX, NULL));
+}
+
+void autosave_forget_snapshot(void)
+{
+  ui.autosave_generation++; // also makes an auto-save in progress obsolete
+  g_free(ui.autosave_snapshot);
+  ui.autosave_snapshot = NULL;
+  if (ui.autosave_structure != NULL) 
+    g_byte_array_free(ui.autosave_structure, TRUE);
+  ui.autosave_structure = NULL;
+}
+
+// returns FALSE if a full auto-save is needed instead
+
+gboolean autosave_append_log(void)
+{
+  XojWriter w;
+  GByteArray *structure, *record;
+  GList *pagelist, *layerlist;
+  struct Page *pg;
+  struct Layer *layer;
+  gchar *logname, *header;
+  FILE *f;
+  gboolean dirty;
+  guint start;
+  int pageno;
+#ifdef PERF_DEBUG
+  GTimer *timer;
+  int nrecords = 0;
+  gsize oldsize = ui.autosave_log_size;
+  
+  timer = g_timer_new();
+#endif
+
+  if (ui.autosave_snapshot == NULL || 
+      ui.autosave_log_size > AUTOSAVE_LOG_MAX_SIZE ||
+      g_list_find_custom(ui.autosave_filename_list, ui.autosave_snapshot,
+                         (GCompareFunc)strcmp) == NULL) 
+    return FALSE;
+  structure = journal_structure();
+  if (structure->len != ui.autosave_structure->len ||
+      memcmp(structure->data, ui.autosave_structure->data, structure->len)) {
+    g_byte_array_free(structure, TRUE);
+    return FALSE;
+  }
+  g_byte_array_free(structure, TRUE);
+  
+  logname = g_strconcat(ui.autosave_snapshot, AUTOSAVE_LOG_SUFFIX, NULL);
+  f = g_fopen(logname, "ab");
+  g_free(logname);
+  if (f == NULL) return FALSE;
+  xoj_writer_init(&w, NULL);
+  w.level = ui.autosave_compression_level;
+  // same shared images as in the snapshot, the structure says so
+  g_list_free(setup_shared_images(&w));
+  for (pagelist = journal.pages, pageno = 0; pagelist!=NULL; 
+       pagelist = pagelist->next, pageno++) {
+    pg = (struct Page *)pagelist->data;
+    dirty = FALSE;
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+      if (((struct Layer *)layerlist->data)->dirty) dirty = TRUE;
+    if (!dirty) continue;
+    xoj_writer_start_capture(&w);
+    xoj_put_str(&w, "<page width=\"");
+    xoj_put_fixed2(&w, pg->width);
+    xoj_put_str(&w, "\" height=\"");
+    xoj_put_fixed2(&w, pg->height);
+    xoj_put_str(&w, "\">\n<background type=\"solid\" color=\"white\" style=\"plain\" />\n");
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+      layer = (struct Layer *)layerlist->data;
+      if (layer->save_cache != NULL) xoj_writer_put_member(&w, layer->save_cache);
+      else if (layer_saved_alone(layer)) { // its own member, also kept for next time
+        xoj_writer_end_member(&w);
+        start = w.capture->len;
+        save_layer(&w, layer);
+        xoj_writer_end_member(&w);
+        layer->save_cache = g_byte_array_sized_new(w.capture->len - start);
+        g_byte_array_append(layer->save_cache, w.capture->data + start, 
+                            w.capture->len - start);
+        layer->save_cache_level = w.level;
+      }
+      else save_layer(&w, layer);
+      layer->dirty = FALSE;
+    }
+    xoj_put_str(&w, "</page>\n");
+    record = xoj_writer_end_capture(&w);
+    if (record == NULL) break;
+    header = g_strdup_printf("page %d %d %u\n", pageno, journal.npages, record->len);
+    if (fputs(header, f) < 0 || fwrite(record->data, 1, record->len, f) != record->len)
+      w.ok = FALSE;
+    ui.autosave_log_size += strlen(header) + record->len;
+    g_free(header);
+    g_byte_array_free(record, TRUE);
+#ifdef PERF_DEBUG
+    nrecords++;
+#endif
   }
-  g_free(base_filename);
-  if (num > AUTOSAVE_MAX) // we ran out of autosave file names... try at the next loop iteration
-    return TRUE;
-  // keep track of old save filenames
-  old_filenames = ui.autosave_filename_list;
-  ui.autosave_filename_list = NULL;
-  if (save_journal(test_filename, TRUE)) { // non-interactive save -> success
-    ui.need_autosave = FALSE; // no longer need an auto-save
-    autosave_cleanup(&old_filenames);
-  } else { // aborted
-    autosave_cleanup(&ui.autosave_filename_list); 
-    ui.autosave_filename_list = old_filenames;
+  if (fclose(f) != 0) w.ok = FALSE;
+  if (w.shared_images != NULL) g_hash_table_destroy(w.shared_images);
+  if (!xoj_writer_close(&w)) {
+    autosave_forget_snapshot(); // the layer caches may be ahead of the log
+    return FALSE;
   }
-  g_free(test_filename);
-  
-  return TRUE; // continue with the timed loop, if we're in it
+#ifdef PERF_DEBUG
+  printf("DEBUG: auto-save logged %d pages (%" G_GSIZE_FORMAT " bytes) in %.1f ms\n",
+         nrecords, ui.autosave_log_size - oldsize, g_timer_elapsed(timer, NULL)*1000);
+  g_timer_destroy(timer);
+#endif
+  return TRUE;
 }
 
 void init_autosave(void)
@@ -382,6 +1517,9 @@ void delete_autosave(char *filename)
   int k;
 
   g_unlink(filename);
+  attach_filename = g_strdup_printf("%s" AUTOSAVE_LOG_SUFFIX, filename);
+  g_unlink(attach_filename);
+  g_free(attach_filename);
   attach_filename = g_strdup_printf("%s.bg.pdf", filename);
   g_unlink(attach_filename);
   k = 1;
@@ -487,7 +1625,11 @@ gboolean close_journal(void)
 
   shutdown_bgpdf();
   delete_journal(&journal);
+  free_lazy_source();
   autosave_cleanup(&ui.autosave_filename_list);
+  forget_saved_attachments();
+  autosave_forget_snapshot();
+  forget_image_decodes();
   
   return TRUE;
   /* note: various members of ui and journal are now in invalid states,
@@ -507,68 +1649,419 @@ void cleanup_numeric(char *s)
   }
 }
 
+// fast path for the lists of numbers written by save_journal() with "%.2f":
+// parses whitespace-separated values of the form -?[0-9]+(.[0-9]{0,2})?
+// directly, giving exactly the same doubles as g_ascii_strtod() (the
+// mantissa is an exact integer and a single division by 10 or 100 is
+// correctly rounded). Returns the number of values stored in vals (at most
+// max), or -1 as soon as anything else shows up (commas, exponents, 1.#J,
+// too many digits...), in which case the caller falls back to the general
+// parser. At most 8 integer digits, so that the values are all below 1E8
+// and the general parser's finite_sized() check has nothing to replace.
+// The integer digits are classified and converted 8 bytes at a time (SWAR,
+// "SIMD within a register"): plain 64-bit integer arithmetic, so it is the
+// same code on every platform and needs no SSE/NEON intrinsics.
+
+#define SWAR_ONES   G_GUINT64_CONSTANT(0x0101010101010101)
+#define SWAR_HIGH   G_GUINT64_CONSTANT(0xF0F0F0F0F0F0F0F0)
+
+// the number of leading ASCII digits in 8 bytes of text (first byte in
+// the low bits): a byte is a digit iff its high nibble is 3, and still is
+// after adding 6. Carries out of non-digit bytes only affect later bytes.
+
+int swar_count_digits(guint64 x)
+{
+  guint64 bad;
+  
+  bad = ((x & SWAR_HIGH) ^ (3*SWAR_ONES<<4)) |
+        (((x + 6*SWAR_ONES) & SWAR_HIGH) ^ (3*SWAR_ONES<<4));
+  if (bad == 0) return 8;
+#ifdef __GNUC__
+  return __builtin_ctzll(bad)/8;
+#else
+  {
+    int n;
+    for (n = 0; !(bad & 0xff); n++) bad >>= 8;
+    return n;
+  }
+#endif
+}
+
+// the value of the first n (1 to 8) digits in x: move them to the top
+// bytes, then combine pairs of digits, pairs of pairs, and so on
+
+guint64 swar_digits_value(guint64 x, int n)
+{
+  x = (x - '0'*SWAR_ONES) << (8*(8-n));
+  x = (x * 10) + (x >> 8);
+  x = (((x & G_GUINT64_CONSTANT(0x000000FF000000FF)) * 
+           (100 + (G_GUINT64_CONSTANT(1000000) << 32))) +
+       (((x >> 16) & G_GUINT64_CONSTANT(0x000000FF000000FF)) * 
+           (1 + (G_GUINT64_CONSTANT(10000) << 32)))) >> 32;
+  return x;
+}
+
+int parse_fixed_numbers(const gchar *text, gsize len, double *vals, int max)
+{
+  const gchar *p, *end;
+  gint64 m;
+  guint64 x;
+  int n, ndigits, nfrac;
+  gboolean neg;
+  
+  p = text;
+  end = text + len;
+  n = 0;
+  while (TRUE) {
+    while (p<end && (*p==' ' || *p=='\n' || *p=='\t' || *p=='\r')) p++;
+    if (p==end || *p==0) return n;
+    if (n==max) return -1;
+    neg = (*p=='-');
+    if (neg) p++;
+    m = 0; ndigits = 0; nfrac = 0;
+    if (end-p >= 8) {
+      memcpy(&x, p, 8);
+      x = GUINT64_FROM_LE(x);
+      ndigits = swar_count_digits(x);
+      if (ndigits > 0) { m = swar_digits_value(x, ndigits); p += ndigits; }
+    }
+    else while (p<end && *p>='0' && *p<='9' && ndigits<8)
+      { m = 10*m + (*p-'0'); p++; ndigits++; }
+    if (ndigits == 0) return -1;
+    if (p<end && *p=='.') {
+      p++;
+      while (p<end && *p>='0' && *p<='9' && nfrac<2)
+        { m = 10*m + (*p-'0'); p++; nfrac++; }
+    }
+    if (p<end && *p!=0 && *p!=' ' && *p!='\n' && *p!='\t' && *p!='\r') 
+      return -1;
+    if (nfrac == 2) vals[n] = m/100.;
+    else if (nfrac == 1) vals[n] = m/10.;
+    else vals[n] = (double)m;
+    if (neg) vals[n] = -vals[n];
+    n++;
+  }
+}
+
+// compare the fast and general number parsers on the stroke data of a
+// real document, check that they agree, and report their throughput;
+// run with "xournal --benchmark-numbers file.xoj". Returns FALSE if the
+// fast parser ever gave a different value.
+
+gboolean benchmark_number_parsing(const gchar *text, gsize len)
+{
+  const gchar *p, *q, *end;
+  gchar *buf, *ptr, *tmpptr;
+  double *vals, *slow_vals;
+  int n, nslow, max, nfast, nstrokes, pass, nmismatch;
+  gsize total;
+  GTimer *timer;
+  double t_fast, t_slow;
+  
+  end = text + len;
+  total = 0; nfast = nstrokes = nmismatch = 0;
+  t_fast = t_slow = 0;
+  timer = g_timer_new();
+  // repeat over the document for at least a second, for stable figures
+  for (pass = 0; pass == 0 || (t_fast+t_slow < 1. && pass < 1000); pass++) {
+    p = text;
+    while ((p = g_strstr_len(p, end-p, "<stroke ")) != NULL) {
+      p = memchr(p, '>', end-p);
+      if (p == NULL) break;
+      p++;
+      q = g_strstr_len(p, end-p, "</stroke>");
+      if (q == NULL) break;
+      max = (q-p)/2 + 1;
+      vals = g_new(double, max);
+      slow_vals = g_new(double, max);
+      buf = g_strndup(p, q-p);
+      g_timer_start(timer);
+      n = parse_fixed_numbers(buf, q-p, vals, max);
+      t_fast += g_timer_elapsed(timer, NULL);
+      g_timer_start(timer);
+      cleanup_numeric(buf);
+      ptr = buf; nslow = 0;
+      while (nslow<max) {
+        slow_vals[nslow] = g_ascii_strtod(ptr, &tmpptr);
+        if (tmpptr == ptr) break;
+        ptr = tmpptr; nslow++;
+      }
+      t_slow += g_timer_elapsed(timer, NULL);
+      if (pass == 0) {
+        nstrokes++;
+        if (n>=0) nfast++;
+        if (n>=0 && (n != nslow || memcmp(vals, slow_vals, n*sizeof(double))))
+          nmismatch++;
+      }
+      total += q-p;
+      g_free(buf);
+      g_free(vals);
+      g_free(slow_vals);
+      p = q;
+    }
+    if (total == 0) break;
+  }
+  g_timer_destroy(timer);
+  if (total == 0) { printf("no stroke data found\n"); return TRUE; }
+  printf("stroke data %.2f MB x %d passes, fast path ok for %d/%d strokes\n",
+         total/1e6/pass, pass, nfast, nstrokes);
+  printf("fast parser %.1f MB/s, general parser %.1f MB/s\n",
+         t_fast>0 ? total/1e6/t_fast : 0., t_slow>0 ? total/1e6/t_slow : 0.);
+  if (nmismatch > 0) 
+    printf("fast parser gave different values for %d strokes\n", nmismatch);
+  return (nmismatch == 0);
+}
+
+// the --benchmark-numbers command line option: returns the exit status
+
+int benchmark_number_parsing_file(const char *filename)
+{
+  gzFile f;
+  XojInput in;
+  gboolean ok;
+  
+  f = gzopen_wrapper(filename, "rb");
+  if (f == NULL) { printf("cannot open %s\n", filename); return 1; }
+  ok = read_xoj_file(filename, f, &in);
+  gzclose(f);
+  if (!ok) { printf("cannot read %s\n", filename); return 1; }
+  ok = benchmark_number_parsing(in.text, in.len);
+  free_xoj_input(&in);
+  return ok ? 0 : 1;
+}
+
 // the XML parser functions for open_journal()
 
 struct Journal tmpJournal;
 struct Page *tmpPage;
-struct Layer *tmpLayer;
-struct Item *tmpItem;
 char *tmpFilename;
 struct Background *tmpBg_pdf;
+GHashTable *tmpImageIds; // the <imagedata> read so far, by id
+
+void release_image_id(gpointer key, gpointer value, gpointer user_data)
+{
+  release_image_png(((StoredImage *)value)->png);
+}
+
+// done reading a journal: forget the ids of its <imagedata>
+
+void forget_image_ids(void)
+{
+  if (tmpImageIds == NULL) return;
+  g_hash_table_foreach(tmpImageIds, release_image_id, NULL);
+  g_hash_table_destroy(tmpImageIds);
+  tmpImageIds = NULL;
+}
 
 GError *xoj_invalid(void)
 {
   return g_error_new(G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, _("Invalid file contents"));
 }
 
+// load a bitmap background of the journal being read (white if it can't be found)
+
+GdkPixbuf *load_bg_pixbuf(const char *name, int file_domain)
+{
+  char *tmpbg_filename;
+  GdkPixbuf *pixbuf;
+  GtkWidget *dialog;
+  int i;
+
+  if (file_domain == DOMAIN_ATTACH) {
+    tmpbg_filename = g_strdup_printf("%s.%s", tmpFilename, name);
+    if (sscanf(name, "bg_%d.png", &i) == 1)
+      if (i > tmpJournal.last_attach_no) 
+        tmpJournal.last_attach_no = i;
+  }
+  else tmpbg_filename = g_strdup(name);
+  pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
+  if (pixbuf == NULL) {
+    dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+      GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
+      _("Could not open background '%s'. Setting background to white."),
+      tmpbg_filename);
+    wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
+    gdk_pixbuf_fill(pixbuf, 0xffffffff); // solid white
+  }
+  g_free(tmpbg_filename);
+  return pixbuf;
+}
+
+/* the attributes of a <background> tag: this may refer to earlier pages,
+   so it is always handled by the main thread, with pages in order */
+
+void xoj_parse_background(XojParser *st, const gchar **attribute_names, 
+   const gchar **attribute_values, GError **error)
+{
+  int has_attr, i;
+  char *ptr;
+  struct Background *tmpbg;
+
+  has_attr = 0;
+  while (*attribute_names!=NULL) {
+    if (!strcmp(*attribute_names, "type")) {
+      if (has_attr) *error = xoj_invalid();
+      for (i=0; i<3; i++)
+        if (!strcmp(*attribute_values, bgtype_names[i]))
+          st->page->bg->type = i;
+      if (st->page->bg->type < 0) *error = xoj_invalid();
+      has_attr |= 1;
+      if (st->page->bg->type == BG_PDF) {
+        if (tmpBg_pdf == NULL) tmpBg_pdf = st->page->bg;
+        else {
+          has_attr |= 24;
+          st->page->bg->filename = refstring_ref(tmpBg_pdf->filename);
+          st->page->bg->file_domain = tmpBg_pdf->file_domain;
+        }
+      }
+    }
+    else if (!strcmp(*attribute_names, "color")) {
+      if (st->page->bg->type != BG_SOLID) *error = xoj_invalid();
+      if (has_attr & 2) *error = xoj_invalid();
+      st->page->bg->color_no = COLOR_OTHER;
+      for (i=0; i<COLOR_MAX; i++)
+        if (!strcmp(*attribute_values, bgcolor_names[i])) {
+          st->page->bg->color_no = i;
+          st->page->bg->color_rgba = predef_bgcolors_rgba[i];
+        }
+      // there's also the case of hex (#rrggbbaa) colors
+      if (st->page->bg->color_no == COLOR_OTHER && **attribute_values == '#') {
+        st->page->bg->color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (*ptr!=0) *error = xoj_invalid();
+      }
+      has_attr |= 2;
+    }
+    else if (!strcmp(*attribute_names, "style")) {
+      if (st->page->bg->type != BG_SOLID) *error = xoj_invalid();
+      if (has_attr & 4) *error = xoj_invalid();
+      st->page->bg->ruling = -1;
+      for (i=0; i<4; i++)
+        if (!strcmp(*attribute_values, bgstyle_names[i]))
+          st->page->bg->ruling = i;
+      if (st->page->bg->ruling < 0) *error = xoj_invalid();
+      has_attr |= 4;
+    }
+    else if (!strcmp(*attribute_names, "domain")) {
+      if (st->page->bg->type <= BG_SOLID || (has_attr & 8))
+        { *error = xoj_invalid(); return; }
+      st->page->bg->file_domain = -1;
+      for (i=0; i<3; i++)
+        if (!strcmp(*attribute_values, file_domain_names[i]))
+          st->page->bg->file_domain = i;
+      if (st->page->bg->file_domain < 0)
+        { *error = xoj_invalid(); return; }
+      has_attr |= 8;
+    }
+    else if (!strcmp(*attribute_names, "filename")) {
+      if (st->page->bg->type <= BG_SOLID || (has_attr != 9)) 
+        { *error = xoj_invalid(); return; }
+      if (st->page->bg->file_domain == DOMAIN_CLONE) {
+        // filename is a page number
+        i = strtol(*attribute_values, &ptr, 10);
+        if (ptr == *attribute_values || i < 0 || i > st->journal->npages-2)
+          { *error = xoj_invalid(); return; }
+        tmpbg = ((struct Page *)g_list_nth_data(st->journal->pages, i))->bg;
+        if (tmpbg->type != st->page->bg->type)
+          { *error = xoj_invalid(); return; }
+        st->page->bg->filename = refstring_ref(tmpbg->filename);
+        st->page->bg->pixbuf = tmpbg->pixbuf;
+        if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
+        st->page->bg->file_domain = tmpbg->file_domain;
+      }
+      else {
+        st->page->bg->filename = new_refstring(*attribute_values);
+        if (st->page->bg->type == BG_PIXMAP)
+          st->page->bg->pixbuf = load_bg_pixbuf(*attribute_values, st->page->bg->file_domain);
+      }
+      has_attr |= 16;
+    }
+    else if (!strcmp(*attribute_names, "pageno")) {
+      if (st->page->bg->type != BG_PDF || (has_attr & 32))
+        { *error = xoj_invalid(); return; }
+      st->page->bg->file_page_seq = strtol(*attribute_values, &ptr, 10);
+      if (ptr == *attribute_values) *error = xoj_invalid();
+      has_attr |= 32;
+    }
+    else *error = xoj_invalid();
+    attribute_names++;
+    attribute_values++;
+  }
+  if (st->page->bg->type < 0) *error = xoj_invalid();
+  if (st->page->bg->type == BG_SOLID && has_attr != 7) *error = xoj_invalid();
+  if (st->page->bg->type == BG_PIXMAP && has_attr != 25) *error = xoj_invalid();
+  if (st->page->bg->type == BG_PDF && has_attr != 57) *error = xoj_invalid();
+}
+
 void xoj_parser_start_element(GMarkupParseContext *context,
    const gchar *element_name, const gchar **attribute_names, 
    const gchar **attribute_values, gpointer user_data, GError **error)
 {
+  XojParser *st = (XojParser *)user_data;
   int has_attr, i;
+  gsize len;
   char *ptr, *tmpptr;
-  struct Background *tmpbg;
-  char *tmpbg_filename;
-  gdouble val;
-  GtkWidget *dialog;
+  StoredImage *img;
   
   if (!strcmp(element_name, "title") || !strcmp(element_name, "xournal")) {
-    if (tmpPage != NULL) {
+    if (st->page != NULL) {
       *error = xoj_invalid();
       return;
     }
     // nothing special to do
   }
+  else if (!strcmp(element_name, "imagedata")) { // an image used several times
+    if (st->page != NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    st->image_id = 0;
+    while (*attribute_names!=NULL) {
+      if (!strcmp(*attribute_names, "id") && st->image_id == 0) {
+        st->image_id = strtol(*attribute_values, &ptr, 10);
+        if (ptr == *attribute_values || st->image_id <= 0) *error = xoj_invalid();
+      }
+      else *error = xoj_invalid();
+      attribute_names++;
+      attribute_values++;
+    }
+    if (st->image_id == 0) *error = xoj_invalid();
+  }
   else if (!strcmp(element_name, "page")) { // start of a page
-    if (tmpPage != NULL) {
+    if (st->page != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpPage = (struct Page *)g_malloc(sizeof(struct Page));
-    tmpPage->layers = NULL;
-    tmpPage->nlayers = 0;
-    tmpPage->group = NULL;
-    tmpPage->bg = g_new(struct Background, 1);
-    tmpPage->bg->type = -1;
-    tmpPage->bg->canvas_item = NULL;
-    tmpPage->bg->pixbuf = NULL;
-    tmpPage->bg->filename = NULL;
-    tmpJournal.pages = g_list_append(tmpJournal.pages, tmpPage);
-    tmpJournal.npages++;
+    st->page = (struct Page *)g_malloc(sizeof(struct Page));
+    st->page->serial = new_serial();
+    st->page->layers = NULL;
+    st->page->nlayers = 0;
+    st->page->group = NULL;
+    st->page->lazy_chunk = -1;
+    st->page->pdf_index_no = 0;
+    st->page->bg = g_new(struct Background, 1);
+    st->page->bg->serial = new_serial();
+    st->page->bg->type = -1;
+    st->page->bg->canvas_item = NULL;
+    st->page->bg->pixbuf = NULL;
+    st->page->bg->filename = NULL;
+    st->journal->pages = g_list_append(st->journal->pages, st->page);
+    st->journal->npages++;
     // scan for height and width attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->width = g_ascii_strtod(*attribute_values, &ptr);
+        st->page->width = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "height")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->height = g_ascii_strtod(*attribute_values, &ptr);
+        st->page->height = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
@@ -579,194 +2072,102 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     if (has_attr!=3) *error = xoj_invalid();
   }
   else if (!strcmp(element_name, "background")) {
-    if (tmpPage == NULL || tmpLayer !=NULL || tmpPage->bg->type >= 0) {
+    if (st->page == NULL || st->layer != NULL || st->page->bg->type >= 0 ||
+        st->bg_names != NULL) {
       *error = xoj_invalid();
       return;
     }
-    has_attr = 0;
-    while (*attribute_names!=NULL) {
-      if (!strcmp(*attribute_names, "type")) {
-        if (has_attr) *error = xoj_invalid();
-        for (i=0; i<3; i++)
-          if (!strcmp(*attribute_values, bgtype_names[i]))
-            tmpPage->bg->type = i;
-        if (tmpPage->bg->type < 0) *error = xoj_invalid();
-        has_attr |= 1;
-        if (tmpPage->bg->type == BG_PDF) {
-          if (tmpBg_pdf == NULL) tmpBg_pdf = tmpPage->bg;
-          else {
-            has_attr |= 24;
-            tmpPage->bg->filename = refstring_ref(tmpBg_pdf->filename);
-            tmpPage->bg->file_domain = tmpBg_pdf->file_domain;
-          }
-        }
-      }
-      else if (!strcmp(*attribute_names, "color")) {
-        if (tmpPage->bg->type != BG_SOLID) *error = xoj_invalid();
-        if (has_attr & 2) *error = xoj_invalid();
-        tmpPage->bg->color_no = COLOR_OTHER;
-        for (i=0; i<COLOR_MAX; i++)
-          if (!strcmp(*attribute_values, bgcolor_names[i])) {
-            tmpPage->bg->color_no = i;
-            tmpPage->bg->color_rgba = predef_bgcolors_rgba[i];
-          }
-        // there's also the case of hex (#rrggbbaa) colors
-        if (tmpPage->bg->color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpPage->bg->color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
-          if (*ptr!=0) *error = xoj_invalid();
-        }
-        has_attr |= 2;
-      }
-      else if (!strcmp(*attribute_names, "style")) {
-        if (tmpPage->bg->type != BG_SOLID) *error = xoj_invalid();
-        if (has_attr & 4) *error = xoj_invalid();
-        tmpPage->bg->ruling = -1;
-        for (i=0; i<4; i++)
-          if (!strcmp(*attribute_values, bgstyle_names[i]))
-            tmpPage->bg->ruling = i;
-        if (tmpPage->bg->ruling < 0) *error = xoj_invalid();
-        has_attr |= 4;
-      }
-      else if (!strcmp(*attribute_names, "domain")) {
-        if (tmpPage->bg->type <= BG_SOLID || (has_attr & 8))
-          { *error = xoj_invalid(); return; }
-        tmpPage->bg->file_domain = -1;
-        for (i=0; i<3; i++)
-          if (!strcmp(*attribute_values, file_domain_names[i]))
-            tmpPage->bg->file_domain = i;
-        if (tmpPage->bg->file_domain < 0)
-          { *error = xoj_invalid(); return; }
-        has_attr |= 8;
-      }
-      else if (!strcmp(*attribute_names, "filename")) {
-        if (tmpPage->bg->type <= BG_SOLID || (has_attr != 9)) 
-          { *error = xoj_invalid(); return; }
-        if (tmpPage->bg->file_domain == DOMAIN_CLONE) {
-          // filename is a page number
-          i = strtol(*attribute_values, &ptr, 10);
-          if (ptr == *attribute_values || i < 0 || i > tmpJournal.npages-2)
-            { *error = xoj_invalid(); return; }
-          tmpbg = ((struct Page *)g_list_nth_data(tmpJournal.pages, i))->bg;
-          if (tmpbg->type != tmpPage->bg->type)
-            { *error = xoj_invalid(); return; }
-          tmpPage->bg->filename = refstring_ref(tmpbg->filename);
-          tmpPage->bg->pixbuf = tmpbg->pixbuf;
-          if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
-          tmpPage->bg->file_domain = tmpbg->file_domain;
-        }
-        else {
-          tmpPage->bg->filename = new_refstring(*attribute_values);
-          if (tmpPage->bg->type == BG_PIXMAP) {
-            if (tmpPage->bg->file_domain == DOMAIN_ATTACH) {
-              tmpbg_filename = g_strdup_printf("%s.%s", tmpFilename, *attribute_values);
-              if (sscanf(*attribute_values, "bg_%d.png", &i) == 1)
-                if (i > tmpJournal.last_attach_no) 
-                  tmpJournal.last_attach_no = i;
-            }
-            else tmpbg_filename = g_strdup(*attribute_values);
-            tmpPage->bg->pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
-            if (tmpPage->bg->pixbuf == NULL) {
-              dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-                GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
-                _("Could not open background '%s'. Setting background to white."),
-                tmpbg_filename);
-              wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
-              gtk_widget_destroy(dialog);
-              tmpPage->bg->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
-              gdk_pixbuf_fill(tmpPage->bg->pixbuf, 0xffffffff); // solid white
-            }
-            g_free(tmpbg_filename);
-          }
-        }
-        has_attr |= 16;
-      }
-      else if (!strcmp(*attribute_names, "pageno")) {
-        if (tmpPage->bg->type != BG_PDF || (has_attr & 32))
-          { *error = xoj_invalid(); return; }
-        tmpPage->bg->file_page_seq = strtol(*attribute_values, &ptr, 10);
-        if (ptr == *attribute_values) *error = xoj_invalid();
-        has_attr |= 32;
-      }
-      else *error = xoj_invalid();
-      attribute_names++;
-      attribute_values++;
+    if (st->defer_bg) { // only the main thread can resolve backgrounds
+      st->bg_names = g_strdupv((gchar **)attribute_names);
+      st->bg_values = g_strdupv((gchar **)attribute_values);
     }
-    if (tmpPage->bg->type < 0) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_SOLID && has_attr != 7) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_PIXMAP && has_attr != 25) *error = xoj_invalid();
-    if (tmpPage->bg->type == BG_PDF && has_attr != 57) *error = xoj_invalid();
+    else xoj_parse_background(st, attribute_names, attribute_values, error);
   }
   else if (!strcmp(element_name, "layer")) { // start of a layer
-    if (tmpPage == NULL || tmpLayer != NULL) {
+    if (st->page == NULL || st->layer != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpLayer = (struct Layer *)g_malloc(sizeof(struct Layer));
-    tmpLayer->items = NULL;
-    tmpLayer->nitems = 0;
-    tmpLayer->group = NULL;
-    tmpPage->layers = g_list_append(tmpPage->layers, tmpLayer);
-    tmpPage->nlayers++;
+    st->layer = (struct Layer *)g_malloc(sizeof(struct Layer));
+    st->layer->serial = new_serial();
+    st->layer->items = NULL;
+    st->layer->nitems = 0;
+    st->layer->save_cache = NULL;
+    st->layer->dirty = TRUE;
+    st->layer->group = NULL;
+    st->page->layers = g_list_append(st->page->layers, st->layer);
+    st->page->nlayers++;
   }
   else if (!strcmp(element_name, "stroke")) { // start of a stroke
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc(sizeof(struct Item));
-    tmpItem->type = ITEM_STROKE;
-    tmpItem->path = NULL;
-    tmpItem->canvas_item = NULL;
-    tmpItem->widths = NULL;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = (struct Item *)g_malloc(sizeof(struct Item));
+    st->item->type = ITEM_STROKE;
+    st->item->path = NULL;
+    st->item->canvas_item = NULL;
+    st->item->widths = NULL;
+    st->layer->items = g_list_append(st->layer->items, st->item);
+    st->layer->nitems++;
     // scan for tool, color, and width attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->brush.thickness = g_ascii_strtod(*attribute_values, &ptr);
-        if (ptr == *attribute_values) *error = xoj_invalid();
-        i = 0;
-        while (*ptr!=0) {
-          realloc_cur_widths(i+1);
-          ui.cur_widths[i] = g_ascii_strtod(ptr, &tmpptr);
-          if (tmpptr == ptr) break;
-          ptr = tmpptr;
-          i++;
+        // size the buffer once: each value takes at least two characters
+        len = strlen(*attribute_values);
+        xoj_parser_realloc_widths(st, len/2 + 1);
+        i = parse_fixed_numbers(*attribute_values, len, st->widths, len/2 + 1);
+        if (i>0) { // fast path: thickness followed by the widths
+          st->item->brush.thickness = st->widths[0];
+          i--;
+          g_memmove(st->widths, st->widths+1, i*sizeof(gdouble));
+        }
+        else {
+          cleanup_numeric((gchar *)*attribute_values);
+          st->item->brush.thickness = g_ascii_strtod(*attribute_values, &ptr);
+          if (ptr == *attribute_values) *error = xoj_invalid();
+          i = 0;
+          while (*ptr!=0) {
+            xoj_parser_realloc_widths(st, i+1);
+            st->widths[i] = g_ascii_strtod(ptr, &tmpptr);
+            if (tmpptr == ptr) break;
+            ptr = tmpptr;
+            i++;
+          }
         }
-        tmpItem->brush.variable_width = (i>0);
+        st->item->brush.variable_width = (i>0);
         if (i>0) {
-          tmpItem->brush.variable_width = TRUE;
-          tmpItem->widths = (gdouble *) g_memdup(ui.cur_widths, i*sizeof(gdouble));
-          ui.cur_path.num_points =  i+1;
+          st->item->brush.variable_width = TRUE;
+          st->item->widths = (gdouble *) g_memdup(st->widths, i*sizeof(gdouble));
+          st->num_points =  i+1;
         }
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "color")) {
         if (has_attr & 2) *error = xoj_invalid();
-        tmpItem->brush.color_no = COLOR_OTHER;
+        st->item->brush.color_no = COLOR_OTHER;
         for (i=0; i<COLOR_MAX; i++)
           if (!strcmp(*attribute_values, color_names[i])) {
-            tmpItem->brush.color_no = i;
-            tmpItem->brush.color_rgba = predef_colors_rgba[i];
+            st->item->brush.color_no = i;
+            st->item->brush.color_rgba = predef_colors_rgba[i];
           }
         // there's also the case of hex (#rrggbbaa) colors
-        if (tmpItem->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpItem->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (st->item->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
+          st->item->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
           if (*ptr!=0) *error = xoj_invalid();
         }
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "tool")) {
         if (has_attr & 4) *error = xoj_invalid();
-        tmpItem->brush.tool_type = -1;
+        st->item->brush.tool_type = -1;
         for (i=0; i<NUM_STROKE_TOOLS; i++)
           if (!strcmp(*attribute_values, tool_names[i])) {
-            tmpItem->brush.tool_type = i;
+            st->item->brush.tool_type = i;
           }
-        if (tmpItem->brush.tool_type == -1) *error = xoj_invalid();
+        if (st->item->brush.tool_type == -1) *error = xoj_invalid();
         has_attr |= 4;
       }
       else *error = xoj_invalid();
@@ -775,65 +2176,65 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     }
     if (has_attr!=7) *error = xoj_invalid();
     // finish filling the brush info
-    tmpItem->brush.thickness_no = 0;  // who cares ?
-    tmpItem->brush.tool_options = 0;  // who cares ?
-    tmpItem->brush.ruler = FALSE;
-    tmpItem->brush.recognizer = FALSE;
-    if (tmpItem->brush.tool_type == TOOL_HIGHLIGHTER) {
-      if (tmpItem->brush.color_no >= 0)
-        tmpItem->brush.color_rgba &= ui.hiliter_alpha_mask;
+    st->item->brush.thickness_no = 0;  // who cares ?
+    st->item->brush.tool_options = 0;  // who cares ?
+    st->item->brush.ruler = FALSE;
+    st->item->brush.recognizer = FALSE;
+    if (st->item->brush.tool_type == TOOL_HIGHLIGHTER) {
+      if (st->item->brush.color_no >= 0)
+        st->item->brush.color_rgba &= ui.hiliter_alpha_mask;
     }
   }
   else if (!strcmp(element_name, "text")) { // start of a text item
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc0(sizeof(struct Item));
-    tmpItem->type = ITEM_TEXT;
-    tmpItem->canvas_item = NULL;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = (struct Item *)g_malloc0(sizeof(struct Item));
+    st->item->type = ITEM_TEXT;
+    st->item->canvas_item = NULL;
+    st->layer->items = g_list_append(st->layer->items, st->item);
+    st->layer->nitems++;
     // scan for font, size, x, y, and color attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "font")) {
         if (has_attr & 1) *error = xoj_invalid();
-        tmpItem->font_name = g_strdup(*attribute_values);
+        st->item->font_name = g_strdup(*attribute_values);
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "size")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->font_size = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->font_size = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "x")) {
         if (has_attr & 4) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "y")) {
         if (has_attr & 8) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
       else if (!strcmp(*attribute_names, "color")) {
         if (has_attr & 16) *error = xoj_invalid();
-        tmpItem->brush.color_no = COLOR_OTHER;
+        st->item->brush.color_no = COLOR_OTHER;
         for (i=0; i<COLOR_MAX; i++)
           if (!strcmp(*attribute_values, color_names[i])) {
-            tmpItem->brush.color_no = i;
-            tmpItem->brush.color_rgba = predef_colors_rgba[i];
+            st->item->brush.color_no = i;
+            st->item->brush.color_rgba = predef_colors_rgba[i];
           }
         // there's also the case of hex (#rrggbbaa) colors
-        if (tmpItem->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
-          tmpItem->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
+        if (st->item->brush.color_no == COLOR_OTHER && **attribute_values == '#') {
+          st->item->brush.color_rgba = strtoul(*attribute_values + 1, &ptr, 16);
           if (*ptr!=0) *error = xoj_invalid();
         }
         has_attr |= 16;
@@ -845,137 +2246,427 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     if (has_attr!=31) *error = xoj_invalid();
   }
   else if (!strcmp(element_name, "image")) { // start of a image item
-    if (tmpLayer == NULL || tmpItem != NULL) {
+    if (st->layer == NULL || st->item != NULL) {
       *error = xoj_invalid();
       return;
     }
-    tmpItem = (struct Item *)g_malloc0(sizeof(struct Item));
-    tmpItem->type = ITEM_IMAGE;
-    tmpItem->canvas_item = NULL;
-    tmpItem->image=NULL;
-    tmpItem->image_png = NULL;
-    tmpItem->image_png_len = 0;
-    tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
-    tmpLayer->nitems++;
+    st->item = (struct Item *)g_malloc0(sizeof(struct Item));
+    st->item->type = ITEM_IMAGE;
+    st->item->canvas_item = NULL;
+    st->item->image=NULL;
+    st->item->image_png = NULL;
+    st->item->image_png_len = 0;
+    st->layer->items = g_list_append(st->layer->items, st->item);
+    st->layer->nitems++;
     // scan for x, y
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "left")) {
         if (has_attr & 1) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "top")) {
         if (has_attr & 2) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "right")) {
         if (has_attr & 4) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.right = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.right = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "bottom")) {
         if (has_attr & 8) *error = xoj_invalid();
         cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.bottom = g_ascii_strtod(*attribute_values, &ptr);
+        st->item->bbox.bottom = g_ascii_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
+      else if (!strcmp(*attribute_names, "ref")) { // to an <imagedata>
+        if (has_attr & 16) *error = xoj_invalid();
+        i = strtol(*attribute_values, &ptr, 10);
+        img = NULL;
+        if (tmpImageIds != NULL)
+          img = (StoredImage *)g_hash_table_lookup(tmpImageIds, GINT_TO_POINTER(i));
+        if (ptr == *attribute_values || img == NULL) *error = xoj_invalid();
+        else {
+          st->item->image_png = ref_image_png(img->png);
+          st->item->image_png_len = img->png_len;
+        }
+        has_attr |= 16;
+      }
       else *error = xoj_invalid();
       attribute_names++;
       attribute_values++;
     }
-    if (has_attr!=15) *error = xoj_invalid();
+    if ((has_attr & 15) != 15) *error = xoj_invalid();
+  }
+}
+
+void xoj_parser_end_element(GMarkupParseContext *context,
+   const gchar *element_name, gpointer user_data, GError **error)
+{
+  XojParser *st = (XojParser *)user_data;
+
+  if (!strcmp(element_name, "page")) {
+    if (st->page == NULL || st->layer != NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    if (st->page->nlayers == 0 || (st->page->bg->type < 0 && st->bg_names == NULL))
+      *error = xoj_invalid();
+    st->page = NULL;
+  }
+  if (!strcmp(element_name, "layer")) {
+    if (st->layer == NULL || st->item != NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    st->layer = NULL;
+  }
+  if (!strcmp(element_name, "stroke")) {
+    if (st->item == NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    update_item_bbox(st->item);
+    st->item = NULL;
+  }
+  if (!strcmp(element_name, "text")) {
+    if (st->item == NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    st->item = NULL;
+  }
+  if (!strcmp(element_name, "image")) {
+    if (st->item == NULL) {
+      *error = xoj_invalid();
+      return;
+    }
+    st->item = NULL;
+  }
+}
+
+void xoj_parser_text(GMarkupParseContext *context,
+   const gchar *text, gsize text_len, gpointer user_data, GError **error)
+{
+  XojParser *st = (XojParser *)user_data;
+  const gchar *element_name, *ptr;
+  gchar *png;
+  gsize png_len;
+  int n;
+  
+  element_name = g_markup_parse_context_get_element(context);
+  if (element_name == NULL) return;
+  if (!strcmp(element_name, "stroke")) {
+    // size the buffer once: each coordinate takes at least two characters
+    xoj_parser_realloc_coords(st, text_len/4 + 1);
+    n = parse_fixed_numbers(text, text_len, st->coords, 2*st->coords_alloc);
+    if (n<0) { // unusual input, use the general parser
+      cleanup_numeric((gchar *)text);
+      ptr = text;
+      n = 0;
+      while (text_len > 0) {
+        xoj_parser_realloc_coords(st, n/2 + 1);
+        st->coords[n] = g_ascii_strtod(text, (char **)(&ptr));
+        if (ptr == text) break;
+        text_len -= (ptr - text);
+        text = ptr;
+        if (!finite_sized(st->coords[n])) {
+          if (n>=2) st->coords[n] = st->coords[n-2];
+          else st->coords[n] = 0;
+        }
+        n++;
+      }
+    }
+    if (n<4 || n&1 || 
+        (st->item->brush.variable_width && (n!=2*st->num_points))) 
+      { *error = xoj_invalid(); return; } // wrong number of points
+    st->item->path = gnome_canvas_points_new(n/2);
+    g_memmove(st->item->path->coords, st->coords, n*sizeof(double));
+  }
+  if (!strcmp(element_name, "text")) {
+    st->item->text = g_malloc(text_len+1);
+    g_memmove(st->item->text, text, text_len);
+    st->item->text[text_len]=0;
+  }
+  if (!strcmp(element_name, "image") && st->item->image_png == NULL) {
+    png = read_image_png(text, text_len, &png_len);
+    st->item->image_png = store_image_png(png, png_len);
+    st->item->image_png_len = png_len;
+    if (st->item->image_png == NULL) // nothing to decode later
+      st->item->image = decode_image_png(NULL, 0);
+  }
+  if (!strcmp(element_name, "imagedata")) {
+    png = read_image_png(text, text_len, &png_len);
+    png = store_image_png(png, png_len);
+    if (png == NULL) { *error = xoj_invalid(); return; }
+    if (tmpImageIds == NULL) tmpImageIds = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (g_hash_table_lookup(tmpImageIds, GINT_TO_POINTER(st->image_id)) != NULL) {
+      release_image_png(png);
+      *error = xoj_invalid();
+      return;
+    }
+    g_hash_table_insert(tmpImageIds, GINT_TO_POINTER(st->image_id), stored_image(png));
   }
 }
 
-void xoj_parser_end_element(GMarkupParseContext *context,
-   const gchar *element_name, gpointer user_data, GError **error)
+const GMarkupParser xoj_markup_parser = { xoj_parser_start_element, 
+                                          xoj_parser_end_element, 
+                                          xoj_parser_text, NULL, NULL};
+
+void xoj_parser_init(XojParser *st, struct Journal *j, gboolean defer_bg)
+{
+  st->journal = j;
+  st->page = NULL;
+  st->layer = NULL;
+  st->item = NULL;
+  st->coords = st->widths = NULL;
+  st->coords_alloc = st->widths_alloc = 0;
+  st->num_points = 0;
+  st->defer_bg = defer_bg;
+  st->bg_names = st->bg_values = NULL;
+  st->image_id = 0;
+}
+
+void xoj_parser_free(XojParser *st)
+{
+  g_free(st->coords);
+  g_free(st->widths);
+  g_strfreev(st->bg_names);
+  g_strfreev(st->bg_values);
+  st->coords = st->widths = NULL;
+  st->bg_names = st->bg_values = NULL;
+}
+
+void xoj_parser_realloc_coords(XojParser *st, int n)
+{
+  if (n <= st->coords_alloc) return;
+  st->coords_alloc = n+100;
+  st->coords = g_realloc(st->coords, 2*(n+100)*sizeof(double));
+}
+
+void xoj_parser_realloc_widths(XojParser *st, int n)
+{
+  if (n <= st->widths_alloc) return;
+  st->widths_alloc = n+100;
+  st->widths = g_realloc(st->widths, (n+100)*sizeof(double));
+}
+
+// parse a piece of the document with its own markup context
+
+gboolean xoj_parse_chunk(XojParser *st, const gchar *text, gsize len)
+{
+  GMarkupParseContext *context;
+  GError *error;
+  gboolean valid;
+  
+  error = NULL;
+  context = g_markup_parse_context_new(&xoj_markup_parser, 0, st, NULL);
+  valid = g_markup_parse_context_parse(context, text, len, &error);
+  if (valid) valid = g_markup_parse_context_end_parse(context, &error);
+  g_markup_parse_context_free(context);
+  if (error != NULL) g_error_free(error);
+  return valid;
+}
+
+/* Parallel parsing: the document is split just before each <page> tag,
+   the pages are parsed by a thread pool into separate journals, and then
+   linked into tmpJournal in order. The backgrounds may refer to earlier
+   pages and need dialogs, so they are resolved during the linking. If
+   anything unusual shows up we start over with the serial parser, whose
+   results are the reference. */
+
+typedef struct XojParseJob {
+  const gchar *text;
+  gsize len;
+  struct Journal journal;
+  XojParser parser;
+  gboolean valid;
+  GAsyncQueue *done; // where the job goes once parsed
+} XojParseJob;
+
+GThreadPool *parse_pool; // created at the first parallel parse, kept until exit
+
+void xoj_parse_thread(gpointer data, gpointer user_data)
+{
+  XojParseJob *job = (XojParseJob *)data;
+  
+  job->valid = xoj_parse_chunk(&job->parser, job->text, job->len)
+                 && job->journal.npages == 1;
+  g_async_queue_push(job->done, job);
+}
+
+void shutdown_parse_pool(void)
 {
-  if (!strcmp(element_name, "page")) {
-    if (tmpPage == NULL || tmpLayer != NULL) {
-      *error = xoj_invalid();
-      return;
+  if (parse_pool == NULL) return;
+  g_thread_pool_free(parse_pool, FALSE, TRUE);
+  parse_pool = NULL;
+}
+
+// if text[i] starts a comment, CDATA section or processing instruction,
+// the index just past its end (len if unterminated), otherwise i
+
+gsize xoj_skip_markup(const gchar *text, gsize len, gsize i)
+{
+  const gchar *start, *end, *close;
+  
+  if (i+4 <= len && !strncmp(text+i, "<!--", 4)) 
+    { start = text+i+4; close = "-->"; }
+  else if (i+9 <= len && !strncmp(text+i, "<![CDATA[", 9)) 
+    { start = text+i+9; close = "]]>"; }
+  else if (i+2 <= len && !strncmp(text+i, "<?", 2)) 
+    { start = text+i+2; close = "?>"; }
+  else return i;
+  end = g_strstr_len(start, text+len-start, close);
+  if (end == NULL) return len;
+  return end + strlen(close) - text;
+}
+
+// is there a page starting at text[i]?
+
+gboolean xoj_is_page_tag(const gchar *text, gsize len, gsize i)
+{
+  return (i+5 < len && !strncmp(text+i, "<page", 5) &&
+          (g_ascii_isspace(text[i+5]) || text[i+5] == '>' || text[i+5] == '/'));
+}
+
+/* returns false if the document is better left to the serial parser,
+   otherwise sets *valid to the result of the parse */
+
+gboolean xoj_parse_parallel(const gchar *text, gsize len, gboolean *valid)
+{
+  GArray *starts;
+  GAsyncQueue *done;
+  XojParseJob *jobs;
+  XojParser st, *pst;
+  GString *skeleton;
+  GList *last;
+  GError *error;
+  const gchar *p;
+  gsize i, trailer;
+  int njobs, nthreads, k;
+  gboolean ok;
+  
+  // comments and such could hide tags: skip over them (the <?xml ?> 
+  // declaration is one), they stay inside whichever piece they are in
+  starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+  for (p = memchr(text, '<', len); p != NULL; 
+       p = memchr(p+1, '<', len - (p+1-text))) {
+    i = p - text;
+    if (xoj_is_page_tag(text, len, i)) g_array_append_val(starts, i);
+    else if ((i = xoj_skip_markup(text, len, i)) != (gsize)(p - text)) {
+      if (i >= len) break;
+      p = text + i - 1; // the search goes on just after it
     }
-    if (tmpPage->nlayers == 0 || tmpPage->bg->type < 0) *error = xoj_invalid();
-    tmpPage = NULL;
   }
-  if (!strcmp(element_name, "layer")) {
-    if (tmpLayer == NULL || tmpItem != NULL) {
-      *error = xoj_invalid();
-      return;
-    }
-    tmpLayer = NULL;
+  njobs = starts->len;
+  trailer = len;
+  for (i = len; njobs > 0 && i >= g_array_index(starts, gsize, njobs-1) + 9; i--)
+    if (!strncmp(text + i - 9, "</xournal", 9)) { trailer = i - 9; break; }
+  if (njobs < PARALLEL_PARSE_MIN_PAGES || trailer == len) {
+    g_array_free(starts, TRUE);
+    return FALSE;
   }
-  if (!strcmp(element_name, "stroke")) {
-    if (tmpItem == NULL) {
-      *error = xoj_invalid();
-      return;
-    }
-    update_item_bbox(tmpItem);
-    tmpItem = NULL;
+  
+  if (parse_pool == NULL) {
+#if GLIB_CHECK_VERSION(2,36,0)
+    nthreads = g_get_num_processors();
+#else
+    nthreads = 4;
+#endif
+    parse_pool = g_thread_pool_new(xoj_parse_thread, NULL, nthreads, FALSE, NULL);
   }
-  if (!strcmp(element_name, "text")) {
-    if (tmpItem == NULL) {
-      *error = xoj_invalid();
-      return;
+  if (parse_pool == NULL) { g_array_free(starts, TRUE); return FALSE; }
+  
+  // first check the header and trailer around the pages: the header
+  // has the <imagedata> that the pages refer to
+  skeleton = g_string_new_len(text, g_array_index(starts, gsize, 0));
+  g_string_append_len(skeleton, text + trailer, len - trailer);
+  xoj_parser_init(&st, &tmpJournal, FALSE);
+  ok = xoj_parse_chunk(&st, skeleton->str, skeleton->len);
+  xoj_parser_free(&st);
+  g_string_free(skeleton, TRUE);
+  
+  jobs = g_new(XojParseJob, njobs);
+  done = g_async_queue_new();
+  for (k = 0; k < njobs; k++) {
+    jobs[k].text = text + g_array_index(starts, gsize, k);
+    jobs[k].len = ((k+1 < njobs) ? g_array_index(starts, gsize, k+1) : trailer) 
+                  - g_array_index(starts, gsize, k);
+    jobs[k].journal.pages = NULL;
+    jobs[k].journal.npages = 0;
+    jobs[k].journal.last_attach_no = 0;
+    jobs[k].journal.lazy_source = NULL;
+    jobs[k].journal.lazy_pages = 0;
+    xoj_parser_init(&jobs[k].parser, &jobs[k].journal, TRUE);
+    jobs[k].valid = FALSE;
+    jobs[k].done = done;
+    g_thread_pool_push(parse_pool, jobs+k, NULL);
+  }
+  g_array_free(starts, TRUE);
+  
+  for (k = 0; k < njobs; k++) g_async_queue_pop(done); // wait for all the pages
+  g_async_queue_unref(done);
+  for (k = 0; k < njobs && ok; k++) ok = jobs[k].valid;
+  if (!ok) { // back to the serial parser
+    for (k = 0; k < njobs; k++) {
+      delete_journal(&jobs[k].journal);
+      xoj_parser_free(&jobs[k].parser);
     }
-    tmpItem = NULL;
+    forget_image_ids(); // it reads them again
+    g_free(jobs);
+    return FALSE;
   }
-  if (!strcmp(element_name, "image")) {
-    if (tmpItem == NULL) {
-      *error = xoj_invalid();
-      return;
+  
+  // link the pages in order, resolving their backgrounds
+  *valid = TRUE;
+  last = NULL;
+  for (k = 0; k < njobs; k++) {
+    pst = &jobs[k].parser;
+    if (*valid) {
+      if (last == NULL) tmpJournal.pages = jobs[k].journal.pages;
+      else {
+        last->next = jobs[k].journal.pages;
+        jobs[k].journal.pages->prev = last;
+      }
+      last = jobs[k].journal.pages;
+      jobs[k].journal.pages = NULL;
+      tmpJournal.npages++;
+      pst->journal = &tmpJournal;
+      pst->page = (struct Page *)last->data;
+      error = NULL;
+      xoj_parse_background(pst, (const gchar **)pst->bg_names, 
+                           (const gchar **)pst->bg_values, &error);
+      if (error != NULL) { *valid = FALSE; g_error_free(error); }
     }
-    tmpItem = NULL;
+    delete_journal(&jobs[k].journal);
+    xoj_parser_free(pst);
   }
+  g_free(jobs);
+  return TRUE;
 }
 
-void xoj_parser_text(GMarkupParseContext *context,
-   const gchar *text, gsize text_len, gpointer user_data, GError **error)
+// parse a whole .xoj document into tmpJournal
+
+gboolean parse_xoj_document(const gchar *text, gsize len)
 {
-  const gchar *element_name, *ptr;
-  int n;
+  XojParser st;
+  gboolean valid;
   
-  element_name = g_markup_parse_context_get_element(context);
-  if (element_name == NULL) return;
-  if (!strcmp(element_name, "stroke")) {
-    cleanup_numeric((gchar *)text);
-    ptr = text;
-    n = 0;
-    while (text_len > 0) {
-      realloc_cur_path(n/2 + 1);
-      ui.cur_path.coords[n] = g_ascii_strtod(text, (char **)(&ptr));
-      if (ptr == text) break;
-      text_len -= (ptr - text);
-      text = ptr;
-      if (!finite_sized(ui.cur_path.coords[n])) {
-        if (n>=2) ui.cur_path.coords[n] = ui.cur_path.coords[n-2];
-        else ui.cur_path.coords[n] = 0;
-      }
-      n++;
-    }
-    if (n<4 || n&1 || 
-        (tmpItem->brush.variable_width && (n!=2*ui.cur_path.num_points))) 
-      { *error = xoj_invalid(); return; } // wrong number of points
-    tmpItem->path = gnome_canvas_points_new(n/2);
-    g_memmove(tmpItem->path->coords, ui.cur_path.coords, n*sizeof(double));
-  }
-  if (!strcmp(element_name, "text")) {
-    tmpItem->text = g_malloc(text_len+1);
-    g_memmove(tmpItem->text, text, text_len);
-    tmpItem->text[text_len]=0;
-  }
-  if (!strcmp(element_name, "image")) {
-    tmpItem->image = read_pixbuf(text, text_len);
-  }
+  if (xoj_parse_parallel(text, len, &valid)) return valid;
+  xoj_parser_init(&st, &tmpJournal, FALSE);
+  valid = xoj_parse_chunk(&st, text, len);
+  xoj_parser_free(&st);
+  return valid;
 }
 
 gboolean user_wants_second_chance(char **filename)
@@ -1019,20 +2710,74 @@ gboolean user_wants_second_chance(char **filename)
   return TRUE;    
 }
 
+// crash recovery: apply the log of an auto-save to the pages just loaded
+// into tmpJournal; a record cut short by a crash ends the replay.
+// Returns the number of pages restored from the log.
+
+int replay_autosave_log(const char *snapshot)
+{
+  gchar *logname, *contents, *p, *q, *end;
+  gsize len;
+  unsigned long size;
+  int pageno, npages, nrecords;
+  GString *text;
+  struct Journal j;
+  XojParser st;
+  struct Page *pg, *newpg;
+  GList *tmplist;
+  
+  logname = g_strconcat(snapshot, AUTOSAVE_LOG_SUFFIX, NULL);
+  if (!g_file_get_contents(logname, &contents, &len, NULL)) 
+    { g_free(logname); return 0; }
+  g_free(logname);
+  p = contents;
+  end = contents + len;
+  nrecords = 0;
+  while (p < end) {
+    q = memchr(p, '\n', end-p);
+    if (q == NULL || sscanf(p, "page %d %d %lu", &pageno, &npages, &size) != 3)
+      break;
+    p = q+1;
+    if (npages != tmpJournal.npages || pageno < 0 || pageno >= npages ||
+        size > (gsize)(end-p)) break;
+    text = gunzip_members((guchar *)p, size);
+    p += size;
+    if (text == NULL) break;
+    j.pages = NULL;
+    j.npages = 0;
+    j.last_attach_no = 0;
+    j.lazy_source = NULL;
+    j.lazy_pages = 0;
+    xoj_parser_init(&st, &j, FALSE);
+    if (xoj_parse_chunk(&st, text->str, text->len) && j.npages == 1) {
+      // swap the layers, the old ones get deleted with j
+      pg = (struct Page *)g_list_nth_data(tmpJournal.pages, pageno);
+      newpg = (struct Page *)j.pages->data;
+      tmplist = pg->layers; pg->layers = newpg->layers; newpg->layers = tmplist;
+      npages = pg->nlayers; pg->nlayers = newpg->nlayers; newpg->nlayers = npages;
+      nrecords++;
+    }
+    xoj_parser_free(&st);
+    delete_journal(&j);
+    g_string_free(text, TRUE);
+  }
+  g_free(contents);
+  return nrecords;
+}
+
 gboolean open_journal(char *filename)
 {
-  const GMarkupParser parser = { xoj_parser_start_element, 
-                                 xoj_parser_end_element, 
-                                 xoj_parser_text, NULL, NULL};
-  GMarkupParseContext *context;
-  GError *error;
   GtkWidget *dialog;
   gboolean valid;
   gzFile f;
-  char buffer[1000];
-  int len;
+  XojInput in;
   gchar *tmpfn, *tmpfn2, *p, *q, *filename_actual;
   gboolean maybe_pdf;
+  GList *tmplist;
+#ifdef PERF_DEBUG
+  GTimer *timer;
+  double t_read, t_parse;
+#endif
   
   tmpfn = g_strdup_printf("%s.xoj", filename);
   if (ui.autoload_pdf_xoj && g_file_test(tmpfn, G_FILE_TEST_EXISTS) &&
@@ -1074,32 +2819,53 @@ gboolean open_journal(char *filename)
     ui.default_path = g_path_get_dirname(filename);
   }
   
-  context = g_markup_parse_context_new(&parser, 0, NULL, NULL);
+#ifdef PERF_DEBUG
+  timer = g_timer_new();
+#endif
   valid = TRUE;
   tmpJournal.npages = 0;
   tmpJournal.pages = NULL;
   tmpJournal.last_attach_no = 0;
+  tmpJournal.lazy_source = NULL;
+  tmpJournal.lazy_pages = 0;
   tmpPage = NULL;
-  tmpLayer = NULL;
-  tmpItem = NULL;
   tmpFilename = filename_actual;
-  error = NULL;
   tmpBg_pdf = NULL;
   maybe_pdf = TRUE;
 
-  while (valid && !gzeof(f)) {
-    len = gzread(f, buffer, 1000);
-    if (len<0) valid = FALSE;
-    if (maybe_pdf && len>=4 && !strncmp(buffer, "%PDF", 4))
-      { valid = FALSE; break; } // most likely pdf
-    else maybe_pdf = FALSE;
-    if (len<=0) break;
-    valid = g_markup_parse_context_parse(context, buffer, len, &error);
+  if (is_binary_journal(filename_actual)) {
+    gzclose(f);
+    maybe_pdf = FALSE;
+    valid = load_binary_journal(filename_actual);
   }
-  gzclose(f);
-  if (valid) valid = g_markup_parse_context_end_parse(context, &error);
+  else { // read the whole document, so its pages can be parsed in parallel
+    valid = read_xoj_file(filename_actual, f, &in);
+    gzclose(f);
+    maybe_pdf = (valid && in.len>=4 && !strncmp(in.text, "%PDF", 4));
+    if (maybe_pdf) valid = FALSE; // most likely pdf
+#ifdef PERF_DEBUG
+    t_read = g_timer_elapsed(timer, NULL);
+    t_parse = g_timer_elapsed(timer, NULL);
+#endif
+    if (valid) valid = parse_xoj_document(in.text, in.len);
+#ifdef PERF_DEBUG
+    t_parse = g_timer_elapsed(timer, NULL) - t_parse;
+    printf("DEBUG: %s %.1f MB in %.1f ms, parsed it in %.1f ms (%.1f MB/s)\n",
+           (in.mapping != NULL) ? "mapped" : "read and uncompressed", in.len/1e6,
+           t_read*1000, t_parse*1000, t_parse>0 ? in.len/1e6/t_parse : 0.);
+#endif
+    free_xoj_input(&in);
+    // restoring an auto-save: add the changes logged since
+    if (valid && strcmp(filename, filename_actual)) 
+      replay_autosave_log(filename_actual);
+  }
+  forget_image_ids(); // the images hold on to their PNG themselves
   if (tmpJournal.npages == 0) valid = FALSE;
-  g_markup_parse_context_free(context);
+#ifdef PERF_DEBUG
+  printf("DEBUG: loaded %d pages from %s in %.1f ms\n", tmpJournal.npages,
+         filename_actual, g_timer_elapsed(timer, NULL)*1000);
+  g_timer_destroy(timer);
+#endif
   
   if (!valid) {
     g_free(filename_actual);
@@ -1119,6 +2885,9 @@ gboolean open_journal(char *filename)
   ui.saved = TRUE; // force close_journal() to do its job
   close_journal();
   g_memmove(&journal, &tmpJournal, sizeof(struct Journal));
+  invalidate_bgpdf_index();
+  for (tmplist = journal.pages; tmplist!=NULL; tmplist = tmplist->next)
+    images_undecoded += page_undecoded_images((struct Page *)tmplist->data);
   
   // if we need to initialize a fresh pdf loader
   if (tmpBg_pdf!=NULL) { 
@@ -1166,6 +2935,7 @@ gboolean open_journal(char *filename)
   
   ui.pageno = 0;
   ui.cur_page = (struct Page *)journal.pages->data;
+  load_page_contents(ui.cur_page);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   ui.zoom = ui.startup_zoom;
@@ -1194,11 +2964,697 @@ gboolean open_journal(char *filename)
     }
     gtk_widget_destroy(dialog);
   }
-  else ui.saved = TRUE;
+  else ui.saved = TRUE;
+
+  g_free(filename_actual);
+  ui.need_autosave = !ui.saved;
+  return TRUE;
+}
+
+/************ binary journal format *************/
+
+/* A .xojb file holds the same information as a .xoj file, in a form that
+   is much faster to read and write. All numbers are little-endian:
+     - header: the magic "XOJB", the format version and the number of pages
+       (32-bit each);
+     - offset table: for each page, the 64-bit file offset of its chunk,
+       the 32-bit size of the chunk and the uncompressed size of its body;
+     - page chunks: the 32-bit size of the page head, the head itself
+       (page size and background, uncompressed so that a page index can be
+       built without inflating anything), then the zlib-compressed body
+       (layers and items). See xojb_write_page() for their contents.
+   Stroke coordinates and widths are packed as 32-bit floats, which is
+   more than the precision of the .xoj format (1/100 pt). */
+
+void xojb_put_byte(GByteArray *buf, int val)
+{
+  guint8 b = val;
+  g_byte_array_append(buf, &b, 1);
+}
+
+void xojb_put_uint(GByteArray *buf, guint32 val)
+{
+  val = GUINT32_TO_LE(val);
+  g_byte_array_append(buf, (guint8 *)&val, 4);
+}
+
+void xojb_put_double(GByteArray *buf, double val)
+{
+  union { gdouble d; guint64 i; } u;
+  u.d = val;
+  u.i = GUINT64_TO_LE(u.i);
+  g_byte_array_append(buf, (guint8 *)&u.i, 8);
+}
+
+void xojb_put_floats(GByteArray *buf, const double *vals, int n)
+{
+  union { gfloat f; guint32 i; } u;
+  
+  for (; n>0; n--, vals++) {
+    u.f = *vals;
+    xojb_put_uint(buf, u.i);
+  }
+}
+
+void xojb_put_data(GByteArray *buf, const gchar *data, gsize len)
+{
+  xojb_put_uint(buf, len);
+  g_byte_array_append(buf, (const guint8 *)data, len);
+}
+
+void xojb_put_string(GByteArray *buf, const gchar *s)
+{
+  xojb_put_data(buf, s, strlen(s));
+}
+
+// serialize the size and background of a page
+
+void xojb_write_page_head(GByteArray *buf, struct Page *pg, int clone_of,
+                          const char *filename, gboolean is_auto)
+{
+  xojb_put_double(buf, pg->width);
+  xojb_put_double(buf, pg->height);
+  xojb_put_byte(buf, pg->bg->type);
+  if (pg->bg->type == BG_SOLID) {
+    xojb_put_uint(buf, pg->bg->color_no);
+    xojb_put_uint(buf, pg->bg->color_rgba);
+    xojb_put_byte(buf, pg->bg->ruling);
+  }
+  else if (pg->bg->type == BG_PIXMAP) {
+    if (clone_of >= 0) {
+      xojb_put_byte(buf, DOMAIN_CLONE);
+      xojb_put_uint(buf, clone_of);
+    } else {
+      if (pg->bg->file_domain == DOMAIN_ATTACH)
+        save_bg_attachment(pg->bg, filename, is_auto);
+      xojb_put_byte(buf, pg->bg->file_domain);
+      xojb_put_string(buf, pg->bg->filename->s);
+    }
+  }
+  else if (pg->bg->type == BG_PDF) {
+    if (clone_of >= 0) xojb_put_byte(buf, DOMAIN_CLONE);
+    else {
+      if (pg->bg->file_domain == DOMAIN_ATTACH)
+        save_bg_attachment(pg->bg, filename, is_auto);
+      xojb_put_byte(buf, pg->bg->file_domain);
+      xojb_put_string(buf, pg->bg->filename->s);
+    }
+    xojb_put_uint(buf, pg->bg->file_page_seq);
+  }
+}
+
+// serialize a page (head and body): returns false if an image could not be encoded
+
+gboolean xojb_write_page(GByteArray *head, GByteArray *buf, struct Page *pg, int clone_of,
+                         const char *filename, gboolean is_auto)
+{
+  struct Layer *layer;
+  struct Item *item;
+  GList *layerlist, *itemlist;
+  gboolean success;
+  
+  success = TRUE;
+  xojb_write_page_head(head, pg, clone_of, filename, is_auto);
+  xojb_put_uint(buf, pg->nlayers);
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    layer = (struct Layer *)layerlist->data;
+    xojb_put_uint(buf, g_list_length(layer->items));
+    for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      xojb_put_byte(buf, item->type);
+      if (item->type == ITEM_STROKE) {
+        xojb_put_byte(buf, item->brush.tool_type);
+        xojb_put_uint(buf, item->brush.color_no);
+        xojb_put_uint(buf, item->brush.color_rgba);
+        xojb_put_double(buf, item->brush.thickness);
+        xojb_put_byte(buf, item->brush.variable_width);
+        xojb_put_uint(buf, item->path->num_points);
+        xojb_put_floats(buf, item->path->coords, 2*item->path->num_points);
+        if (item->brush.variable_width)
+          xojb_put_floats(buf, item->widths, item->path->num_points-1);
+      }
+      else if (item->type == ITEM_TEXT) {
+        xojb_put_string(buf, item->font_name);
+        xojb_put_double(buf, item->font_size);
+        xojb_put_double(buf, item->bbox.left);
+        xojb_put_double(buf, item->bbox.top);
+        xojb_put_uint(buf, item->brush.color_no);
+        xojb_put_uint(buf, item->brush.color_rgba);
+        xojb_put_string(buf, item->text);
+      }
+      else if (item->type == ITEM_IMAGE) {
+        xojb_put_double(buf, item->bbox.left);
+        xojb_put_double(buf, item->bbox.top);
+        xojb_put_double(buf, item->bbox.right);
+        xojb_put_double(buf, item->bbox.bottom);
+        if (!encode_image_png(item)) success = FALSE;
+        xojb_put_data(buf, item->image_png, item->image_png_len);
+      }
+    }
+  }
+  return success;
+}
+
+// saves the journal in binary format: returns true on success, false on error
+
+gboolean save_binary_journal(const char *filename, gboolean is_auto)
+{
+  FILE *f;
+  GByteArray *buf, *head, *header, *chunk;
+  GList *pagelist;
+  struct Page *pg;
+  guchar *zbuf;
+  uLongf zlen;
+  guint64 offset;
+  gboolean success;
+  int *clones, i, level;
+  XojbReader r;
+  gsize size;
+  gchar *tmpfilename;
+#ifdef PERF_DEBUG
+  GTimer *timer = g_timer_new();
+  int ncopied = 0;
+#endif
+
+  level = is_auto ? ui.autosave_compression_level : ui.compression_level;
+  /* the unread pages are copied from journal.lazy_source, which may well
+     be the file we are saving to: write a new file, then replace the old
+     one, which stays readable as long as we keep it open */
+  tmpfilename = g_strdup_printf("%s.tmp", filename);
+  f = g_fopen(tmpfilename, "wb");
+  if (f==NULL) { g_free(tmpfilename); return FALSE; }
+  chk_attach_names();
+  if (is_auto)
+    ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(filename));
+
+  // the offset table gets filled in as the pages are written
+  header = g_byte_array_new();
+  g_byte_array_append(header, (const guint8 *)XOJB_MAGIC, 4);
+  xojb_put_uint(header, XOJB_VERSION);
+  xojb_put_uint(header, journal.npages);
+  g_byte_array_set_size(header, XOJB_HEADER_SIZE + XOJB_TABLE_ENTRY_SIZE*journal.npages);
+  memset(header->data + XOJB_HEADER_SIZE, 0, header->len - XOJB_HEADER_SIZE);
+  success = (fwrite(header->data, 1, header->len, f) == header->len);
+  offset = header->len;
+  g_byte_array_set_size(header, XOJB_HEADER_SIZE);
+
+  buf = g_byte_array_new();
+  head = g_byte_array_new();
+  chunk = g_byte_array_new();
+  clones = find_bg_clones();
+  for (pagelist = journal.pages, i = 0; pagelist!=NULL && success; 
+       pagelist = pagelist->next, i++) {
+    pg = (struct Page *)pagelist->data;
+    g_byte_array_set_size(head, 4); // room for the size of the head
+    if (pg->lazy_chunk >= 0 && journal.lazy_source != NULL) {
+      // a page that wasn't read in: the head may have changed (background
+      // file names, page size), but the compressed contents are still good
+      xojb_write_page_head(head, pg, clones[i], filename, is_auto);
+      if (!xojb_read_chunk(journal.lazy_source, journal.lazy_length, pg->lazy_chunk,
+                           TRUE, chunk, &r, NULL, &size)) {
+        success = FALSE;
+        break;
+      }
+      *(guint32 *)head->data = GUINT32_TO_LE(head->len - 4);
+      zlen = r.end - r.ptr;
+      if (fwrite(head->data, 1, head->len, f) != head->len ||
+          fwrite(r.ptr, 1, zlen, f) != zlen)
+        success = FALSE;
+#ifdef PERF_DEBUG
+      ncopied++;
+#endif
+    }
+    else {
+      load_page_contents(pg);
+      g_byte_array_set_size(buf, 0);
+      if (!xojb_write_page(head, buf, pg, clones[i], filename, is_auto))
+        success = FALSE; // an image that couldn't be encoded
+      *(guint32 *)head->data = GUINT32_TO_LE(head->len - 4);
+      zlen = compressBound(buf->len);
+      zbuf = g_malloc(zlen);
+      if (compress2(zbuf, &zlen, buf->data, buf->len, level) != Z_OK ||
+          fwrite(head->data, 1, head->len, f) != head->len ||
+          fwrite(zbuf, 1, zlen, f) != zlen)
+        success = FALSE;
+      g_free(zbuf);
+      size = buf->len;
+    }
+    xojb_put_uint(header, (guint32)(offset & 0xffffffff));
+    xojb_put_uint(header, (guint32)(offset >> 32));
+    xojb_put_uint(header, head->len + zlen);
+    xojb_put_uint(header, size);
+    offset += head->len + zlen;
+  }
+  g_free(clones);
+  g_byte_array_free(buf, TRUE);
+  g_byte_array_free(head, TRUE);
+  g_byte_array_free(chunk, TRUE);
+
+  if (success) success = (fseek(f, XOJB_HEADER_SIZE, SEEK_SET) == 0);
+  if (success) 
+    success = (fwrite(header->data + XOJB_HEADER_SIZE, 1, header->len - XOJB_HEADER_SIZE, f)
+                  == header->len - XOJB_HEADER_SIZE);
+  g_byte_array_free(header, TRUE);
+  if (fclose(f) != 0) success = FALSE;
+  if (success) success = (g_rename(tmpfilename, filename) == 0);
+  if (!success) g_unlink(tmpfilename);
+  g_free(tmpfilename);
+
+#ifdef PERF_DEBUG
+  printf("DEBUG: saved %d pages in binary format (%d copied unread) in %.1f ms\n", 
+         journal.npages, ncopied, g_timer_elapsed(timer, NULL)*1000);
+  g_timer_destroy(timer);
+#endif
+  return success;
+}
+
+const guchar *xojb_get_bytes(XojbReader *r, gsize len)
+{
+  const guchar *p = r->ptr;
+  
+  if (!r->ok || len > (gsize)(r->end - r->ptr)) { r->ok = FALSE; return NULL; }
+  r->ptr += len;
+  return p;
+}
+
+int xojb_get_byte(XojbReader *r)
+{
+  const guchar *p = xojb_get_bytes(r, 1);
+  return (p!=NULL) ? *p : 0;
+}
+
+guint32 xojb_get_uint(XojbReader *r)
+{
+  const guchar *p = xojb_get_bytes(r, 4);
+  if (p==NULL) return 0;
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((guint32)p[3]<<24);
+}
+
+double xojb_get_double(XojbReader *r)
+{
+  union { gdouble d; guint64 i; } u;
+  u.i = xojb_get_uint(r);
+  u.i |= ((guint64)xojb_get_uint(r))<<32;
+  return r->ok ? u.d : 0.;
+}
+
+void xojb_get_floats(XojbReader *r, double *vals, int n)
+{
+  union { gfloat f; guint32 i; } u;
+  
+  for (; n>0; n--, vals++) {
+    u.i = xojb_get_uint(r);
+    *vals = u.f;
+  }
+}
+
+gchar *xojb_get_string(XojbReader *r, gsize *len)
+{
+  const guchar *p;
+  gchar *s;
+  gsize n;
+  
+  n = xojb_get_uint(r);
+  p = xojb_get_bytes(r, n);
+  if (p==NULL) return NULL;
+  s = g_malloc(n+1);
+  g_memmove(s, p, n);
+  s[n] = 0;
+  if (len!=NULL) *len = n;
+  return s;
+}
+
+// rebuild the size and background of a page of tmpJournal from its head
+
+gboolean xojb_read_page_head(XojbReader *r)
+{
+  struct Page *pg;
+  struct Background *tmpbg;
+  char *name;
+  int i;
+  
+  tmpPage = (struct Page *)g_malloc(sizeof(struct Page));
+  tmpPage->serial = new_serial();
+  tmpPage->layers = NULL;
+  tmpPage->nlayers = 0;
+  tmpPage->group = NULL;
+  tmpPage->lazy_chunk = -1;
+  tmpPage->pdf_index_no = 0;
+  tmpPage->bg = g_new(struct Background, 1);
+  tmpPage->bg->serial = new_serial();
+  tmpPage->bg->canvas_item = NULL;
+  tmpPage->bg->pixbuf = NULL;
+  tmpPage->bg->filename = NULL;
+  tmpJournal.pages = g_list_append(tmpJournal.pages, tmpPage);
+  tmpJournal.npages++;
+  
+  tmpPage->width = xojb_get_double(r);
+  tmpPage->height = xojb_get_double(r);
+  tmpPage->bg->type = xojb_get_byte(r);
+  if (tmpPage->bg->type == BG_SOLID) {
+    tmpPage->bg->color_no = (gint32)xojb_get_uint(r);
+    tmpPage->bg->color_rgba = xojb_get_uint(r);
+    tmpPage->bg->ruling = xojb_get_byte(r);
+    if (tmpPage->bg->color_no >= COLOR_MAX || tmpPage->bg->ruling > RULING_GRAPH)
+      return FALSE;
+  }
+  else if (tmpPage->bg->type == BG_PIXMAP || tmpPage->bg->type == BG_PDF) {
+    tmpPage->bg->file_domain = xojb_get_byte(r);
+    if (tmpPage->bg->file_domain == DOMAIN_CLONE) {
+      if (tmpPage->bg->type == BG_PDF) tmpbg = tmpBg_pdf;
+      else {
+        i = xojb_get_uint(r);
+        if (i < 0 || i > tmpJournal.npages-2) return FALSE;
+        pg = (struct Page *)g_list_nth_data(tmpJournal.pages, i);
+        if (pg == NULL) return FALSE;
+        tmpbg = pg->bg;
+        if (tmpbg->type != BG_PIXMAP) return FALSE;
+      }
+      if (tmpbg == NULL) return FALSE;
+      tmpPage->bg->filename = refstring_ref(tmpbg->filename);
+      tmpPage->bg->pixbuf = tmpbg->pixbuf;
+      if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
+      tmpPage->bg->file_domain = tmpbg->file_domain;
+    }
+    else if (tmpPage->bg->file_domain == DOMAIN_ABSOLUTE ||
+             tmpPage->bg->file_domain == DOMAIN_ATTACH) {
+      name = xojb_get_string(r, NULL);
+      if (name == NULL) return FALSE;
+      tmpPage->bg->filename = new_refstring(name);
+      if (tmpPage->bg->type == BG_PIXMAP)
+        tmpPage->bg->pixbuf = load_bg_pixbuf(name, tmpPage->bg->file_domain);
+      else if (tmpBg_pdf == NULL) tmpBg_pdf = tmpPage->bg;
+      g_free(name);
+    }
+    else return FALSE;
+    if (tmpPage->bg->type == BG_PDF)
+      tmpPage->bg->file_page_seq = xojb_get_uint(r);
+  }
+  else return FALSE;
+  return r->ok;
+}
+
+// read one item from the body of a page chunk, or return NULL
+
+struct Item *xojb_read_item(XojbReader *r)
+{
+  struct Item *item;
+  int n, i;
+
+  item = g_new0(struct Item, 1);
+  item->type = xojb_get_byte(r);
+  item->canvas_item = NULL;
+  if (item->type == ITEM_STROKE) {
+    item->brush.tool_type = xojb_get_byte(r);
+    item->brush.color_no = (gint32)xojb_get_uint(r);
+    item->brush.color_rgba = xojb_get_uint(r);
+    item->brush.thickness = xojb_get_double(r);
+    item->brush.variable_width = (xojb_get_byte(r) != 0);
+    item->brush.thickness_no = 0;  // who cares ?
+    item->brush.tool_options = 0;  // who cares ?
+    item->brush.ruler = FALSE;
+    item->brush.recognizer = FALSE;
+    n = xojb_get_uint(r);
+    if (!r->ok || n < 2 || item->brush.tool_type >= NUM_STROKE_TOOLS ||
+        item->brush.color_no >= COLOR_MAX || 
+        (gsize)n > (gsize)(r->end - r->ptr)/8) 
+      { g_free(item); return NULL; }
+    item->path = gnome_canvas_points_new(n);
+    xojb_get_floats(r, item->path->coords, 2*n);
+    for (i=0; i<2*n; i++)
+      if (!finite_sized(item->path->coords[i]))
+        item->path->coords[i] = (i>=2) ? item->path->coords[i-2] : 0;
+    if (item->brush.variable_width) {
+      item->widths = g_new(gdouble, n-1);
+      xojb_get_floats(r, item->widths, n-1);
+    }
+    if (!r->ok) {
+      gnome_canvas_points_free(item->path);
+      g_free(item->widths);
+      g_free(item);
+      return NULL;
+    }
+    update_item_bbox(item);
+  }
+  else if (item->type == ITEM_TEXT) {
+    item->font_name = xojb_get_string(r, NULL);
+    item->font_size = xojb_get_double(r);
+    item->bbox.left = xojb_get_double(r);
+    item->bbox.top = xojb_get_double(r);
+    item->brush.color_no = (gint32)xojb_get_uint(r);
+    item->brush.color_rgba = xojb_get_uint(r);
+    item->text = xojb_get_string(r, NULL);
+    if (!r->ok || item->brush.color_no >= COLOR_MAX) {
+      g_free(item->font_name);
+      g_free(item->text);
+      g_free(item);
+      return NULL;
+    }
+  }
+  else if (item->type == ITEM_IMAGE) {
+    item->bbox.left = xojb_get_double(r);
+    item->bbox.top = xojb_get_double(r);
+    item->bbox.right = xojb_get_double(r);
+    item->bbox.bottom = xojb_get_double(r);
+    item->image_png = xojb_get_string(r, &item->image_png_len);
+    item->image = NULL; // decoded when needed, see item_image()
+    if (item->image_png == NULL || item->image_png_len == 0) {
+      g_free(item->image_png);
+      g_free(item);
+      return NULL;
+    }
+    item->image_png = store_image_png(item->image_png, item->image_png_len);
+  }
+  else { g_free(item); return NULL; }
+  return item;
+}
+
+// inflate the body of a page chunk, and read its layers and items into pg
+
+gboolean xojb_read_layers(const guchar *zdata, gsize zsize, gsize size, struct Page *pg)
+{
+  XojbReader r;
+  guchar *raw;
+  uLongf rawlen;
+  struct Layer *layer;
+  struct Item *item;
+  int nlayers, nitems;
+
+  raw = g_try_malloc(size+1);
+  rawlen = size;
+  if (raw == NULL || uncompress(raw, &rawlen, zdata, zsize) != Z_OK || rawlen != size) {
+    g_free(raw);
+    return FALSE;
+  }
+  r.ptr = raw;
+  r.end = raw + size;
+  r.ok = TRUE;
+  nlayers = xojb_get_uint(&r);
+  if (nlayers <= 0 || (gsize)nlayers > size/4) r.ok = FALSE;
+  for (; nlayers>0 && r.ok; nlayers--) {
+    layer = g_new(struct Layer, 1);
+    layer->items = NULL;
+    layer->nitems = 0;
+    layer->save_cache = NULL;
+    layer->dirty = TRUE;
+    layer->serial = new_serial();
+    layer->group = NULL;
+    pg->layers = g_list_append(pg->layers, layer);
+    pg->nlayers++;
+    for (nitems = xojb_get_uint(&r); nitems>0 && r.ok; nitems--) {
+      item = xojb_read_item(&r);
+      if (item == NULL) { r.ok = FALSE; break; }
+      layer->items = g_list_prepend(layer->items, item);
+      layer->nitems++;
+    }
+    layer->items = g_list_reverse(layer->items);
+  }
+  g_free(raw);
+  return r.ok;
+}
+
+/* read the i-th page chunk of a binary journal from the file f, whose
+   size is length, into buf (only its head if want_body is FALSE). Then
+   point r at the chunk body and head at the head (if not NULL), and get
+   the uncompressed size of the body */
+
+gboolean xojb_read_chunk(FILE *f, guint64 length, int i, gboolean want_body,
+                         GByteArray *buf, XojbReader *r, XojbReader *head, gsize *size)
+{
+  guchar entry[XOJB_TABLE_ENTRY_SIZE];
+  guint64 offset;
+  gsize chunksize, headsize, readsize;
+  
+  if (fseek(f, XOJB_HEADER_SIZE + (long)i*XOJB_TABLE_ENTRY_SIZE, SEEK_SET) != 0 ||
+      fread(entry, 1, XOJB_TABLE_ENTRY_SIZE, f) != XOJB_TABLE_ENTRY_SIZE)
+    return FALSE;
+  r->ptr = entry;
+  r->end = entry + XOJB_TABLE_ENTRY_SIZE;
+  r->ok = TRUE;
+  offset = xojb_get_uint(r);
+  offset |= ((guint64)xojb_get_uint(r))<<32;
+  chunksize = xojb_get_uint(r);
+  *size = xojb_get_uint(r);
+  if (offset > length || chunksize > length - offset || chunksize < 4 ||
+      offset > G_MAXLONG || fseek(f, (long)offset, SEEK_SET) != 0) return FALSE;
+  
+  g_byte_array_set_size(buf, 4);
+  if (fread(buf->data, 1, 4, f) != 4) return FALSE;
+  headsize = GUINT32_FROM_LE(*(guint32 *)buf->data);
+  readsize = want_body ? chunksize : MIN(chunksize, 4 + (gsize)headsize);
+  g_byte_array_set_size(buf, readsize);
+  if (fread(buf->data + 4, 1, readsize - 4, f) != readsize - 4) return FALSE;
+  r->ptr = buf->data;
+  r->end = buf->data + readsize;
+  xojb_get_uint(r); // the head size, again
+  if (head != NULL) {
+    head->ptr = xojb_get_bytes(r, headsize);
+    head->end = r->ok ? head->ptr + headsize : head->ptr;
+    head->ok = r->ok;
+  }
+  else xojb_get_bytes(r, headsize);
+  return r->ok;
+}
+
+// does the file start with the binary journal magic?
+
+gboolean is_binary_journal(const char *filename)
+{
+  FILE *f;
+  char magic[4];
+  gboolean ret;
+
+  f = g_fopen(filename, "rb");
+  if (f==NULL) return FALSE;
+  ret = (fread(magic, 1, 4, f) == 4 && !strncmp(magic, XOJB_MAGIC, 4));
+  fclose(f);
+  return ret;
+}
+
+/* read a binary journal into tmpJournal: returns true on success.
+   In lazy mode only the header, the offset table and the page heads (page
+   sizes and backgrounds) are read, and the file is kept open so that
+   load_page_contents() can get the rest later. Saving never overwrites
+   it in place (see save_binary_journal) */
+
+gboolean load_binary_journal(const char *filename)
+{
+  FILE *f;
+  struct stat stat_buf;
+  guchar header[XOJB_HEADER_SIZE];
+  GByteArray *buf;
+  gsize size;
+  XojbReader r, head;
+  int npages, i;
+  gboolean valid;
+#ifdef PERF_DEBUG
+  GTimer *timer = g_timer_new();
+#endif
+
+  f = g_fopen(filename, "rb");
+  if (f == NULL) return FALSE;
+  if (fstat(fileno(f), &stat_buf) != 0 || 
+      fread(header, 1, XOJB_HEADER_SIZE, f) != XOJB_HEADER_SIZE)
+    { fclose(f); return FALSE; }
+  r.ptr = header;
+  r.end = header + XOJB_HEADER_SIZE;
+  r.ok = TRUE;
+  xojb_get_bytes(&r, 4); // the magic number
+  valid = (xojb_get_uint(&r) == XOJB_VERSION);
+  npages = xojb_get_uint(&r);
+  if (!r.ok || npages <= 0 || 
+      (guint64)npages > (stat_buf.st_size - XOJB_HEADER_SIZE)/XOJB_TABLE_ENTRY_SIZE)
+    valid = FALSE;
+  
+  buf = g_byte_array_new();
+  for (i = 0; i < npages && valid; i++) {
+    valid = xojb_read_chunk(f, stat_buf.st_size, i, !ui.lazy_load, buf, &r, &head, &size)
+            && xojb_read_page_head(&head);
+    if (!valid) break;
+    if (ui.lazy_load) {
+      tmpPage->lazy_chunk = i;
+      tmpJournal.lazy_pages++;
+    }
+    else valid = xojb_read_layers(r.ptr, r.end - r.ptr, size, tmpPage);
+  }
+  g_byte_array_free(buf, TRUE);
+  tmpPage = NULL;
+
+  if (valid && tmpJournal.lazy_pages > 0) {
+    tmpJournal.lazy_source = f;
+    tmpJournal.lazy_length = stat_buf.st_size;
+  }
+  else fclose(f);
+#ifdef PERF_DEBUG
+  printf("DEBUG: opened a binary journal of %d pages (%d unread) in %.1f ms\n", 
+         npages, tmpJournal.lazy_pages, g_timer_elapsed(timer, NULL)*1000);
+  g_timer_destroy(timer);
+#endif
+  return valid;
+}
+
+void free_mapped_file(GMappedFile *mapping)
+{
+#if GLIB_CHECK_VERSION(2,22,0)
+  g_mapped_file_unref(mapping);
+#else
+  g_mapped_file_free(mapping);
+#endif
+}
+
+/* read in the layers and items of a page of a lazily loaded binary
+   journal; this must happen before anything looks at them */
+
+void load_page_contents(struct Page *pg)
+{
+  XojbReader r;
+  gsize size;
+  struct Layer *layer;
+  GByteArray *buf;
+  
+  if (pg->lazy_chunk < 0) return;
+  buf = g_byte_array_new();
+  if (journal.lazy_source == NULL ||
+      !xojb_read_chunk(journal.lazy_source, journal.lazy_length, pg->lazy_chunk, 
+                       TRUE, buf, &r, NULL, &size) ||
+      !xojb_read_layers(r.ptr, r.end - r.ptr, size, pg))
+    g_warning(_("Could not read page contents from the journal file"));
+  g_byte_array_free(buf, TRUE);
+  if (pg->nlayers == 0) { // keep the page usable anyway
+    layer = g_new(struct Layer, 1);
+    layer->items = NULL;
+    layer->nitems = 0;
+    layer->save_cache = NULL;
+    layer->dirty = TRUE;
+    layer->serial = new_serial();
+    layer->group = NULL;
+    pg->layers = g_list_append(NULL, layer);
+    pg->nlayers = 1;
+  }
+  pg->lazy_chunk = -1;
+  images_undecoded += page_undecoded_images(pg);
+  if (pg->group != NULL) make_page_canvas_items(pg);
+  if (--journal.lazy_pages <= 0) free_lazy_source();
+}
 
-  g_free(filename_actual);
-  ui.need_autosave = !ui.saved;
-  return TRUE;
+// read in everything that hasn't been yet (before saving, etc.)
+
+void load_all_pages(void)
+{
+  GList *pglist;
+  
+  if (journal.lazy_source == NULL) return;
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next)
+    load_page_contents((struct Page *)pglist->data);
+  free_lazy_source();
+}
+
+void free_lazy_source(void)
+{
+  if (journal.lazy_source != NULL) fclose(journal.lazy_source);
+  journal.lazy_source = NULL;
+  journal.lazy_length = 0;
+  journal.lazy_pages = 0;
 }
 
 /************ file backgrounds *************/
@@ -1212,6 +3668,7 @@ struct Background *attempt_load_pix_bg(char *filename, gboolean attach)
   if (pix == NULL) return NULL;
   
   bg = g_new(struct Background, 1);
+  bg->serial = new_serial();
   bg->type = BG_PIXMAP;
   bg->canvas_item = NULL;
   bg->pixbuf = pix;
@@ -1285,6 +3742,7 @@ GList *attempt_load_gv_bg(char *filename)
       g_object_unref(loader);
       loader = NULL;
       bg = g_new(struct Background, 1);
+      bg->serial = new_serial();
       bg->canvas_item = NULL;
       bg->pixbuf = pix;
       bg->pixbuf_scale = (GS_BITMAP_DPI/72.0);
@@ -1318,161 +3776,1150 @@ struct Background *attempt_screenshot_bg(void)
       False, ButtonReleaseMask, GrabModeAsync, GrabModeSync, None, None))
     return NULL;
 
-  XWindowEvent (GDK_DISPLAY(), x_root, ButtonReleaseMask, &x_event);
-  XUngrabButton(GDK_DISPLAY(), AnyButton, AnyModifier, x_root);
+  XWindowEvent (GDK_DISPLAY(), x_root, ButtonReleaseMask, &x_event);
+  XUngrabButton(GDK_DISPLAY(), AnyButton, AnyModifier, x_root);
+
+  x_win = x_event.xbutton.subwindow;
+  if (x_win == None) x_win = x_root;
+
+  window = gdk_window_foreign_new_for_display(gdk_display_get_default(), x_win);
+    
+  gdk_window_get_geometry(window, &x, &y, &w, &h, NULL);
+  cmap = gdk_drawable_get_colormap(window);
+  if (cmap == NULL) cmap = gdk_colormap_get_system();
+  
+  pix = gdk_pixbuf_get_from_drawable(NULL, window,
+     cmap, 0, 0, 0, 0, w, h);
+    
+  if (pix == NULL) return NULL;
+  
+  bg = g_new(struct Background, 1);
+  bg->serial = new_serial();
+  bg->type = BG_PIXMAP;
+  bg->canvas_item = NULL;
+  bg->pixbuf = pix;
+  bg->pixbuf_scale = DEFAULT_ZOOM;
+  bg->filename = new_refstring(NULL);
+  bg->file_domain = DOMAIN_ATTACH;
+  return bg;
+#else
+  // not implemented on non-X11 backends
+  return FALSE;
+#endif
+}
+
+/************** pdf annotation ***************/
+
+/* cancel a request */
+
+void cancel_bgpdf_request(struct BgPdfRequest *req)
+{
+  GList *list_link;
+  
+  list_link = g_list_find(bgpdf.requests, req);
+  if (list_link == NULL) return;
+  // remove the request
+  bgpdf.requests = g_list_delete_link(bgpdf.requests, list_link);
+  g_free(req);
+}
+
+/* the rendered pages are kept within a memory budget (ui.pdf_cache_size):
+   when over budget, drop the least recently displayed off-screen pages.
+   rescale_bg_pixmaps() requests them again when they come back into view */
+
+void bgpdf_evict_page(int pageno, struct BgPdfPage *bgpg)
+{
+  GList *list;
+  struct Page *pg;
+
+  for (list = bgpdf_pages_using(pageno); list!=NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq != pageno) continue;
+    if (pg->bg->pixbuf!=NULL) g_object_unref(pg->bg->pixbuf);
+    pg->bg->pixbuf = NULL;
+    pg->bg->pixbuf_scale = 0;
+    pg->bg->pixel_width = pg->bg->pixel_height = 0;
+    update_canvas_bg(pg); // just removes the canvas item, so the memory goes
+  }
+  g_object_unref(bgpg->pixbuf);
+  bgpg->pixbuf = NULL;
+  bgpdf.cache_bytes -= bgpg->bytes;
+  bgpg->bytes = 0;
+  bgpg->evicted = TRUE;
+}
+
+void bgpdf_trim_cache(void)
+{
+  GList *list;
+  struct Page *pg;
+  struct BgPdfPage *bgpg, *victim;
+  struct BgPdfTile *tile, *victim_tile;
+  gboolean *on_screen;
+  int pageno, victim_pageno, i;
+
+  if (bgpdf_cache_fits(bgpdf.cache_bytes)) return;
+
+  // keep the pages on screen, and those prefetched in the scroll direction
+  on_screen = g_new0(gboolean, bgpdf.npages+1);
+  for (list = journal.pages, i = 0; list!=NULL; list = list->next, i++) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type == BG_PDF && pg->bg->file_page_seq <= bgpdf.npages &&
+        (is_visible(pg) || bgpdf_page_priority(i, bgpdf.view_first_page, 
+                             bgpdf.view_last_page) < BGPDF_PRIORITY_OTHER))
+      on_screen[pg->bg->file_page_seq] = TRUE;
+  }
+  
+  while (!bgpdf_cache_fits(bgpdf.cache_bytes)) {
+    victim = NULL;
+    for (list = bgpdf.pages, pageno = 1; list!=NULL; list = list->next, pageno++) {
+      bgpg = (struct BgPdfPage *)list->data;
+      if (bgpg->pixbuf == NULL || on_screen[pageno]) continue;
+      if (victim == NULL || bgpg->last_used < victim->last_used)
+        { victim = bgpg; victim_pageno = pageno; }
+    }
+    // tiles are on screen if displayed by the latest rescale
+    victim_tile = NULL;
+    for (list = bgpdf.tiles; list!=NULL; list = list->next) {
+      tile = (struct BgPdfTile *)list->data;
+      if (tile->last_used == bgpdf.cache_clock) continue;
+      if (victim_tile == NULL || tile->last_used < victim_tile->last_used)
+        victim_tile = tile;
+    }
+    if (victim_tile != NULL && 
+        (victim == NULL || victim_tile->last_used <= victim->last_used))
+      bgpdf_evict_tile(victim_tile);
+    else if (victim != NULL) bgpdf_evict_page(victim_pageno, victim);
+    else break; // all that's left is on screen
+  }
+  g_free(on_screen);
+}
+
+// would the cache stay within budget if it held that many bytes?
+
+gboolean bgpdf_cache_fits(gsize bytes)
+{
+  return (ui.pdf_cache_size <= 0 || bytes <= (gsize)ui.pdf_cache_size*1024*1024);
+}
+
+/* called by rescale_bg_pixmaps() for the pages on screen; new_in_view is
+   TRUE if the page just scrolled into view, for the hit/miss statistics */
+
+void bgpdf_touch_page(int pageno, gboolean new_in_view)
+{
+  struct BgPdfPage *bgpg;
+  
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  bgpg = (pageno <= bgpdf.npages) ? g_list_nth_data(bgpdf.pages, pageno-1) : NULL;
+  if (bgpg != NULL && bgpg->pixbuf != NULL) {
+    bgpg->last_used = bgpdf.cache_clock;
+    if (new_in_view) bgpdf.cache_hits++;
+  }
+  else if (new_in_view) bgpdf.cache_misses++;
+}
+
+gboolean bgpdf_page_evicted(int pageno)
+{
+  struct BgPdfPage *bgpg;
+
+  if (bgpdf.status == STATUS_NOT_INIT || pageno > bgpdf.npages) return FALSE;
+  bgpg = g_list_nth_data(bgpdf.pages, pageno-1);
+  return (bgpg != NULL && bgpg->evicted);
+}
+
+/* a whole page render is limited to BGPDF_MAX_PAGE_PIXELS; beyond the
+   corresponding zoom, the visible parts of the page get rendered at full
+   resolution in tiles of BGPDF_TILE_SIZE pixels, displayed over the
+   (blurry) whole page render; the tiles share the cache budget */
+
+double bgpdf_max_page_zoom(struct Page *pg)
+{
+  return sqrt(BGPDF_MAX_PAGE_PIXELS/(pg->width*pg->height));
+}
+
+struct BgPdfTile *bgpdf_find_tile(int pageno, double dpi, int tile_x, int tile_y)
+{
+  GList *list;
+  struct BgPdfTile *tile;
+
+  for (list = bgpdf.tiles; list!=NULL; list = list->next) {
+    tile = (struct BgPdfTile *)list->data;
+    if (tile->pageno == pageno && tile->dpi == dpi &&
+        tile->tile_x == tile_x && tile->tile_y == tile_y) return tile;
+  }
+  return NULL;
+}
+
+void bgpdf_tile_item_destroyed(GtkObject *object, gpointer data)
+{
+  bgpdf.tile_items = g_list_remove(bgpdf.tile_items, data);
+  g_free(data);
+}
+
+void bgpdf_show_tile(struct Page *pg, struct BgPdfTile *tile)
+{
+  GList *list;
+  struct BgPdfTileItem *titem;
+  double scale_x, scale_y;
+  gboolean is_well_scaled;
+
+  for (list = bgpdf.tile_items; list!=NULL; list = list->next) {
+    titem = (struct BgPdfTileItem *)list->data;
+    if (titem->page == pg && titem->tile == tile) return;
+  }
+  if (pg->group == NULL || pg->bg->type != BG_PDF) return;
+  
+  titem = g_new(struct BgPdfTileItem, 1);
+  titem->page = pg;
+  titem->tile = tile;
+  scale_x = pg->width/tile->page_pixel_width;
+  scale_y = pg->height/tile->page_pixel_height;
+  is_well_scaled = (fabs(tile->page_pixel_width - pg->width*ui.zoom) < 2.
+                 && fabs(tile->page_pixel_height - pg->height*ui.zoom) < 2.);
+  if (is_well_scaled)
+    titem->canvas_item = gnome_canvas_item_new(pg->group, 
+        gnome_canvas_pixbuf_get_type(), "pixbuf", tile->pixbuf,
+        "x", tile->tile_x*BGPDF_TILE_SIZE*scale_x, 
+        "y", tile->tile_y*BGPDF_TILE_SIZE*scale_y,
+        "width-in-pixels", TRUE, "height-in-pixels", TRUE, 
+        NULL);
+  else
+    titem->canvas_item = gnome_canvas_item_new(pg->group, 
+        gnome_canvas_pixbuf_get_type(), "pixbuf", tile->pixbuf,
+        "x", tile->tile_x*BGPDF_TILE_SIZE*scale_x, 
+        "y", tile->tile_y*BGPDF_TILE_SIZE*scale_y,
+        "width", gdk_pixbuf_get_width(tile->pixbuf)*scale_x, 
+        "height", gdk_pixbuf_get_height(tile->pixbuf)*scale_y, 
+        "width-set", TRUE, "height-set", TRUE, 
+        NULL);
+  lower_canvas_item_to(pg->group, titem->canvas_item, pg->bg->canvas_item);
+  g_signal_connect(titem->canvas_item, "destroy", 
+                   G_CALLBACK(bgpdf_tile_item_destroyed), titem);
+  bgpdf.tile_items = g_list_prepend(bgpdf.tile_items, titem);
+}
+
+/* remove the tiles shown on a page (on all pages if pg is NULL) */
+
+void bgpdf_clear_tile_items(struct Page *pg)
+{
+  GList *list;
+  struct BgPdfTileItem *titem;
+
+  for (list = bgpdf.tile_items; list!=NULL; ) {
+    titem = (struct BgPdfTileItem *)list->data;
+    list = list->next; // the destroy handler removes titem from the list
+    if (pg == NULL || titem->page == pg) 
+      gtk_object_destroy(GTK_OBJECT(titem->canvas_item));
+  }
+}
+
+void bgpdf_evict_tile(struct BgPdfTile *tile)
+{
+  GList *list;
+  struct BgPdfTileItem *titem;
+
+  for (list = bgpdf.tile_items; list!=NULL; ) {
+    titem = (struct BgPdfTileItem *)list->data;
+    list = list->next;
+    if (titem->tile == tile) gtk_object_destroy(GTK_OBJECT(titem->canvas_item));
+  }
+  bgpdf.tiles = g_list_remove(bgpdf.tiles, tile);
+  bgpdf.cache_bytes -= tile->bytes;
+  g_object_unref(tile->pixbuf);
+  g_free(tile);
+}
+
+/* forget the tiles that are not at the given resolution (all of them
+   if dpi is 0, i.e. not zoomed in enough to use tiles) */
+
+void bgpdf_drop_tiles(double dpi)
+{
+  GList *list;
+  struct BgPdfTile *tile;
+  struct BgPdfRequest *req;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  for (list = bgpdf.tiles; list!=NULL; ) {
+    tile = (struct BgPdfTile *)list->data;
+    list = list->next;
+    if (tile->dpi != dpi) bgpdf_evict_tile(tile);
+  }
+  for (list = bgpdf.requests; list != NULL; ) {
+    req = (struct BgPdfRequest *)list->data;
+    list = list->next;
+    if (req->tile_x >= 0 && req->dpi != dpi) cancel_bgpdf_request(req);
+  }
+  for (list = bgpdf.rendering; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->tile_x >= 0 && req->dpi != dpi) g_atomic_int_set(&req->cancelled, TRUE);
+  }
+}
+
+/* show the tiles of a page that intersect the viewport, and request
+   the missing ones */
+
+void bgpdf_update_tiles(struct Page *pg)
+{
+  GtkAdjustment *hadj, *vadj;
+  double left, right, top, bottom, tile_size;
+  int tile_x, tile_y, max_x, max_y;
+  struct BgPdfTile *tile;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  hadj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+  vadj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  left = hadj->value/ui.zoom - pg->hoffset;
+  right = (hadj->value + hadj->page_size)/ui.zoom - pg->hoffset;
+  top = vadj->value/ui.zoom - pg->voffset;
+  bottom = (vadj->value + vadj->page_size)/ui.zoom - pg->voffset;
+
+  tile_size = BGPDF_TILE_SIZE/ui.zoom; // in page coordinates
+  max_x = (int)ceil(pg->width/tile_size) - 1;
+  max_y = (int)ceil(pg->height/tile_size) - 1;
+  for (tile_y = MAX(0, (int)floor(top/tile_size)); 
+       tile_y <= MIN(max_y, (int)floor(bottom/tile_size)); tile_y++)
+    for (tile_x = MAX(0, (int)floor(left/tile_size)); 
+         tile_x <= MIN(max_x, (int)floor(right/tile_size)); tile_x++) {
+      tile = bgpdf_find_tile(pg->bg->file_page_seq, 72*ui.zoom, tile_x, tile_y);
+      if (tile != NULL) {
+        tile->last_used = bgpdf.cache_clock;
+        bgpdf_show_tile(pg, tile);
+      }
+      else add_bgpdf_tile_request(pg->bg->file_page_seq, ui.zoom, 
+                                  tile_x, tile_y, BGPDF_PRIORITY_VISIBLE);
+    }
+}
+
+/* when scrolling without a full rescale_bg_pixmaps(): update the tiles
+   of the visible pages, and drop the queued ones that are out of view.
+   The visible pages are found by stepping from those seen last time */
+
+void bgpdf_update_visible_tiles(void)
+{
+  GList *list;
+  struct Page *pg;
+  struct BgPdfRequest *req;
+  int pageno, first_visible, last_visible, pos;
+
+  if (bgpdf.status == STATUS_NOT_INIT || journal.pages == NULL) return;
+  for (list = bgpdf.requests; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->tile_x >= 0) req->priority = G_MAXINT;
+  }
+  bgpdf.cache_clock++;
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE) {
+    pg = ui.cur_page;
+    if (pg->bg->type == BG_PDF && ui.zoom > bgpdf_max_page_zoom(pg)) 
+      bgpdf_update_tiles(pg);
+    bgpdf_cancel_stale_tile_requests();
+    return;
+  }
+  
+  pageno = CLAMP(bgpdf.view_first_page, 0, journal.npages-1);
+  list = g_list_nth(journal.pages, pageno);
+  while (list->prev != NULL && page_view_position((struct Page *)list->data) >= 0)
+    { list = list->prev; pageno--; }
+  first_visible = last_visible = -1;
+  for ( ; list != NULL; list = list->next, pageno++) {
+    pg = (struct Page *)list->data;
+    pos = page_view_position(pg);
+    if (pos > 0) break;
+    if (pos < 0) continue;
+    if (first_visible < 0) first_visible = pageno;
+    last_visible = pageno;
+    if (pg->bg->type == BG_PDF && ui.zoom > bgpdf_max_page_zoom(pg)) 
+      bgpdf_update_tiles(pg);
+  }
+  if (first_visible >= 0) {
+    if (first_visible != bgpdf.view_first_page) 
+      bgpdf.view_direction = (first_visible > bgpdf.view_first_page) ? 1 : -1;
+    bgpdf.view_first_page = first_visible;
+    bgpdf.view_last_page = last_visible;
+  }
+  bgpdf_cancel_stale_tile_requests();
+}
+
+void bgpdf_tile_finished(struct BgPdfRequest *req)
+{
+  GList *list;
+  struct Page *pg;
+  struct BgPdfTile *tile;
+
+  if (req->pixbuf == NULL) return; // keep showing the whole page render
+  tile = g_new(struct BgPdfTile, 1);
+  tile->pageno = req->pageno;
+  tile->dpi = req->dpi;
+  tile->tile_x = req->tile_x;
+  tile->tile_y = req->tile_y;
+  tile->pixbuf = req->pixbuf;
+  req->pixbuf = NULL;
+  tile->page_pixel_width = req->pixel_width;
+  tile->page_pixel_height = req->pixel_height;
+  tile->bytes = gdk_pixbuf_get_rowstride(tile->pixbuf) * 
+                gdk_pixbuf_get_height(tile->pixbuf);
+  tile->last_used = bgpdf.cache_clock;
+  bgpdf.tiles = g_list_prepend(bgpdf.tiles, tile);
+  bgpdf.cache_bytes += tile->bytes;
+
+  for (list = bgpdf_pages_using(tile->pageno); list!= NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq != tile->pageno) continue;
+    if (is_visible(pg)) bgpdf_show_tile(pg, tile);
+  }
+  bgpdf_trim_cache();
+  bgpdf_update_view_stats(req);
+}
+
+/* rendered pages are also kept on disk across sessions (ui.pdfcachedir),
+   as zlib-compressed pixel data after a one-line header. The file name
+   identifies the PDF file (see init_bgpdf), the page and the resolution */
+
+gchar *bgpdf_cache_filename(int pageno, double dpi)
+{
+  gchar *name, *path;
+  
+  if (bgpdf.checksum == NULL || ui.pdf_disk_cache_size <= 0) return NULL;
+  name = g_strdup_printf("%s-%d-%d.pix", bgpdf.checksum, pageno, (int)(100*dpi+0.5));
+  path = g_build_filename(ui.pdfcachedir, name, NULL);
+  g_free(name);
+  return path;
+}
+
+/* frees the memory block holding a pixbuf's pixels, which may start
+   before the pixels themselves */
+
+void bgpdf_free_pixbuf_data(guchar *pixels, gpointer data)
+{
+  g_free(data);
+}
+
+gint64 disk_cache_bytes; // size of the disk cache, as of the last trim plus new pages
+gboolean disk_cache_trimming; // a thread is already trimming it
+G_LOCK_DEFINE_STATIC(disk_cache);
+
+gboolean bgpdf_in_disk_cache(int pageno, double dpi)
+{
+  gchar *filename;
+  gboolean ret;
+
+  filename = bgpdf_cache_filename(pageno, dpi);
+  if (filename == NULL) return FALSE;
+  ret = g_file_test(filename, G_FILE_TEST_IS_REGULAR);
+  g_free(filename);
+  return ret;
+}
+
+// these two also get called from the disk and render threads
+
+GdkPixbuf *bgpdf_load_cached_page(struct BgPdfRequest *req)
+{
+  gchar *filename, *contents, *data;
+  guchar *pixels;
+  gsize length;
+  uLongf size;
+  int width, height, rowstride, has_alpha;
+  GdkPixbuf *pixbuf;
+
+  filename = bgpdf_cache_filename(req->pageno, req->dpi);
+  if (filename == NULL) return NULL;
+  if (!g_file_get_contents(filename, &contents, &length, NULL)) 
+    { g_free(filename); return NULL; }
+#if GLIB_CHECK_VERSION(2,18,0)
+  g_utime(filename, NULL); // most recently used
+#endif
+  g_free(filename);
+
+  data = memchr(contents, '\n', MIN(length, 100));
+  if (data == NULL || 
+      sscanf(contents, "XOURNAL-PDF-CACHE 2 %d %d %d %d", 
+             &width, &height, &rowstride, &has_alpha) != 4 ||
+      width <= 0 || height <= 0 || rowstride < width*(has_alpha?4:3))
+    { g_free(contents); return NULL; }
+  data++;
+  size = (uLongf)rowstride*height;
+  pixels = g_try_malloc(size);
+  if (pixels != NULL && 
+      (uncompress(pixels, &size, (Bytef *)data, length - (data-contents)) != Z_OK ||
+       size != (uLongf)rowstride*height))
+    { g_free(pixels); pixels = NULL; }
+  g_free(contents);
+  if (pixels == NULL) return NULL;
+  pixbuf = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, has_alpha, 8, 
+             width, height, rowstride, bgpdf_free_pixbuf_data, pixels);
+  if (pixbuf == NULL) { g_free(pixels); return NULL; }
+  req->pixel_width = width;
+  req->pixel_height = height;
+  return pixbuf;
+}
+
+void bgpdf_save_cached_page(struct BgPdfRequest *req)
+{
+  gchar *filename, *tmpfilename;
+  guchar *pixels, *zbuf;
+  int y, rowlength, rowstride, height;
+  z_stream zs;
+  gsize zlen;
+  FILE *f;
+  gboolean ok, must_trim;
+
+  if (gdk_pixbuf_get_bits_per_sample(req->pixbuf) != 8) return;
+  filename = bgpdf_cache_filename(req->pageno, req->dpi);
+  if (filename == NULL) return;
+
+  // mostly blank pages compress very well, even at the fastest setting
+  pixels = gdk_pixbuf_get_pixels(req->pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride(req->pixbuf);
+  height = gdk_pixbuf_get_height(req->pixbuf);
+  rowlength = gdk_pixbuf_get_width(req->pixbuf)*gdk_pixbuf_get_n_channels(req->pixbuf);
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) { g_free(filename); return; }
+  zlen = deflateBound(&zs, (uLong)rowlength*height);
+  zbuf = g_try_malloc(zlen);
+  ok = (zbuf != NULL);
+  zs.next_out = zbuf;
+  zs.avail_out = zlen;
+  for (y = 0; y < height && ok; y++) { // without the padding at the end of rows
+    zs.next_in = pixels + y*rowstride;
+    zs.avail_in = rowlength;
+    ok = (deflate(&zs, (y == height-1) ? Z_FINISH : Z_NO_FLUSH) != Z_STREAM_ERROR);
+  }
+  zlen = zs.total_out;
+  deflateEnd(&zs);
+  if (!ok) { g_free(zbuf); g_free(filename); return; }
+
+  tmpfilename = g_strdup_printf("%s.%p", filename, req); // unique per thread
+  f = g_fopen(tmpfilename, "wb");
+  if (f == NULL) { g_free(zbuf); g_free(tmpfilename); g_free(filename); return; }
+  fprintf(f, "XOURNAL-PDF-CACHE 2 %d %d %d %d\n", gdk_pixbuf_get_width(req->pixbuf),
+          height, rowlength, gdk_pixbuf_get_has_alpha(req->pixbuf)?1:0);
+  fwrite(zbuf, 1, zlen, f);
+  g_free(zbuf);
+  ok = !ferror(f);
+  if (fclose(f) != 0) ok = FALSE;
+  if (ok) ok = (g_rename(tmpfilename, filename) == 0);
+  if (!ok) g_unlink(tmpfilename);
+  g_free(tmpfilename);
+  g_free(filename);
+  if (!ok) return;
+
+  // once over budget, make some room (the header is not worth counting)
+  G_LOCK(disk_cache);
+  disk_cache_bytes += zlen;
+  must_trim = (!disk_cache_trimming && 
+               disk_cache_bytes > (gint64)ui.pdf_disk_cache_size*1024*1024);
+  if (must_trim) disk_cache_trimming = TRUE;
+  G_UNLOCK(disk_cache);
+  if (must_trim) bgpdf_trim_disk_cache((gint64)ui.pdf_disk_cache_size*1024*1024*3/4);
+}
+
+/* keep the disk cache within max_bytes by deleting the least recently
+   used files: down to ui.pdf_disk_cache_size whenever a PDF file gets
+   loaded, and to a bit less when it fills up while rendering, so that
+   this doesn't happen after every page */
+
+typedef struct BgPdfCacheFile {
+  gchar *path;
+  time_t mtime;
+  off_t size;
+} BgPdfCacheFile;
+
+gint bgpdf_compare_cache_files(gconstpointer a, gconstpointer b)
+{
+  time_t ta = ((const struct BgPdfCacheFile *)a)->mtime;
+  time_t tb = ((const struct BgPdfCacheFile *)b)->mtime;
+  return (ta < tb) ? -1 : (ta > tb) ? 1 : 0;
+}
+
+void bgpdf_trim_disk_cache(gint64 max_bytes)
+{
+  GDir *dir;
+  const gchar *name;
+  struct stat stat_buf;
+  struct BgPdfCacheFile *cf;
+  GList *files, *list;
+  gint64 total;
+
+  dir = g_dir_open(ui.pdfcachedir, 0, NULL);
+  if (dir == NULL) {
+    G_LOCK(disk_cache);
+    disk_cache_trimming = FALSE;
+    G_UNLOCK(disk_cache);
+    return;
+  }
+  files = NULL;
+  total = 0;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    cf = g_new(struct BgPdfCacheFile, 1);
+    cf->path = g_build_filename(ui.pdfcachedir, name, NULL);
+    if (g_stat(cf->path, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+      { g_free(cf->path); g_free(cf); continue; }
+    cf->mtime = stat_buf.st_mtime;
+    cf->size = stat_buf.st_size;
+    total += cf->size;
+    files = g_list_prepend(files, cf);
+  }
+  g_dir_close(dir);
+
+  files = g_list_sort(files, bgpdf_compare_cache_files);
+  for (list = files; list != NULL; list = list->next) {
+    cf = (struct BgPdfCacheFile *)list->data;
+    if (total > max_bytes && g_unlink(cf->path) == 0)
+      total -= cf->size;
+    g_free(cf->path);
+    g_free(cf);
+  }
+  g_list_free(files);
+  G_LOCK(disk_cache);
+  disk_cache_bytes = total;
+  disk_cache_trimming = FALSE;
+  G_UNLOCK(disk_cache);
+}
+
+/* remove the most urgent request from the queue, and return it;
+   at equal priority, previews come first */
+
+struct BgPdfRequest *bgpdf_next_request(void)
+{
+  GList *list, *best;
+  struct BgPdfRequest *req, *best_req;
+
+  best = bgpdf.requests;
+  if (best == NULL) return NULL;
+  for (list = best->next; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    best_req = (struct BgPdfRequest *)best->data;
+    if (req->priority < best_req->priority || 
+        (req->priority == best_req->priority && req->preview && !best_req->preview))
+      best = list;
+  }
+  bgpdf.requests = g_list_remove_link(bgpdf.requests, best);
+  list = best->data;
+  g_list_free_1(best);
+  return (struct BgPdfRequest *)list;
+}
+
+/* re-prioritize the queued requests as the view changes: a whole page
+   request gets the priority of the most urgent journal page showing that
+   PDF page; tiles and pages that went away get the lowest priority.
+   One pass over the journal and one over the requests, at each rescale */
+
+void bgpdf_update_request_priorities(int first_visible, int last_visible)
+{
+  GList *list;
+  struct Page *pg;
+  struct BgPdfRequest *req;
+  int *page_priority, size, pageno, priority;
+  
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  size = bgpdf.npages + 1;
+  page_priority = g_new(int, size);
+  for (pageno = 0; pageno < size; pageno++) page_priority[pageno] = G_MAXINT;
+  for (list = journal.pages, pageno = 0; list != NULL; list = list->next, pageno++) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq <= 0 ||
+        pg->bg->file_page_seq >= size) continue;
+    priority = bgpdf_page_priority(pageno, first_visible, last_visible);
+    if (priority < page_priority[pg->bg->file_page_seq])
+      page_priority[pg->bg->file_page_seq] = priority;
+  }
+  for (list = bgpdf.requests; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->tile_x >= 0 || req->pageno <= 0 || req->pageno >= size)
+      req->priority = G_MAXINT;
+    else req->priority = page_priority[req->pageno];
+  }
+  // also keep track of in-flight requests, for the statistics
+  for (list = bgpdf.rendering; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->tile_x >= 0 || req->pageno <= 0 || req->pageno >= size)
+      req->priority = G_MAXINT;
+    else req->priority = page_priority[req->pageno];
+  }
+  g_free(page_priority);
+}
+
+/* tiles get requested again at every rescale while in view: drop
+   the queued ones that were not, they have scrolled out of view */
+
+void bgpdf_cancel_stale_tile_requests(void)
+{
+  GList *list;
+  struct BgPdfRequest *req;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  for (list = bgpdf.requests; list != NULL; ) {
+    req = (struct BgPdfRequest *)list->data;
+    list = list->next;
+    if (req->tile_x >= 0 && req->priority == G_MAXINT) cancel_bgpdf_request(req);
+  }
+}
+
+/* three ways to render a region of a PDF page into a pixbuf. First,
+   poppler -> cairo -> X pixmap -> pixbuf: avoids a bitmap font bug in
+   some versions of poppler, but needs the X server (main loop only) */
 
-  x_win = x_event.xbutton.subwindow;
-  if (x_win == None) x_win = x_root;
+GdkPixbuf *bgpdf_render_via_pixmap(PopplerPage *pdfpage, int src_x, int src_y,
+              int width, int height, double scale_x, double scale_y)
+{
+  GdkPixbuf *pixbuf;
+  GdkPixmap *pixmap;
+  cairo_t *cr;
 
-  window = gdk_window_foreign_new_for_display(gdk_display_get_default(), x_win);
-    
-  gdk_window_get_geometry(window, &x, &y, &w, &h, NULL);
-  cmap = gdk_drawable_get_colormap(window);
-  if (cmap == NULL) cmap = gdk_colormap_get_system();
-  
-  pix = gdk_pixbuf_get_from_drawable(NULL, window,
-     cmap, 0, 0, 0, 0, w, h);
-    
-  if (pix == NULL) return NULL;
-  
-  bg = g_new(struct Background, 1);
-  bg->type = BG_PIXMAP;
-  bg->canvas_item = NULL;
-  bg->pixbuf = pix;
-  bg->pixbuf_scale = DEFAULT_ZOOM;
-  bg->filename = new_refstring(NULL);
-  bg->file_domain = DOMAIN_ATTACH;
-  return bg;
-#else
-  // not implemented on non-X11 backends
-  return FALSE;
-#endif
+  pixmap = gdk_pixmap_new(GTK_WIDGET(canvas)->window, width, height, -1);
+  cr = gdk_cairo_create(pixmap);
+  cairo_set_source_rgb(cr, 1., 1., 1.);
+  cairo_paint(cr);
+  cairo_translate(cr, -src_x, -src_y);
+  cairo_scale(cr, scale_x, scale_y);
+  poppler_page_render(pdfpage, cr);
+  cairo_destroy(cr);
+  pixbuf = gdk_pixbuf_get_from_drawable(NULL, GDK_DRAWABLE(pixmap),
+    NULL, 0, 0, 0, 0, width, height);
+  g_object_unref(pixmap);
+  return pixbuf;
 }
 
-/************** pdf annotation ***************/
+/* second, wrapper_poppler_page_render_to_pixbuf(), which renders into a
+   cairo surface then copies it pixel by pixel into a separate pixbuf
+   (still used for printing). Third, the one used for backgrounds: cairo
+   renders straight into the memory block that becomes the pixbuf, and
+   a single in-place pass packs cairo's xRGB words into RGB bytes. 
+   If cancelled is not NULL, give up (returning NULL) if *cancelled gets
+   set before or during the poppler pass, which itself can't be stopped */
+
+GdkPixbuf *bgpdf_render_direct(PopplerPage *pdfpage, int src_x, int src_y,
+              int width, int height, double scale_x, double scale_y, 
+              gint *cancelled)
+{
+  guchar *pixels, *dst;
+  guint32 *src, pixel;
+  int stride, pixbuf_stride, x, y;
+  cairo_surface_t *surface;
+  cairo_t *cr;
 
-/* cancel a request */
+  if (cancelled != NULL && g_atomic_int_get(cancelled)) return NULL;
+  stride = 4*width;
+  pixels = g_try_malloc((gsize)stride*height);
+  if (pixels == NULL) return NULL;
+  memset(pixels, 0xff, (gsize)stride*height); // white background
+
+  surface = cairo_image_surface_create_for_data(pixels, CAIRO_FORMAT_RGB24, 
+                                                width, height, stride);
+  cr = cairo_create(surface);
+  cairo_translate(cr, -src_x, -src_y);
+  cairo_scale(cr, scale_x, scale_y);
+  poppler_page_render(pdfpage, cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  if (cancelled != NULL && g_atomic_int_get(cancelled)) {
+#ifdef PERF_DEBUG
+    printf("DEBUG: render of %dx%d pixels cancelled\n", width, height);
+#endif
+    g_free(pixels);
+    return NULL;
+  }
 
-void cancel_bgpdf_request(struct BgPdfRequest *req)
+  // the write position never gets ahead of the read position
+  pixbuf_stride = (3*width + 3) & ~3;
+  for (y = 0; y < height; y++) {
+    src = (guint32 *)(pixels + y*stride);
+    dst = pixels + y*pixbuf_stride;
+    for (x = 0; x < width; x++) {
+      pixel = *(src++);
+      *(dst++) = (pixel >> 16) & 0xff;
+      *(dst++) = (pixel >> 8) & 0xff;
+      *(dst++) = pixel & 0xff;
+    }
+  }
+  pixels = g_realloc(pixels, (gsize)pixbuf_stride*height);
+  return gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, FALSE, 8,
+           width, height, pixbuf_stride, bgpdf_free_pixbuf_data, pixels);
+}
+
+#ifdef PERF_DEBUG
+/* compare the three render paths on the first page, at the current zoom */
+
+void bgpdf_benchmark_render_paths(void)
 {
-  GList *list_link;
-  
-  list_link = g_list_find(bgpdf.requests, req);
-  if (list_link == NULL) return;
-  // remove the request
-  bgpdf.requests = g_list_delete_link(bgpdf.requests, list_link);
-  g_free(req);
+  PopplerPage *pdfpage;
+  GdkPixbuf *pixbuf;
+  GTimer *timer;
+  gdouble height, width;
+  int scaled_height, scaled_width, i;
+  double t_pixmap, t_copy, t_direct;
+
+  pdfpage = poppler_document_get_page(bgpdf.document, 0);
+  if (!pdfpage) return;
+  poppler_page_get_size(pdfpage, &width, &height);
+  scaled_width = (int) (ui.zoom * width);
+  scaled_height = (int) (ui.zoom * height);
+  timer = g_timer_new();
+  t_pixmap = t_copy = t_direct = 0.;
+  for (i = 0; i < 3; i++) {
+    if (GTK_WIDGET(canvas)->window != NULL) {
+      g_timer_start(timer);
+      pixbuf = bgpdf_render_via_pixmap(pdfpage, 0, 0, scaled_width, scaled_height,
+                 scaled_width/width, scaled_height/height);
+      t_pixmap += g_timer_elapsed(timer, NULL);
+      if (pixbuf != NULL) g_object_unref(pixbuf);
+    }
+    g_timer_start(timer);
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, scaled_width, scaled_height);
+    wrapper_poppler_page_render_to_pixbuf(pdfpage, 0, 0, scaled_width, scaled_height,
+                 ui.zoom, 0, pixbuf);
+    t_copy += g_timer_elapsed(timer, NULL);
+    g_object_unref(pixbuf);
+    g_timer_start(timer);
+    pixbuf = bgpdf_render_direct(pdfpage, 0, 0, scaled_width, scaled_height,
+                 scaled_width/width, scaled_height/height, NULL);
+    t_direct += g_timer_elapsed(timer, NULL);
+    if (pixbuf != NULL) g_object_unref(pixbuf);
+  }
+  printf("DEBUG: page 1 at %dx%d: X pixmap %.1f ms, cairo copy %.1f ms, direct %.1f ms\n",
+    scaled_width, scaled_height, t_pixmap*1000/3, t_copy*1000/3, t_direct*1000/3);
+  g_timer_destroy(timer);
+  g_object_unref(pdfpage);
 }
+#endif
 
-/* process a bg PDF request from the queue, and recurse */
+/* render a page of the PDF file (or one tile of it) at the requested
+   resolution. The X server can only be used from the main loop, so the
+   render threads always go through a client-side cairo surface
+   (in_main_loop = FALSE) */
 
-gboolean bgpdf_scheduler_callback(gpointer data)
+GdkPixbuf *bgpdf_render_page(PopplerDocument *document, struct BgPdfRequest *req,
+                             gboolean in_main_loop)
 {
-  struct BgPdfRequest *req;
-  struct BgPdfPage *bgpg;
   GdkPixbuf *pixbuf;
-  GtkWidget *dialog;
   PopplerPage *pdfpage;
   gdouble height, width;
   int scaled_height, scaled_width;
-  GdkPixmap *pixmap;
-  cairo_t *cr;
+  int src_x, src_y, render_height, render_width;
+
+  pdfpage = poppler_document_get_page(document, req->pageno-1);
+  if (!pdfpage) return NULL;
+//  printf("DEBUG: Processing request for page %d at %f dpi\n", req->pageno, req->dpi);
+  poppler_page_get_size(pdfpage, &width, &height);
+  scaled_width = (int) (req->dpi * width/72);
+  scaled_height = (int) (req->dpi * height/72);
+  req->pixel_width = scaled_width;
+  req->pixel_height = scaled_height;
+
+  if (req->tile_x >= 0) { // just the requested tile
+    src_x = req->tile_x * BGPDF_TILE_SIZE;
+    src_y = req->tile_y * BGPDF_TILE_SIZE;
+    render_width = MIN(BGPDF_TILE_SIZE, scaled_width - src_x);
+    render_height = MIN(BGPDF_TILE_SIZE, scaled_height - src_y);
+    if (render_width <= 0 || render_height <= 0) 
+      { g_object_unref(pdfpage); return NULL; }
+  }
+  else { 
+    src_x = src_y = 0;
+    render_width = scaled_width;
+    render_height = scaled_height;
+  }
 
-  // if all requests have been cancelled, remove ourselves from main loop
-  if (bgpdf.requests == NULL) { bgpdf.pid = 0; return FALSE; }
-  if (bgpdf.status == STATUS_NOT_INIT)
-    { printf("DEBUG: BGPDF not initialized??\n"); bgpdf.pid = 0; return FALSE; }
+  if (ui.poppler_force_cairo && in_main_loop)
+    pixbuf = bgpdf_render_via_pixmap(pdfpage, src_x, src_y, render_width, 
+               render_height, scaled_width/width, scaled_height/height);
+  else
+    pixbuf = bgpdf_render_direct(pdfpage, src_x, src_y, render_width, 
+               render_height, scaled_width/width, scaled_height/height,
+               in_main_loop ? NULL : &req->cancelled);
+  g_object_unref(pdfpage);
+  return pixbuf;
+}
 
-  req = (struct BgPdfRequest *)bgpdf.requests->data;
+/* statistics on how long the user waits for the visible pages */
 
-  // use poppler to generate the page
-  pixbuf = NULL;
-  pdfpage = poppler_document_get_page(bgpdf.document, req->pageno-1);
-  if (pdfpage) {
-//    printf("DEBUG: Processing request for page %d at %f dpi\n", req->pageno, req->dpi);
-    set_cursor_busy(TRUE);
-    poppler_page_get_size(pdfpage, &width, &height);
-    scaled_width = (int) (req->dpi * width/72);
-    scaled_height = (int) (req->dpi * height/72);
-
-    if (ui.poppler_force_cairo) { // poppler -> cairo -> pixmap -> pixbuf
-      pixmap = gdk_pixmap_new(GTK_WIDGET(canvas)->window, scaled_width, scaled_height, -1);
-      cr = gdk_cairo_create(pixmap);
-      cairo_set_source_rgb(cr, 1., 1., 1.);
-      cairo_paint(cr);
-      cairo_scale(cr, scaled_width/width, scaled_height/height);
-      poppler_page_render(pdfpage, cr);
-      cairo_destroy(cr);
-      pixbuf = gdk_pixbuf_get_from_drawable(NULL, GDK_DRAWABLE(pixmap),
-        NULL, 0, 0, 0, 0, scaled_width, scaled_height);
-      g_object_unref(pixmap);
-    }
-    else { // directly poppler -> pixbuf: faster, but bitmap font bug
-      pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
-                 FALSE, 8, scaled_width, scaled_height);
-      wrapper_poppler_page_render_to_pixbuf(
-                pdfpage, 0, 0, scaled_width, scaled_height,
-                req->dpi/72, 0, pixbuf);
-    }
-    g_object_unref(pdfpage);
-    set_cursor_busy(FALSE);
-  }
+void bgpdf_update_view_stats(struct BgPdfRequest *req)
+{
+  if (req->priority != BGPDF_PRIORITY_VISIBLE || !bgpdf.view_pending) return;
+  bgpdf.view_pending = FALSE;
+  bgpdf.view_last_time = g_timer_elapsed(bgpdf.view_timer, NULL);
+  bgpdf.view_total_time += bgpdf.view_last_time;
+  bgpdf.view_count++;
+#ifdef PERF_DEBUG
+  printf("DEBUG: first visible PDF page after %.3f s (average %.3f s over %d)\n",
+    bgpdf.view_last_time, bgpdf.view_total_time/bgpdf.view_count, bgpdf.view_count);
+#endif
+}
+
+/* store a finished render and update the pages that use it */
+
+void bgpdf_render_finished(struct BgPdfRequest *req)
+{
+  struct BgPdfPage *bgpg;
+  GtkWidget *dialog;
 
-  // process the generated pixbuf...
-  if (pixbuf != NULL) { // success
+  if (req->tile_x >= 0) { bgpdf_tile_finished(req); return; }
+  if (req->pixbuf != NULL) { // success
     while (req->pageno > bgpdf.npages) {
       bgpg = g_new(struct BgPdfPage, 1);
       bgpg->pixbuf = NULL;
+      bgpg->bytes = 0;
+      bgpg->evicted = FALSE;
       bgpdf.pages = g_list_append(bgpdf.pages, bgpg);
       bgpdf.npages++;
     }
     bgpg = g_list_nth_data(bgpdf.pages, req->pageno-1);
+    if (req->preview && bgpg->pixbuf!=NULL) return; // the real one came first
     if (bgpg->pixbuf!=NULL) g_object_unref(bgpg->pixbuf);
-    bgpg->pixbuf = pixbuf;
+    bgpg->pixbuf = req->pixbuf;
+    req->pixbuf = NULL;
     bgpg->dpi = req->dpi;
-    bgpg->pixel_height = scaled_height;
-    bgpg->pixel_width = scaled_width;
+    bgpg->pixel_height = req->pixel_height;
+    bgpg->pixel_width = req->pixel_width;
+    bgpdf.cache_bytes -= bgpg->bytes;
+    bgpg->bytes = gdk_pixbuf_get_rowstride(bgpg->pixbuf) * bgpg->pixel_height;
+    bgpdf.cache_bytes += bgpg->bytes;
+    bgpg->evicted = FALSE;
+    bgpg->last_used = bgpdf.cache_clock;
     bgpdf_update_bg(req->pageno, bgpg); // update all pages that have this bg
+    bgpdf_trim_cache();
+    bgpdf_update_view_stats(req);
   } else { // failure
     if (!bgpdf.has_failed) {
+      bgpdf.has_failed = TRUE; // set first: more renders may fail during the dialog
       dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
         GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, _("Unable to render one or more PDF pages."));
       wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
       gtk_widget_destroy(dialog);
     }
-    bgpdf.has_failed = TRUE;
   }
+}
+
+/* process a bg PDF request from the queue, and recurse
+   (only used when there are no render threads) */
+
+gboolean bgpdf_scheduler_callback(gpointer data)
+{
+  struct BgPdfRequest *req;
+
+  // if all requests have been cancelled, remove ourselves from main loop
+  if (bgpdf.requests == NULL) { bgpdf.pid = 0; return FALSE; }
+  if (bgpdf.status == STATUS_NOT_INIT)
+    { printf("DEBUG: BGPDF not initialized??\n"); bgpdf.pid = 0; return FALSE; }
+
+  req = bgpdf_next_request();
+
+  // use poppler to generate the page, unless it's in the disk cache
+  set_cursor_busy(TRUE);
+  if (req->tile_x < 0 && !req->preview) req->pixbuf = bgpdf_load_cached_page(req);
+  if (req->pixbuf == NULL) {
+    req->pixbuf = bgpdf_render_page(bgpdf.document, req, TRUE);
+    if (req->pixbuf != NULL && req->tile_x < 0 && !req->preview) 
+      bgpdf_save_cached_page(req);
+  }
+  set_cursor_busy(FALSE);
+  bgpdf_render_finished(req);
+  if (req->pixbuf != NULL) g_object_unref(req->pixbuf); // if it wasn't used
+  g_free(req);
 
-  bgpdf.requests = g_list_delete_link(bgpdf.requests, bgpdf.requests);
   if (bgpdf.requests != NULL) return TRUE; // remain in the idle loop
   bgpdf.pid = 0;
   return FALSE; // we're done
 }
 
-/* make a request */
+/* the render threads: each thread renders with its own poppler document,
+   then hands the result back to the main loop */
+
+void bgpdf_render_thread(gpointer data, gpointer user_data)
+{
+  struct BgPdfRequest *req;
+  PopplerDocument *document;
+
+  req = (struct BgPdfRequest *)data;
+  if (g_atomic_int_get(&req->cancelled)) // superseded while waiting for a thread
+    { g_idle_add(bgpdf_render_done, req); return; }
+  // add_bgpdf_request() already sent the pages in the disk cache elsewhere
+  document = (PopplerDocument *)g_async_queue_try_pop(bgpdf.render_docs);
+  if (document == NULL) document = bgpdf_open_document();
+  if (document != NULL) {
+    req->pixbuf = bgpdf_render_page(document, req, FALSE);
+    g_async_queue_push(bgpdf.render_docs, document);
+  }
+  if (req->pixbuf != NULL && req->tile_x < 0 && !req->preview) 
+    bgpdf_save_cached_page(req);
+  g_idle_add(bgpdf_render_done, req);
+}
+
+/* the disk thread reads the pages found in the disk cache, so that they
+   don't have to wait behind the renders */
+
+void bgpdf_disk_thread(gpointer data, gpointer user_data)
+{
+  struct BgPdfRequest *req;
+
+  req = (struct BgPdfRequest *)data;
+  if (!g_atomic_int_get(&req->cancelled)) req->pixbuf = bgpdf_load_cached_page(req);
+  g_idle_add(bgpdf_render_done, req);
+}
+
+gboolean bgpdf_render_done(gpointer data)
+{
+  struct BgPdfRequest *req;
+  GList *list_link;
+
+  req = (struct BgPdfRequest *)data;
+  list_link = g_list_find(bgpdf.rendering, req);
+  if (list_link != NULL) // otherwise, the reader was shut down meanwhile
+    bgpdf.rendering = g_list_delete_link(bgpdf.rendering, list_link);
+  if (list_link != NULL) {
+    if (!g_atomic_int_get(&req->cancelled)) {
+      if (req->from_disk && req->pixbuf == NULL) // unreadable: render it
+        queue_bgpdf_request(new_bgpdf_request(req->pageno, req->dpi/72, -1, -1, 
+                                              req->priority));
+      else bgpdf_render_finished(req);
+    }
+    bgpdf_dispatch_requests(); // a thread may now be free
+  }
+  if (req->pixbuf != NULL) g_object_unref(req->pixbuf);
+  g_free(req);
+  return FALSE;
+}
+
+/* hand queued requests to the render threads, keeping them all busy */
 
-gboolean add_bgpdf_request(int pageno, double zoom)
+void bgpdf_dispatch_requests(void)
 {
-  struct BgPdfRequest *req, *cmp_req;
+  struct BgPdfRequest *req;
   GList *list;
+  guint nrendering;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  if (bgpdf.render_pool == NULL) {
+    if (bgpdf.requests != NULL && !bgpdf.pid)
+      bgpdf.pid = g_idle_add(bgpdf_scheduler_callback, NULL);
+    return;
+  }
+  nrendering = 0;
+  for (list = bgpdf.rendering; list != NULL; list = list->next)
+    if (!((struct BgPdfRequest *)list->data)->from_disk) nrendering++;
+  while (bgpdf.requests != NULL && nrendering < ui.pdf_render_threads) {
+    req = bgpdf_next_request();
+    bgpdf.rendering = g_list_append(bgpdf.rendering, req);
+    g_thread_pool_push(bgpdf.render_pool, req, NULL);
+    nrendering++;
+  }
+}
+
+/* make a request */
+
+struct BgPdfRequest *new_bgpdf_request(int pageno, double zoom, int tile_x, 
+                                       int tile_y, int priority)
+{
+  struct BgPdfRequest *req;
 
-  if (bgpdf.status == STATUS_NOT_INIT)
-    return FALSE; // don't accept requests
   req = g_new(struct BgPdfRequest, 1);
   req->pageno = pageno;
   req->dpi = 72*zoom;
-//  printf("DEBUG: Enqueuing request for page %d at %f dpi\n", pageno, req->dpi);
+  req->tile_x = tile_x;
+  req->tile_y = tile_y;
+  req->preview = FALSE;
+  req->from_disk = FALSE;
+  req->priority = priority;
+  req->cancelled = FALSE;
+  req->pixbuf = NULL;
+  return req;
+}
+
+void queue_bgpdf_request(struct BgPdfRequest *req)
+{
+//  printf("DEBUG: Enqueuing request for page %d at %f dpi\n", req->pageno, req->dpi);
+  // start the clock if the user is now waiting for this page
+  if (req->priority == BGPDF_PRIORITY_VISIBLE && !bgpdf.view_pending) {
+    bgpdf.view_pending = TRUE;
+    g_timer_start(bgpdf.view_timer);
+  }
+
+  if (req->from_disk) { // no need to wait for a render thread
+    bgpdf.rendering = g_list_append(bgpdf.rendering, req);
+    g_thread_pool_push(bgpdf.disk_pool, req, NULL);
+    return;
+  }
+  bgpdf.requests = g_list_append(bgpdf.requests, req);
+  bgpdf_dispatch_requests();
+}
+
+// cancel the requests for a whole page, about to be superseded
+
+void cancel_bgpdf_page_requests(int pageno)
+{
+  struct BgPdfRequest *cmp_req;
+  GList *list;
 
-  // cancel any request this may supersede
   for (list = bgpdf.requests; list != NULL; ) {
     cmp_req = (struct BgPdfRequest *)list->data;
     list = list->next;
-    if (cmp_req->pageno == pageno) cancel_bgpdf_request(cmp_req);
+    if (cmp_req->pageno == pageno && cmp_req->tile_x < 0) 
+      cancel_bgpdf_request(cmp_req);
+  }
+  for (list = bgpdf.rendering; list != NULL; list = list->next) {
+    cmp_req = (struct BgPdfRequest *)list->data;
+    if (cmp_req->pageno == pageno && cmp_req->tile_x < 0) 
+      g_atomic_int_set(&cmp_req->cancelled, TRUE);
   }
+}
 
-  // make the request
-  bgpdf.requests = g_list_append(bgpdf.requests, req);
-  if (!bgpdf.pid) bgpdf.pid = g_idle_add(bgpdf_scheduler_callback, NULL);
+gboolean add_bgpdf_request(int pageno, double zoom, int priority)
+{
+  struct BgPdfRequest *req;
+  struct BgPdfPage *bgpg;
+  gboolean in_disk_cache;
+
+  if (bgpdf.status == STATUS_NOT_INIT)
+    return FALSE; // don't accept requests
+
+  cancel_bgpdf_page_requests(pageno);
+
+  // pages in the disk cache get read right away by the disk thread
+  in_disk_cache = bgpdf_in_disk_cache(pageno, 72*zoom);
+  if (in_disk_cache && bgpdf.disk_pool != NULL) {
+    req = new_bgpdf_request(pageno, zoom, -1, -1, priority);
+    req->from_disk = TRUE;
+    queue_bgpdf_request(req);
+    return TRUE;
+  }
+
+  // if there's nothing to show yet, start with a quick low-res preview
+  // (unless the page will just be read from the disk cache)
+  bgpg = (pageno <= bgpdf.npages) ? g_list_nth_data(bgpdf.pages, pageno-1) : NULL;
+  if (ui.pdf_preview && priority < BGPDF_PRIORITY_OTHER && 
+      72*zoom > 2*BGPDF_PREVIEW_DPI && (bgpg == NULL || bgpg->pixbuf == NULL) &&
+      !in_disk_cache) {
+    req = new_bgpdf_request(pageno, BGPDF_PREVIEW_DPI/72.0, -1, -1, priority);
+    req->preview = TRUE;
+    queue_bgpdf_request(req);
+  }
+
+  queue_bgpdf_request(new_bgpdf_request(pageno, zoom, -1, -1, priority));
+  return TRUE;
+}
+
+/* request a tile, unless it's already on its way */
+
+gboolean add_bgpdf_tile_request(int pageno, double zoom, int tile_x, int tile_y, 
+                                int priority)
+{
+  struct BgPdfRequest *req;
+  GList *list;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return FALSE;
+  for (list = bgpdf.requests; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->pageno == pageno && req->dpi == 72*zoom && 
+        req->tile_x == tile_x && req->tile_y == tile_y) {
+      if (req->priority > priority) req->priority = priority;
+      return TRUE;
+    }
+  }
+  for (list = bgpdf.rendering; list != NULL; list = list->next) {
+    req = (struct BgPdfRequest *)list->data;
+    if (req->pageno == pageno && req->dpi == 72*zoom && 
+        !g_atomic_int_get(&req->cancelled) &&
+        req->tile_x == tile_x && req->tile_y == tile_y) return TRUE;
+  }
+  queue_bgpdf_request(new_bgpdf_request(pageno, zoom, tile_x, tile_y, priority));
   return TRUE;
 }
 
@@ -1483,9 +4930,32 @@ void shutdown_bgpdf(void)
   GList *list;
   struct BgPdfPage *pdfpg;
   struct BgPdfRequest *req;
+  PopplerDocument *document;
 
   if (bgpdf.status == STATUS_NOT_INIT) return;
   
+  /* wait for the render and disk threads. The requests still waiting for
+     a thread are cancelled, so they go straight back to bgpdf_render_done();
+     like the others, they get freed there, without being used */
+  for (list = bgpdf.rendering; list != NULL; list = list->next)
+    g_atomic_int_set(&((struct BgPdfRequest *)list->data)->cancelled, TRUE);
+  if (bgpdf.render_pool != NULL) {
+    g_thread_pool_free(bgpdf.render_pool, FALSE, TRUE);
+    bgpdf.render_pool = NULL;
+  }
+  if (bgpdf.disk_pool != NULL) {
+    g_thread_pool_free(bgpdf.disk_pool, FALSE, TRUE);
+    bgpdf.disk_pool = NULL;
+  }
+  g_list_free(bgpdf.rendering);
+  bgpdf.rendering = NULL;
+  if (bgpdf.render_docs != NULL) {
+    while ((document = g_async_queue_try_pop(bgpdf.render_docs)) != NULL)
+      g_object_unref(document);
+    g_async_queue_unref(bgpdf.render_docs);
+    bgpdf.render_docs = NULL;
+  }
+
   // cancel all requests and free data structures
   refstring_unref(bgpdf.filename);
   for (list = bgpdf.pages; list != NULL; list = list->next) {
@@ -1494,25 +4964,86 @@ void shutdown_bgpdf(void)
     g_free(pdfpg);
   }
   g_list_free(bgpdf.pages);
+  bgpdf_clear_tile_items(NULL);
+  while (bgpdf.tiles != NULL) 
+    bgpdf_evict_tile((struct BgPdfTile *)bgpdf.tiles->data);
   for (list = bgpdf.requests; list != NULL; list = list->next) {
     req = (struct BgPdfRequest *)list->data;
     g_free(req);
   }
   g_list_free(bgpdf.requests);
 
-  if (bgpdf.file_contents!=NULL) {
-    g_free(bgpdf.file_contents); 
-    bgpdf.file_contents = NULL;
-  }
-  if (bgpdf.document!=NULL) {
+  if (bgpdf.document!=NULL) { // before the data it may be reading from
     g_object_unref(bgpdf.document);
     bgpdf.document = NULL;
   }
+  bgpdf_free_file_contents();
+  g_free(bgpdf.uri);
+  bgpdf.uri = NULL;
+  g_free(bgpdf.checksum);
+  bgpdf.checksum = NULL;
+  g_timer_destroy(bgpdf.view_timer);
+  bgpdf_free_page_index();
+#ifdef PERF_DEBUG
+  printf("DEBUG: PDF page cache: %d hits, %d misses\n", 
+         bgpdf.cache_hits, bgpdf.cache_misses);
+  printf("DEBUG: %d PDF bg updates in %.1f ms, for %d journal pages\n",
+         bgpdf.update_count, bgpdf.update_time*1000, journal.npages);
+#endif
 
   bgpdf.status = STATUS_NOT_INIT;
 }
 
 
+// release the copy or the mapping of the PDF file
+
+void bgpdf_free_file_contents(void)
+{
+  if (bgpdf.file_mapping != NULL) {
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(bgpdf.file_mapping);
+#else
+    g_mapped_file_free(bgpdf.file_mapping);
+#endif
+    bgpdf.file_mapping = NULL;
+  }
+  else g_free(bgpdf.file_contents);
+  bgpdf.file_contents = NULL;
+  g_free(bgpdf.file_path);
+  bgpdf.file_path = NULL;
+}
+
+/* open a poppler document for the main loop or a render thread, on
+   the copy or mapping of the file we already have (poppler doesn't copy
+   it), rather than having poppler read the file again.
+   poppler_document_new_from_data() starts at 0.6.1, but we want to
+   be compatible with poppler 0.5.4 = latest in CentOS as of sept 2009 */
+
+PopplerDocument *bgpdf_open_document(void)
+{
+#if POPPLER_CHECK_VERSION(0, 6, 1)
+  return poppler_document_new_from_data(bgpdf.file_contents, 
+                        bgpdf.file_length, NULL, NULL);
+#else
+  return poppler_document_new_from_file(bgpdf.uri, NULL, NULL);
+#endif
+}
+
+/* is this the file we have mapped in memory? then it must not be
+   overwritten in place (only replaced, e.g. unlinked then recreated) */
+
+gboolean bgpdf_is_mapped_file(const char *filename)
+{
+  struct stat stat_a, stat_b;
+
+  if (bgpdf.status == STATUS_NOT_INIT || bgpdf.file_mapping == NULL) return FALSE;
+  if (!strcmp(filename, bgpdf.file_path)) return TRUE;
+  if (g_stat(filename, &stat_a) != 0 || g_stat(bgpdf.file_path, &stat_b) != 0)
+    return FALSE;
+  return (stat_a.st_ino != 0 && stat_a.st_ino == stat_b.st_ino && 
+          stat_a.st_dev == stat_b.st_dev);
+}
+
 // initialize PDF background rendering 
 
 gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
@@ -1520,39 +5051,95 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
   int i, n_pages;
   struct Background *bg;
   struct Page *pg;
+  GList *pglist;
   PopplerPage *pdfpage;
   gdouble width, height;
-  gchar *uri;
+  struct stat stat_buf;
+  gchar *path, *cwd, *key;
   
   if (bgpdf.status != STATUS_NOT_INIT) return FALSE;
   
-  // make a copy of the file in memory and check it's a PDF
-  if (!g_file_get_contents(pdfname, &(bgpdf.file_contents), &(bgpdf.file_length), NULL))
+  // map the file in memory (or make a copy of it) and check it's a PDF
+  bgpdf.file_mapping = NULL;
+  if (ui.pdf_mmap) bgpdf.file_mapping = g_mapped_file_new(pdfname, FALSE, NULL);
+  if (bgpdf.file_mapping != NULL) {
+    bgpdf.file_contents = g_mapped_file_get_contents(bgpdf.file_mapping);
+    bgpdf.file_length = g_mapped_file_get_length(bgpdf.file_mapping);
+  }
+  else if (!g_file_get_contents(pdfname, &(bgpdf.file_contents), &(bgpdf.file_length), NULL))
     return FALSE;
+  bgpdf.file_path = g_strdup(pdfname);
   if (bgpdf.file_length < 4 || strncmp(bgpdf.file_contents, "%PDF", 4))
-    { g_free(bgpdf.file_contents); bgpdf.file_contents = NULL; return FALSE; }
+    { bgpdf_free_file_contents(); return FALSE; }
 
   // init bgpdf data structures and open poppler document
   bgpdf.status = STATUS_READY;
+  bgpdf.file_serial++; // a different PDF for save_bg_attachment()
   bgpdf.filename = new_refstring((file_domain == DOMAIN_ATTACH) ? "bg.pdf" : pdfname);
   bgpdf.file_domain = file_domain;
   bgpdf.npages = 0;
   bgpdf.pages = NULL;
   bgpdf.requests = NULL;
+  bgpdf.tiles = NULL;
+  bgpdf.tile_items = NULL;
+  bgpdf.page_index = NULL;
+  bgpdf.page_index_size = 0;
+  bgpdf.page_index_valid = FALSE;
+  bgpdf.update_count = 0;
+  bgpdf.update_time = 0.;
   bgpdf.pid = 0;
   bgpdf.has_failed = FALSE;
+  bgpdf.render_pool = NULL;
+  bgpdf.render_docs = NULL;
+  bgpdf.disk_pool = NULL;
+  bgpdf.rendering = NULL;
+  bgpdf.view_first_page = 0;
+  bgpdf.view_direction = 1;
+  bgpdf.view_timer = g_timer_new();
+  bgpdf.view_pending = FALSE;
+  bgpdf.view_count = 0;
+  bgpdf.view_total_time = 0.;
+  bgpdf.view_last_page = -1;
+  bgpdf.cache_bytes = 0;
+  bgpdf.cache_clock = 0;
+  bgpdf.cache_hits = bgpdf.cache_misses = 0;
+  // the disk cache knows the file by its path, size and date: a checksum
+  // of the contents would mean reading all of it now
+  bgpdf.checksum = NULL;
+#if GLIB_CHECK_VERSION(2,16,0)
+  if (g_stat(pdfname, &stat_buf) == 0) {
+    if (g_path_is_absolute(pdfname)) path = g_strdup(pdfname);
+    else {
+      cwd = g_get_current_dir();
+      path = g_build_filename(cwd, pdfname, NULL);
+      g_free(cwd);
+    }
+    key = g_strdup_printf("%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT, path, 
+             (gint64)stat_buf.st_size, (gint64)stat_buf.st_mtime);
+    bgpdf.checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, key, -1);
+    g_free(key);
+    g_free(path);
+  }
+#endif
+  if (ui.pdf_disk_cache_size > 0) 
+    bgpdf_trim_disk_cache((gint64)ui.pdf_disk_cache_size*1024*1024);
 
-/* poppler_document_new_from_data() starts at 0.6.1, but we want to
-   be compatible with poppler 0.5.4 = latest in CentOS as of sept 2009 */
-  uri = g_filename_to_uri(pdfname, NULL, NULL);
-  if (!uri) uri = g_strdup_printf("file://%s", pdfname);
-  bgpdf.document = poppler_document_new_from_file(uri, NULL, NULL);
-  g_free(uri);
-/*    with poppler 0.6.1 or later, can replace the above 4 lines by:
-  bgpdf.document = poppler_document_new_from_data(bgpdf.file_contents, 
-                          bgpdf.file_length, NULL, NULL);
-*/
+  bgpdf.uri = g_filename_to_uri(pdfname, NULL, NULL);
+  if (!bgpdf.uri) bgpdf.uri = g_strdup_printf("file://%s", pdfname);
+  bgpdf.document = bgpdf_open_document();
   if (bgpdf.document == NULL) { shutdown_bgpdf(); return FALSE; }
+
+  // start the render threads, if we can
+  if (ui.pdf_render_threads > 0 && g_thread_supported()) {
+    bgpdf.render_docs = g_async_queue_new();
+    bgpdf.render_pool = g_thread_pool_new(bgpdf_render_thread, NULL,
+                                          ui.pdf_render_threads, FALSE, NULL);
+    if (bgpdf.checksum != NULL && ui.pdf_disk_cache_size > 0)
+      bgpdf.disk_pool = g_thread_pool_new(bgpdf_disk_thread, NULL, 1, FALSE, NULL);
+  }
+#ifdef PERF_DEBUG
+  bgpdf_benchmark_render_paths();
+#endif
   
   if (pdfname[0]=='/' && ui.filename == NULL) {
     if (ui.default_path!=NULL) g_free(ui.default_path);
@@ -1563,17 +5150,17 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
   
   // create pages with correct sizes if requested
   n_pages = poppler_document_get_n_pages(bgpdf.document);
+  pglist = journal.pages;
   for (i=1; i<=n_pages; i++) {
+    pg = (pglist != NULL) ? (struct Page *)pglist->data : NULL;
+    if (pglist != NULL) pglist = pglist->next;
     pdfpage = poppler_document_get_page(bgpdf.document, i-1);
     if (!pdfpage) continue;
-    if (journal.npages < i) {
+    if (pg == NULL) {
       bg = g_new(struct Background, 1);
       bg->canvas_item = NULL;
-      pg = NULL;
-    } else {
-      pg = (struct Page *)g_list_nth_data(journal.pages, i-1);
-      bg = pg->bg;
-    }
+    } else bg = pg->bg;
+    bg->serial = new_serial(); // a different background, even if reused
     bg->type = BG_PDF;
     bg->filename = refstring_ref(bgpdf.filename);
     bg->file_domain = bgpdf.file_domain;
@@ -1593,28 +5180,116 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
       update_canvas_bg(pg);
     }
   }
+  invalidate_bgpdf_index();
   update_page_stuff();
   rescale_bg_pixmaps(); // this actually requests the pages !!
   return TRUE;
 }
 
 
+/* index from PDF page numbers to the journal pages that use them as
+   background. It is built by bgpdf_pages_using() when first needed, then
+   kept up to date: bgpdf_index_page() must be called whenever a page is
+   added to the journal or gets a different background, and
+   bgpdf_unindex_page() when it is removed. invalidate_bgpdf_index() is
+   only for when the whole journal changes */
+
+void invalidate_bgpdf_index(void)
+{
+  bgpdf.page_index_valid = FALSE;
+}
+
+void bgpdf_unindex_page(struct Page *pg)
+{
+  int n;
+  
+  n = pg->pdf_index_no;
+  pg->pdf_index_no = 0;
+  if (!bgpdf.page_index_valid || n <= 0 || n >= bgpdf.page_index_size) return;
+  bgpdf.page_index[n] = g_list_remove(bgpdf.page_index[n], pg);
+}
+
+void bgpdf_index_page(struct Page *pg)
+{
+  int n;
+
+  bgpdf_unindex_page(pg);
+  if (!bgpdf.page_index_valid) return; // it gets built when needed
+  if (pg->bg->type != BG_PDF || pg->bg->file_page_seq <= 0) return;
+  n = pg->bg->file_page_seq;
+  if (n >= bgpdf.page_index_size) {
+    bgpdf.page_index = g_renew(GList *, bgpdf.page_index, n+1);
+    memset(bgpdf.page_index + bgpdf.page_index_size, 0, 
+           (n+1 - bgpdf.page_index_size)*sizeof(GList *));
+    bgpdf.page_index_size = n+1;
+  }
+  bgpdf.page_index[n] = g_list_prepend(bgpdf.page_index[n], pg);
+  pg->pdf_index_no = n;
+}
+
+void bgpdf_free_page_index(void)
+{
+  int i;
+
+  for (i = 0; i < bgpdf.page_index_size; i++) g_list_free(bgpdf.page_index[i]);
+  g_free(bgpdf.page_index);
+  bgpdf.page_index = NULL;
+  bgpdf.page_index_size = 0;
+  bgpdf.page_index_valid = FALSE;
+}
+
+GList *bgpdf_pages_using(int pageno)
+{
+  GList *list;
+  struct Page *pg;
+
+  if (!bgpdf.page_index_valid) {
+    bgpdf_free_page_index();
+    bgpdf.page_index_size = bgpdf.npages + 1;
+    for (list = journal.pages; list!= NULL; list = list->next) {
+      pg = (struct Page *)list->data;
+      if (pg->bg->type == BG_PDF && pg->bg->file_page_seq >= bgpdf.page_index_size)
+        bgpdf.page_index_size = pg->bg->file_page_seq + 1;
+    }
+    bgpdf.page_index = g_new0(GList *, bgpdf.page_index_size);
+    for (list = g_list_last(journal.pages); list!= NULL; list = list->prev) {
+      pg = (struct Page *)list->data;
+      pg->pdf_index_no = 0;
+      if (pg->bg->type == BG_PDF && pg->bg->file_page_seq > 0) {
+        bgpdf.page_index[pg->bg->file_page_seq] = 
+          g_list_prepend(bgpdf.page_index[pg->bg->file_page_seq], pg);
+        pg->pdf_index_no = pg->bg->file_page_seq;
+      }
+    }
+    bgpdf.page_index_valid = TRUE;
+  }
+  if (pageno <= 0 || pageno >= bgpdf.page_index_size) return NULL;
+  return bgpdf.page_index[pageno];
+}
+
 // look for all journal pages with given pdf bg, and update their bg pixmaps
 void bgpdf_update_bg(int pageno, struct BgPdfPage *bgpg)
 {
   GList *list;
   struct Page *pg;
+#ifdef PERF_DEBUG
+  GTimer *timer = g_timer_new();
+#endif
   
-  for (list = journal.pages; list!= NULL; list = list->next) {
+  for (list = bgpdf_pages_using(pageno); list!= NULL; list = list->next) {
     pg = (struct Page *)list->data;
-    if (pg->bg->type == BG_PDF && pg->bg->file_page_seq == pageno) {
-      if (pg->bg->pixbuf!=NULL) g_object_unref(pg->bg->pixbuf);
-      pg->bg->pixbuf = g_object_ref(bgpg->pixbuf);
-      pg->bg->pixel_width = bgpg->pixel_width;
-      pg->bg->pixel_height = bgpg->pixel_height;
-      update_canvas_bg(pg);
-    }
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq != pageno) continue;
+    if (pg->bg->pixbuf!=NULL) g_object_unref(pg->bg->pixbuf);
+    pg->bg->pixbuf = g_object_ref(bgpg->pixbuf);
+    pg->bg->pixel_width = bgpg->pixel_width;
+    pg->bg->pixel_height = bgpg->pixel_height;
+    update_canvas_bg(pg);
   }
+#ifdef PERF_DEBUG
+  bgpdf.update_count++;
+  bgpdf.update_time += g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+#endif
 }
 
 // initialize the recent files list
@@ -1744,6 +5419,11 @@ void init_config_default(void)
   ui.zoom_step_increment = 1;
   ui.zoom_step_factor = 1.5;
   ui.progressive_bg = TRUE;
+  ui.pdf_render_threads = 2;
+  ui.pdf_cache_size = 256;
+  ui.pdf_disk_cache_size = 1024;
+  ui.pdf_preview = TRUE;
+  ui.pdf_mmap = FALSE; // a mapped file that gets rewritten would crash us
   ui.print_ruling = TRUE;
   ui.exportpdf_prefer_legacy = FALSE;
   ui.exportpdf_layers = FALSE;
@@ -1757,12 +5437,18 @@ void init_config_default(void)
   ui.width_maximum_multiplier = 1.25;
   ui.button_switch_mapping = FALSE;
   ui.autoload_pdf_xoj = FALSE;
+  ui.lazy_load = TRUE;
   ui.autocreate_new_xoj = FALSE;
   ui.poppler_force_cairo = FALSE;
   ui.touch_as_handtool = FALSE;
   ui.pen_disables_touch = FALSE;
   ui.device_for_touch = g_strdup(DEFAULT_DEVICE_FOR_TOUCH);
   ui.autosave_enabled = FALSE;
+  ui.autosave_threaded = TRUE;
+  ui.compression_level = 6;
+  ui.autosave_compression_level = 1;
+  ui.compression_threads = 0;
+  ui.share_images = FALSE;
   ui.autosave_filename_list = NULL;
   ui.autosave_delay = 5;
   ui.autosave_loop_running = FALSE;
@@ -1920,6 +5606,9 @@ void save_config_to_file(void)
   update_keyval("general", "autoload_pdf_xoj",
     _(" automatically load filename.pdf.xoj instead of filename.pdf (true/false)"),
     g_strdup(ui.autoload_pdf_xoj?"true":"false"));
+  update_keyval("general", "lazy_load",
+    _(" read the pages of binary (.xojb) journals only when they are needed (true/false)"),
+    g_strdup(ui.lazy_load?"true":"false"));
   update_keyval("general", "autocreate_new_xoj",
     _(" when attempting to open a non-existent file, treat it as a new file (true/false)"),
     g_strdup(ui.autocreate_new_xoj?"true":"false"));
@@ -1929,6 +5618,21 @@ void save_config_to_file(void)
   update_keyval("general", "autosave_delay",
     _(" delay for periodic autosaves (in seconds)"),
     g_strdup_printf("%d", ui.autosave_delay));
+  update_keyval("general", "autosave_threaded",
+    _(" write autosaves in a background thread (true/false)"),
+    g_strdup(ui.autosave_threaded?"true":"false"));
+  update_keyval("general", "compression_level",
+    _(" compression level for saved files (0 = uncompressed, 1 = fastest, 9 = smallest)"),
+    g_strdup_printf("%d", ui.compression_level));
+  update_keyval("general", "autosave_compression_level",
+    _(" compression level for autosaves (0 = uncompressed, 1 = fastest, 9 = smallest)"),
+    g_strdup_printf("%d", ui.autosave_compression_level));
+  update_keyval("general", "compression_threads",
+    _(" number of threads compressing saved files (0 = no extra threads)"),
+    g_strdup_printf("%d", ui.compression_threads));
+  update_keyval("general", "share_images",
+    _(" save images used several times only once (not readable by xournal 0.4.8 and earlier) (true/false)"),
+    g_strdup(ui.share_images?"true":"false"));
   update_keyval("general", "default_path",
     _(" default path for open/save (leave blank for current directory)"),
     g_strdup((ui.default_path!=NULL)?ui.default_path:""));
@@ -2001,6 +5705,21 @@ void save_config_to_file(void)
   update_keyval("paper", "progressive_bg",
     _(" just-in-time update of page backgrounds (true/false)"),
     g_strdup(ui.progressive_bg?"true":"false"));
+  update_keyval("paper", "pdf_render_threads",
+    _(" number of threads rendering PDF backgrounds (0 = render in the user interface thread)"),
+    g_strdup_printf("%d", ui.pdf_render_threads));
+  update_keyval("paper", "pdf_cache_size",
+    _(" memory used by rendered PDF backgrounds, in megabytes; off-screen pages are rendered again as needed (0 = unlimited)"),
+    g_strdup_printf("%d", ui.pdf_cache_size));
+  update_keyval("paper", "pdf_disk_cache_size",
+    _(" disk space used to keep rendered PDF backgrounds across sessions, in megabytes (0 = disabled)"),
+    g_strdup_printf("%d", ui.pdf_disk_cache_size));
+  update_keyval("paper", "pdf_preview",
+    _(" show a quick low resolution PDF background until the page is fully rendered (true/false)"),
+    g_strdup(ui.pdf_preview?"true":"false"));
+  update_keyval("paper", "pdf_mmap",
+    _(" map background PDF files in memory rather than reading a copy of them; don't modify them while in use (true/false)"),
+    g_strdup(ui.pdf_mmap?"true":"false"));
   update_keyval("paper", "gs_bitmap_dpi",
     _(" bitmap resolution of PS/PDF backgrounds rendered using ghostscript (dpi)"),
     g_strdup_printf("%d", GS_BITMAP_DPI));
@@ -2338,9 +6057,15 @@ void load_config_from_file(void)
     if (str!=NULL) ui.device_for_touch = str;
   parse_keyval_boolean("general", "buttons_switch_mappings", &ui.button_switch_mapping);
   parse_keyval_boolean("general", "autoload_pdf_xoj", &ui.autoload_pdf_xoj);
+  parse_keyval_boolean("general", "lazy_load", &ui.lazy_load);
   parse_keyval_boolean("general", "autocreate_new_xoj", &ui.autocreate_new_xoj);
   parse_keyval_boolean("general", "autosave_enabled", &ui.autosave_enabled);
   parse_keyval_int("general", "autosave_delay", &ui.autosave_delay, 1, 3600);
+  parse_keyval_boolean("general", "autosave_threaded", &ui.autosave_threaded);
+  parse_keyval_int("general", "compression_level", &ui.compression_level, 0, 9);
+  parse_keyval_int("general", "autosave_compression_level", &ui.autosave_compression_level, 0, 9);
+  parse_keyval_int("general", "compression_threads", &ui.compression_threads, 0, 16);
+  parse_keyval_boolean("general", "share_images", &ui.share_images);
   parse_keyval_string("general", "default_path", &ui.default_path);
   parse_keyval_boolean("general", "pressure_sensitivity", &ui.pressure_sensitivity);
   parse_keyval_float("general", "width_minimum_multiplier", &ui.width_minimum_multiplier, 0., 10.);
@@ -2367,6 +6092,11 @@ void load_config_from_file(void)
   parse_keyval_boolean("paper", "apply_all", &ui.bg_apply_all_pages);
   parse_keyval_enum("paper", "default_unit", &ui.default_unit, unit_names, 4);
   parse_keyval_boolean("paper", "progressive_bg", &ui.progressive_bg);
+  parse_keyval_int("paper", "pdf_render_threads", &ui.pdf_render_threads, 0, 16);
+  parse_keyval_int("paper", "pdf_cache_size", &ui.pdf_cache_size, 0, 65536);
+  parse_keyval_int("paper", "pdf_disk_cache_size", &ui.pdf_disk_cache_size, 0, 1048576);
+  parse_keyval_boolean("paper", "pdf_preview", &ui.pdf_preview);
+  parse_keyval_boolean("paper", "pdf_mmap", &ui.pdf_mmap);
   parse_keyval_boolean("paper", "print_ruling", &ui.print_ruling);
   parse_keyval_boolean("paper", "new_page_duplicates_bg", &ui.new_page_bg_from_pdf);
   parse_keyval_int("paper", "gs_bitmap_dpi", &GS_BITMAP_DPI, 1, 1200);
@@ -25,23 +25,276 @@ extern int GS_BITMAP_DPI, PDFTOPPM_PRINTING_DPI;
 #define AUTOSAVE_MAX 9
 #define AUTOSAVE_FILENAME_TEMPLATE "%s.autosave%d.xoj"
 #define AUTOSAVE_FILENAME_FILTER "%s.autosave*.xoj"
+#define AUTOSAVE_LOG_SUFFIX ".log"
+#define AUTOSAVE_LOG_MAX_SIZE (16*1024*1024) // beyond this, do a full auto-save
 
+// an attached background written out by save_bg_attachment()
+typedef struct SavedAttachment {
+  gchar *path;
+  GdkPixbuf *pixbuf; // for a bitmap background (a reference is held)
+  int pdf_serial; // for the PDF background, its bgpdf.file_serial
+  gint64 size;
+  time_t mtime; // the file as we left it
+} SavedAttachment;
+
+// a full auto-save handed over to the worker thread
+typedef struct AutosavePart { // one of these is set:
+  GString *text;       // XML text
+  GByteArray *member;  // a compressed layer from its save_cache
+  struct Layer *layer; // a private copy of a layer that changed
+} AutosavePart;
+
+typedef struct AutosaveJob {
+  FILE *f;
+  gchar *filename;
+  GList *parts; // the AutosaveParts, in order
+  GList *old_filenames; // the previous auto-save, deleted on success
+  GByteArray *structure; // journal_structure() at the time of the snapshot
+  int generation; // ui.autosave_generation at the time
+  GHashTable *shared_images; // see setup_shared_images()
+  gboolean ok;
+} AutosaveJob;
+
+// buffered output of .xoj files, passed on to zlib in blocks of this size
+#define XOJ_WRITER_BLOCK 262144
+#define XOJ_WRITER_CHUNK 65536 // compressed output, per fwrite()
+#define XOJ_WRITER_BASE64 49152 // image bytes encoded at a time (a multiple of 3)
+#define XOJ_LAYER_MEMBER_MIN 16384 // smaller layers share a gzip member, see layer_saved_alone()
+#define XOJ_WRITER_JOBS_PER_THREAD 4 // blocks being compressed at a time, per thread
+#define XOJ_READ_BLOCK 1048576 // for gzread(), when a file can't be read in one go
+
+// the text of a .xoj file being opened, see read_xoj_file()
+typedef struct XojInput {
+  const gchar *text;
+  gsize len;
+  GString *buf;         // holds the text if the file was compressed
+  GMappedFile *mapping; // holds it otherwise
+} XojInput;
+
+// a block compressed by a worker thread (compression_threads option)
+typedef struct XojDeflateJob {
+  GString *text;       // the block, or NULL if out is a saved member copied as is
+  GByteArray *out;     // the block as a gzip member of its own
+  GByteArray *capture; // also gets a copy of out, see xoj_writer_start_capture()
+  int level;
+  gboolean ok;
+  gint done;
+  GAsyncQueue *finished; // the job is pushed there once done
+} XojDeflateJob;
+
+typedef struct XojWriter {
+  FILE *f;
+  GString *buf;
+  gboolean ok;
+  gsize total; // uncompressed bytes written so far
+  int level; // zlib compression level, 0 to 9
+  z_stream zs;
+  gboolean in_member; // zs holds an unfinished gzip member
+  GByteArray *capture; // if not NULL, also gets a copy of the output
+  GHashTable *shared_images; // ids of the images saved in <imagedata>, by PNG
+  GQueue *jobs; // the XojDeflateJobs not written yet, in order (NULL if serial)
+  GAsyncQueue *finished;
+  guint max_jobs;
+} XojWriter;
+
+// below this many pages, parallel parsing of .xoj files isn't worth it
+#define PARALLEL_PARSE_MIN_PAGES 8
+
+// state of the .xoj parser, one per thread
+typedef struct XojParser {
+  struct Journal *journal; // where the pages go
+  struct Page *page;
+  struct Layer *layer;
+  struct Item *item;
+  double *coords, *widths; // scratch space for strokes
+  int coords_alloc, widths_alloc;
+  int num_points; // for variable width strokes
+  gboolean defer_bg; // if true, keep the <background> attributes for later
+  gchar **bg_names, **bg_values;
+  int image_id; // of the <imagedata> being read
+} XojParser;
+
+// binary journal format (.xojb)
+#define XOJB_MAGIC "XOJB"
+#define XOJB_VERSION 1
+#define XOJB_HEADER_SIZE 12
+#define XOJB_TABLE_ENTRY_SIZE 16
+
+// decoding of the binary format: a cursor that fails safely past the end
+typedef struct XojbReader {
+  const guchar *ptr, *end;
+  gboolean ok;
+} XojbReader;
+
+void xoj_writer_init(XojWriter *w, FILE *f);
+void xoj_writer_output(XojWriter *w, const void *data, gsize len);
+void xoj_writer_deflate(XojWriter *w, int flush);
+gboolean gzip_member(const void *data, gsize len, int level, GByteArray *out);
+void xoj_deflate_thread(gpointer data, gpointer user_data);
+void xoj_writer_submit(XojWriter *w);
+void xoj_writer_drain(XojWriter *w, guint max_jobs);
+void xoj_writer_flush(XojWriter *w);
+void xoj_writer_end_member(XojWriter *w);
+void xoj_writer_put_member(XojWriter *w, GByteArray *member);
+void xoj_writer_start_capture(XojWriter *w);
+GByteArray *xoj_writer_end_capture(XojWriter *w);
+gboolean xoj_writer_close(XojWriter *w);
+GString *gunzip_members(const guchar *data, gsize len);
+gboolean read_xoj_file(const char *filename, gzFile f, XojInput *in);
+void free_xoj_input(XojInput *in);
+void xoj_put_str(XojWriter *w, const char *s);
+void xoj_put_fixed2(XojWriter *w, double x);
+void xoj_put_fixed2_list(XojWriter *w, const double *vals, int n);
+void xoj_put_color(XojWriter *w, int color_no, guint color_rgba, const char **names);
+void write_image_png(XojWriter *w, const gchar *png, gsize png_len);
+gboolean write_image(XojWriter *w, struct Item *item);
+GList *setup_shared_images(XojWriter *w);
+void save_shared_images(XojWriter *w, GList *shared);
+void release_image_id(gpointer key, gpointer value, gpointer user_data);
+void forget_image_ids(void);
+gchar *read_image_png(const gchar *base64_str, gsize base64_strlen, gsize *png_len);
+void save_layer(XojWriter *w, struct Layer *layer);
+gboolean layer_saved_alone(struct Layer *layer);
 void new_journal(void);
+guint pixbuf_content_hash(gconstpointer key);
+gboolean pixbuf_content_equal(gconstpointer a, gconstpointer b);
+int *find_bg_clones(void);
+void free_saved_attachment(gpointer data);
+void forget_saved_attachments(void);
+void remember_saved_attachment(const char *path, struct Background *bg);
+gboolean saved_attachment_matches(SavedAttachment *att, struct Background *bg);
+gboolean saved_attachment_find_func(gpointer key, gpointer value, gpointer data);
+gboolean clone_or_copy_file(const char *src, const char *dst);
+void save_bg_attachment(struct Background *bg, const char *filename, gboolean is_auto);
 gboolean save_journal(const char *filename, gboolean is_auto);
 gboolean close_journal(void);
+GByteArray *journal_structure(void);
+void save_page_head(XojWriter *w, struct Page *pg, int clone_of, 
+                    const char *filename, gboolean is_auto);
+void autosave_job_add_text(AutosaveJob *job, XojWriter *tw);
+gboolean autosave_start_thread(const char *filename, GList *old_filenames);
+void autosave_thread(gpointer data, gpointer user_data);
+gboolean autosave_thread_done(gpointer data);
+void autosave_start_log(const char *snapshot);
+void autosave_forget_snapshot(void);
+gboolean autosave_append_log(void);
+int replay_autosave_log(const char *snapshot);
+GdkPixbuf *load_bg_pixbuf(const char *name, int file_domain);
+int swar_count_digits(guint64 x);
+guint64 swar_digits_value(guint64 x, int n);
+int parse_fixed_numbers(const gchar *text, gsize len, double *vals, int max);
+gboolean benchmark_number_parsing(const gchar *text, gsize len);
+int benchmark_number_parsing_file(const char *filename);
+void xoj_parse_background(XojParser *st, const gchar **attribute_names, 
+   const gchar **attribute_values, GError **error);
+void xoj_parser_init(XojParser *st, struct Journal *j, gboolean defer_bg);
+void xoj_parser_free(XojParser *st);
+void xoj_parser_realloc_coords(XojParser *st, int n);
+void xoj_parser_realloc_widths(XojParser *st, int n);
+gboolean xoj_parse_chunk(XojParser *st, const gchar *text, gsize len);
+void xoj_parse_thread(gpointer data, gpointer user_data);
+void shutdown_parse_pool(void);
+gsize xoj_skip_markup(const gchar *text, gsize len, gsize i);
+gboolean xoj_is_page_tag(const gchar *text, gsize len, gsize i);
+gboolean xoj_parse_parallel(const gchar *text, gsize len, gboolean *valid);
+gboolean parse_xoj_document(const gchar *text, gsize len);
 gboolean open_journal(char *filename);
 
+void xojb_put_byte(GByteArray *buf, int val);
+void xojb_put_uint(GByteArray *buf, guint32 val);
+void xojb_put_double(GByteArray *buf, double val);
+void xojb_put_floats(GByteArray *buf, const double *vals, int n);
+void xojb_put_data(GByteArray *buf, const gchar *data, gsize len);
+void xojb_put_string(GByteArray *buf, const gchar *s);
+void xojb_write_page_head(GByteArray *buf, struct Page *pg, int clone_of,
+                          const char *filename, gboolean is_auto);
+gboolean xojb_write_page(GByteArray *head, GByteArray *buf, struct Page *pg, int clone_of,
+                         const char *filename, gboolean is_auto);
+gboolean save_binary_journal(const char *filename, gboolean is_auto);
+const guchar *xojb_get_bytes(XojbReader *r, gsize len);
+int xojb_get_byte(XojbReader *r);
+guint32 xojb_get_uint(XojbReader *r);
+double xojb_get_double(XojbReader *r);
+void xojb_get_floats(XojbReader *r, double *vals, int n);
+gchar *xojb_get_string(XojbReader *r, gsize *len);
+gboolean xojb_read_page_head(XojbReader *r);
+struct Item *xojb_read_item(XojbReader *r);
+gboolean xojb_read_layers(const guchar *zdata, gsize zsize, gsize size, struct Page *pg);
+gboolean xojb_read_chunk(FILE *f, guint64 length, int i, gboolean want_body,
+                         GByteArray *buf, XojbReader *r, XojbReader *head, gsize *size);
+gboolean is_binary_journal(const char *filename);
+gboolean load_binary_journal(const char *filename);
+void free_mapped_file(GMappedFile *mapping);
+void load_page_contents(struct Page *pg);
+void load_all_pages(void);
+void free_lazy_source(void);
+
 struct Background *attempt_load_pix_bg(char *filename, gboolean attach);
 GList *attempt_load_gv_bg(char *filename);
 struct Background *attempt_screenshot_bg(void);
 
 void cancel_bgpdf_request(struct BgPdfRequest *req);
-gboolean add_bgpdf_request(int pageno, double zoom);
+struct BgPdfRequest *new_bgpdf_request(int pageno, double zoom, int tile_x, 
+                                       int tile_y, int priority);
+void queue_bgpdf_request(struct BgPdfRequest *req);
+void cancel_bgpdf_page_requests(int pageno);
+gboolean add_bgpdf_request(int pageno, double zoom, int priority);
+gchar *bgpdf_cache_filename(int pageno, double dpi);
+gboolean bgpdf_in_disk_cache(int pageno, double dpi);
+void bgpdf_free_pixbuf_data(guchar *pixels, gpointer data);
+GdkPixbuf *bgpdf_load_cached_page(struct BgPdfRequest *req);
+void bgpdf_save_cached_page(struct BgPdfRequest *req);
+gint bgpdf_compare_cache_files(gconstpointer a, gconstpointer b);
+void bgpdf_trim_disk_cache(gint64 max_bytes);
+gboolean add_bgpdf_tile_request(int pageno, double zoom, int tile_x, int tile_y, 
+                                int priority);
+struct BgPdfTile *bgpdf_find_tile(int pageno, double dpi, int tile_x, int tile_y);
+void bgpdf_tile_item_destroyed(GtkObject *object, gpointer data);
+void bgpdf_show_tile(struct Page *pg, struct BgPdfTile *tile);
+void bgpdf_clear_tile_items(struct Page *pg);
+void bgpdf_evict_tile(struct BgPdfTile *tile);
+void bgpdf_drop_tiles(double dpi);
+void bgpdf_update_tiles(struct Page *pg);
+void bgpdf_update_visible_tiles(void);
+double bgpdf_max_page_zoom(struct Page *pg);
+void bgpdf_tile_finished(struct BgPdfRequest *req);
+void bgpdf_cancel_stale_tile_requests(void);
+void bgpdf_update_view_stats(struct BgPdfRequest *req);
+struct BgPdfRequest *bgpdf_next_request(void);
+void bgpdf_evict_page(int pageno, struct BgPdfPage *bgpg);
+void bgpdf_trim_cache(void);
+gboolean bgpdf_cache_fits(gsize bytes);
+void bgpdf_touch_page(int pageno, gboolean new_in_view);
+gboolean bgpdf_page_evicted(int pageno);
+void bgpdf_update_request_priorities(int first_visible, int last_visible);
+GdkPixbuf *bgpdf_render_via_pixmap(PopplerPage *pdfpage, int src_x, int src_y,
+              int width, int height, double scale_x, double scale_y);
+GdkPixbuf *bgpdf_render_direct(PopplerPage *pdfpage, int src_x, int src_y,
+              int width, int height, double scale_x, double scale_y, 
+              gint *cancelled);
+#ifdef PERF_DEBUG
+void bgpdf_benchmark_render_paths(void);
+#endif
+GdkPixbuf *bgpdf_render_page(PopplerDocument *document, struct BgPdfRequest *req,
+                             gboolean in_main_loop);
+void bgpdf_render_finished(struct BgPdfRequest *req);
 gboolean bgpdf_scheduler_callback(gpointer data);
+void bgpdf_render_thread(gpointer data, gpointer user_data);
+void bgpdf_disk_thread(gpointer data, gpointer user_data);
+gboolean bgpdf_render_done(gpointer data);
+void bgpdf_dispatch_requests(void);
 void shutdown_bgpdf(void);
+void bgpdf_free_file_contents(void);
+PopplerDocument *bgpdf_open_document(void);
+gboolean bgpdf_is_mapped_file(const char *filename);
 gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain);
 
 void bgpdf_create_page_with_bg(int pageno, struct BgPdfPage *bgpg);
+void invalidate_bgpdf_index(void);
+void bgpdf_index_page(struct Page *pg);
+void bgpdf_unindex_page(struct Page *pg);
+void bgpdf_free_page_index(void);
+GList *bgpdf_pages_using(int pageno);
 void bgpdf_update_bg(int pageno, struct BgPdfPage *bgpg);
 
 void init_mru(void);
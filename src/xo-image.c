@@ -20,11 +20,13 @@
 #include <math.h>
 #include <string.h>
 #include <gtk/gtk.h>
+#include <zlib.h>
 
 #include "xournal.h"
 #include "xo-support.h"
 #include "xo-image.h"
 #include "xo-misc.h"
+#include "xo-file.h"
 
 // create pixbuf from buffer, or return NULL on failure
 GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen)
@@ -36,11 +38,463 @@ GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen)
   gdk_pixbuf_loader_write(loader, buf, buflen, NULL);
   gdk_pixbuf_loader_close(loader, NULL);
   pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
-  g_object_ref(pixbuf);
+  if (pixbuf != NULL) g_object_ref(pixbuf);
   g_object_unref(loader);
   return pixbuf;
 }
 
+/* The image store: items showing the same image share one copy of its
+   PNG, found by its contents, and one pixbuf. The PNG of an image item is
+   always either NULL or in the store; it is reference counted with
+   ref_image_png() and release_image_png() instead of copied and freed.
+   Journal parsing threads may add PNGs, hence the lock. */
+
+GHashTable *image_store;     // the StoredImages, by PNG contents
+GHashTable *image_store_png; // the same, by PNG pointer
+GHashTable *image_store_pixels; // those with a pixbuf, by pixel contents
+int image_store_last_id;
+G_LOCK_DEFINE_STATIC(image_store);
+
+guint stored_image_hash(gconstpointer key)
+{
+  const StoredImage *img = (const StoredImage *)key;
+  guint h;
+  gsize i;
+
+  h = 2166136261U; // FNV-1a
+  for (i = 0; i < img->png_len; i++) h = (h ^ (guchar)img->png[i]) * 16777619U;
+  return h;
+}
+
+gboolean stored_image_equal(gconstpointer a, gconstpointer b)
+{
+  const StoredImage *ia = (const StoredImage *)a, *ib = (const StoredImage *)b;
+
+  return ia->png_len == ib->png_len && !memcmp(ia->png, ib->png, ia->png_len);
+}
+
+// add a PNG to the store (takes over the buffer): returns the store's copy
+
+gchar *store_image_png(gchar *png, gsize png_len)
+{
+  StoredImage key, *img;
+
+  if (png == NULL) return NULL;
+  G_LOCK(image_store);
+  if (image_store == NULL) {
+    image_store = g_hash_table_new(stored_image_hash, stored_image_equal);
+    image_store_png = g_hash_table_new(g_direct_hash, g_direct_equal);
+    image_store_pixels = g_hash_table_new(pixbuf_content_hash, pixbuf_content_equal);
+  }
+  key.png = png;
+  key.png_len = png_len;
+  img = (StoredImage *)g_hash_table_lookup(image_store, &key);
+  if (img != NULL) { g_free(png); img->refs++; }
+  else {
+    img = g_new0(StoredImage, 1);
+    img->png = png;
+    img->png_len = png_len;
+    img->refs = 1;
+    img->id = ++image_store_last_id;
+    g_hash_table_insert(image_store, img, img);
+    g_hash_table_insert(image_store_png, png, img);
+  }
+  G_UNLOCK(image_store);
+  return img->png;
+}
+
+// the store's record of a PNG, or NULL
+
+StoredImage *stored_image(const gchar *png)
+{
+  StoredImage *img;
+  
+  if (png == NULL) return NULL;
+  G_LOCK(image_store); // parse threads may be creating the store
+  img = (image_store_png != NULL) ? 
+    (StoredImage *)g_hash_table_lookup(image_store_png, png) : NULL;
+  G_UNLOCK(image_store);
+  return img;
+}
+
+gchar *ref_image_png(gchar *png)
+{
+  StoredImage *img;
+  
+  if (png == NULL) return NULL;
+  G_LOCK(image_store);
+  img = (StoredImage *)g_hash_table_lookup(image_store_png, png);
+  img->refs++;
+  G_UNLOCK(image_store);
+  return png;
+}
+
+gboolean stored_image_has_pixbuf(gpointer key, gpointer value, gpointer pixbuf)
+{
+  return ((StoredImage *)value)->pixbuf == pixbuf;
+}
+
+void release_image_png(gchar *png)
+{
+  StoredImage *img, *other;
+  
+  if (png == NULL) return;
+  G_LOCK(image_store);
+  img = (StoredImage *)g_hash_table_lookup(image_store_png, png);
+  if (--img->refs == 0) {
+    g_hash_table_remove(image_store, img);
+    g_hash_table_remove(image_store_png, png);
+    if (img->pixbuf != NULL) {
+      // the pixels stay known as long as some other image shares them
+      if (g_hash_table_lookup(image_store_pixels, img->pixbuf) == img) {
+        g_hash_table_remove(image_store_pixels, img->pixbuf);
+        other = (StoredImage *)g_hash_table_find(image_store, 
+                                   stored_image_has_pixbuf, img->pixbuf);
+        if (other != NULL) g_hash_table_insert(image_store_pixels, other->pixbuf, other);
+      }
+      g_object_unref(img->pixbuf);
+    }
+    g_free(img->png);
+    g_free(img);
+  }
+  G_UNLOCK(image_store);
+}
+
+/* the pixbuf shown for a stored PNG, now that one was decoded (takes over
+   the reference, and returns one): if an image with the same pixels is
+   shown already, its pixbuf is shared instead */
+
+GdkPixbuf *share_image_pixbuf(StoredImage *img, GdkPixbuf *pixbuf)
+{
+  StoredImage *other;
+  
+  if (img == NULL) return pixbuf;
+  G_LOCK(image_store);
+  if (img->pixbuf == NULL) {
+    other = (StoredImage *)g_hash_table_lookup(image_store_pixels, pixbuf);
+    if (other != NULL) {
+      g_object_unref(pixbuf);
+      pixbuf = g_object_ref(other->pixbuf);
+    }
+    else g_hash_table_insert(image_store_pixels, pixbuf, img);
+    img->pixbuf = pixbuf;
+  }
+  else { g_object_unref(pixbuf); pixbuf = img->pixbuf; }
+  G_UNLOCK(image_store);
+  return g_object_ref(pixbuf);
+}
+
+// a reference to the pixbuf of a stored PNG, decoding it if nobody has yet
+
+GdkPixbuf *stored_image_pixbuf(const gchar *png, gsize png_len)
+{
+  StoredImage *img;
+  
+  img = stored_image(png);
+  if (img != NULL && img->pixbuf != NULL) return g_object_ref(img->pixbuf);
+  return share_image_pixbuf(img, decode_image_png(png, png_len));
+}
+
+// give a new image item its pixbuf and PNG, sharing them with identical images
+
+void store_image_pixbuf(struct Item *item, GdkPixbuf *pixbuf)
+{
+  StoredImage *img;
+  
+  img = NULL;
+  G_LOCK(image_store);
+  if (image_store_pixels != NULL)
+    img = (StoredImage *)g_hash_table_lookup(image_store_pixels, pixbuf);
+  G_UNLOCK(image_store);
+  if (img != NULL) {
+    item->image_png = ref_image_png(img->png);
+    item->image_png_len = img->png_len;
+    item->image = share_image_pixbuf(img, pixbuf);
+    return;
+  }
+  item->image = pixbuf;
+  item->image_png = NULL;
+  item->image_png_len = 0;
+  encode_image_png(item);
+}
+
+// make sure an image item has its PNG, for saving or copying: returns FALSE on failure
+
+gboolean encode_image_png(struct Item *item)
+{
+  gchar *png;
+  gsize png_len;
+  GdkPixbuf *pixbuf;
+
+  if (item->image_png != NULL) return TRUE;
+  if (!gdk_pixbuf_save_to_buffer(item->image, &png, &png_len, "png", NULL, NULL)) {
+    item->image_png_len = 0;       // failed for some reason, so forget it
+    return FALSE;
+  }
+  item->image_png = store_image_png(png, png_len);
+  item->image_png_len = png_len;
+  // share the pixbuf from now on
+  pixbuf = share_image_pixbuf(stored_image(item->image_png), g_object_ref(item->image));
+  g_object_unref(item->image);
+  item->image = pixbuf;
+  if (item->canvas_item != NULL)
+    gnome_canvas_item_set(item->canvas_item, "pixbuf", item->image, NULL);
+  return TRUE;
+}
+
+// the stored images shown by more than one item in the journal, in the order
+// they become so; none unless they're to be saved that way (share_images option)
+
+GList *find_shared_images(void)
+{
+  GHashTable *uses;
+  GList *shared, *pagelist, *layerlist, *itemlist;
+  struct Item *item;
+  StoredImage *img;
+  int n;
+  
+  if (!ui.share_images) return NULL;
+  G_LOCK(image_store);
+  n = (image_store != NULL) ? g_hash_table_size(image_store) : 0;
+  G_UNLOCK(image_store);
+  if (n < 1) return NULL;
+  uses = g_hash_table_new(g_direct_hash, g_direct_equal);
+  shared = NULL;
+  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next)
+    for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL;
+         layerlist = layerlist->next)
+      for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL;
+           itemlist = itemlist->next) {
+        item = (struct Item *)itemlist->data;
+        if (item->type != ITEM_IMAGE) continue;
+        img = stored_image(item->image_png);
+        if (img == NULL) continue;
+        n = GPOINTER_TO_INT(g_hash_table_lookup(uses, img)) + 1;
+        g_hash_table_insert(uses, img, GINT_TO_POINTER(n));
+        if (n == 2) shared = g_list_prepend(shared, img);
+      }
+  g_hash_table_destroy(uses);
+  return g_list_reverse(shared);
+}
+
+void unmark_saved_shared(gpointer key, gpointer value, gpointer changed)
+{
+  StoredImage *img = (StoredImage *)value;
+  
+  if (!img->saved_shared) return;
+  img->saved_shared = FALSE;
+  g_hash_table_insert((GHashTable *)changed, img, img);
+}
+
+/* record which images are saved as shared from now on; those that
+   weren't last time, or were but aren't now, get added to changed */
+
+void mark_shared_images(GList *shared, GHashTable *changed)
+{
+  StoredImage *img;
+  
+  G_LOCK(image_store);
+  if (image_store != NULL) 
+    g_hash_table_foreach(image_store, unmark_saved_shared, changed);
+  G_UNLOCK(image_store);
+  for ( ; shared!=NULL; shared = shared->next) {
+    img = (StoredImage *)shared->data;
+    img->saved_shared = TRUE;
+    if (!g_hash_table_remove(changed, img)) g_hash_table_insert(changed, img, img);
+  }
+}
+
+/* Images read from a journal only keep their PNG at first (image_png);
+   the pixbuf gets decoded when the page comes into view, by a pool of
+   threads, or right away by item_image() when something else needs it. */
+
+GThreadPool *image_decode_pool; // NULL until needed, or if there are no threads
+GHashTable *image_decodes; // the ImageDecodeRequests in progress, by item
+int images_undecoded; // at most this many images still need their pixbuf
+int image_decode_max_queue; // statistics, over a burst of decoding
+int image_decode_count;
+GTimer *image_decode_timer;
+
+// decode a PNG; an image that can't be read is shown as an empty pixbuf
+
+GdkPixbuf *decode_image_png(const gchar *png, gsize png_len)
+{
+  GdkPixbuf *pixbuf;
+  
+  pixbuf = NULL;
+  if (png != NULL && png_len > 0) pixbuf = pixbuf_from_buffer(png, png_len);
+  if (pixbuf == NULL) {
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+    gdk_pixbuf_fill(pixbuf, 0);
+  }
+  return pixbuf;
+}
+
+// give a decoded pixbuf to an image (takes over the reference)
+
+void set_image_pixbuf(struct Item *item, GdkPixbuf *pixbuf)
+{
+  item->image = share_image_pixbuf(stored_image(item->image_png), pixbuf);
+  if (images_undecoded > 0) images_undecoded--;
+  if (item->canvas_item != NULL)
+    gnome_canvas_item_set(item->canvas_item, "pixbuf", item->image, NULL);
+}
+
+// the pixbuf of an image, decoding it now if it hasn't been yet
+
+GdkPixbuf *item_image(struct Item *item)
+{
+  if (item->image == NULL) {
+    cancel_image_decode(item);
+    set_image_pixbuf(item, stored_image_pixbuf(item->image_png, item->image_png_len));
+  }
+  return item->image;
+}
+
+void image_decode_thread(gpointer data, gpointer user_data)
+{
+  ImageDecodeRequest *req = (ImageDecodeRequest *)data;
+
+  if (g_atomic_int_get(&req->cancelled)) { // nobody is waiting for it
+    release_image_png(req->png);
+    g_free(req);
+    return;
+  }
+  req->pixbuf = decode_image_png(req->png, req->png_len);
+  pixbuf_content_hash(req->pixbuf); // so that sharing it costs nothing later
+  g_idle_add(image_decode_done, req);
+}
+
+gboolean image_decode_done(gpointer data)
+{
+  ImageDecodeRequest *req = (ImageDecodeRequest *)data;
+
+  if (req->item != NULL) {
+    g_hash_table_remove(image_decodes, req->item);
+    set_image_pixbuf(req->item, req->pixbuf);
+    image_decode_count++;
+  }
+  else g_object_unref(req->pixbuf);
+  release_image_png(req->png);
+  g_free(req);
+  if (image_decodes != NULL && g_hash_table_size(image_decodes) == 0) {
+#ifdef PERF_DEBUG
+    printf("DEBUG: decoded %d images in %.1f ms, at most %d queued\n", 
+           image_decode_count, g_timer_elapsed(image_decode_timer, NULL)*1000,
+           image_decode_max_queue);
+#endif
+    image_decode_count = image_decode_max_queue = 0;
+  }
+  return FALSE;
+}
+
+// start decoding the images on a page that don't have their pixbuf yet
+
+void queue_image_decodes(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+  ImageDecodeRequest *req;
+  StoredImage *img;
+  int nthreads;
+  
+  if (images_undecoded == 0) return;
+  if (image_decode_pool == NULL && g_thread_supported()) {
+    // leave a processor to the PDF renderer and the user interface
+#if GLIB_CHECK_VERSION(2,36,0)
+    nthreads = MAX(1, (int)g_get_num_processors() - 1);
+#else
+    nthreads = 3;
+#endif
+    image_decode_pool = g_thread_pool_new(image_decode_thread, NULL, nthreads, FALSE, NULL);
+    image_decodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    image_decode_timer = g_timer_new();
+  }
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL;
+         itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type != ITEM_IMAGE || item->image != NULL) continue;
+      img = stored_image(item->image_png);
+      if (image_decode_pool == NULL || (img != NULL && img->pixbuf != NULL))
+        { item_image(item); continue; }
+      if (g_hash_table_lookup(image_decodes, item) != NULL) continue;
+      req = g_new(ImageDecodeRequest, 1);
+      req->item = item;
+      req->png = ref_image_png(item->image_png);
+      req->png_len = item->image_png_len;
+      req->pixbuf = NULL;
+      req->cancelled = FALSE;
+      if (g_hash_table_size(image_decodes) == 0 && image_decode_count == 0)
+        g_timer_start(image_decode_timer);
+      g_hash_table_insert(image_decodes, item, req);
+      image_decode_max_queue = MAX(image_decode_max_queue, 
+                                   g_hash_table_size(image_decodes));
+      g_thread_pool_push(image_decode_pool, req, NULL);
+    }
+}
+
+// the number of images on a page without their pixbuf
+
+int page_undecoded_images(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+  int n = 0;
+  
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL;
+         itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type == ITEM_IMAGE && item->image == NULL) n++;
+    }
+  return n;
+}
+
+// an image is going away: its pixbuf won't be needed after all
+
+void cancel_image_decode(struct Item *item)
+{
+  ImageDecodeRequest *req;
+  
+  if (image_decodes == NULL) return;
+  req = (ImageDecodeRequest *)g_hash_table_lookup(image_decodes, item);
+  if (req == NULL) return;
+  req->item = NULL;
+  g_atomic_int_set(&req->cancelled, TRUE);
+  g_hash_table_remove(image_decodes, item);
+}
+
+// the journal was closed (the requests still running clean up after themselves)
+
+void forget_image_decodes(void)
+{
+  images_undecoded = 0;
+  image_decode_count = image_decode_max_queue = 0;
+}
+
+void cancel_image_decode_request(gpointer key, gpointer value, gpointer data)
+{
+  ImageDecodeRequest *req = (ImageDecodeRequest *)value;
+  
+  req->item = NULL;
+  g_atomic_int_set(&req->cancelled, TRUE);
+}
+
+// at exit: drop the queued decodes, wait for those running, free the pool
+
+void shutdown_image_decodes(void)
+{
+  if (image_decode_pool == NULL) return;
+  g_hash_table_foreach(image_decodes, cancel_image_decode_request, NULL);
+  g_hash_table_destroy(image_decodes);
+  image_decodes = NULL;
+  g_thread_pool_free(image_decode_pool, FALSE, TRUE);
+  image_decode_pool = NULL;
+  g_timer_destroy(image_decode_timer);
+  image_decode_timer = NULL;
+}
+
 void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
 {
   double scale;
@@ -51,9 +505,7 @@ void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
   item->canvas_item = NULL;
   item->bbox.left = pt[0];
   item->bbox.top = pt[1];
-  item->image = pixbuf;
-  item->image_png = NULL;
-  item->image_png_len = 0;
+  store_image_pixbuf(item, pixbuf);
 
   // Scale at native size, unless that won't fit, in which case we shrink it down.
   scale = 1 / ui.zoom;
@@ -66,6 +518,7 @@ void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
   item->bbox.bottom = item->bbox.top + scale * gdk_pixbuf_get_height(item->image);
   ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
   ui.cur_layer->nitems++;
+  invalidate_save_cache(ui.cur_layer);
   
   make_canvas_item_one(ui.cur_layer->group, item);
 
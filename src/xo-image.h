@@ -13,7 +13,53 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// an image in the store, shared by the image items that show it
+typedef struct StoredImage {
+  gchar *png;        // its PNG
+  gsize png_len;
+  int refs;          // number of holders of the PNG
+  int id;            // to refer to it in saved files, unique while we run
+  GdkPixbuf *pixbuf; // the decoded image, or NULL if not needed yet
+  gboolean saved_shared; // whether it was saved once for several items last time
+} StoredImage;
+
+// a PNG being decoded by the image decode threads
+typedef struct ImageDecodeRequest {
+  struct Item *item; // the image, or NULL if it went away meanwhile
+  gchar *png;        // a copy of its PNG
+  gsize png_len;
+  GdkPixbuf *pixbuf; // the result
+  gint cancelled;    // item went away before decoding started: skip it
+} ImageDecodeRequest;
+
+extern int images_undecoded;
+
 GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen);
+guint stored_image_hash(gconstpointer key);
+gboolean stored_image_equal(gconstpointer a, gconstpointer b);
+gchar *store_image_png(gchar *png, gsize png_len);
+StoredImage *stored_image(const gchar *png);
+gchar *ref_image_png(gchar *png);
+gboolean stored_image_has_pixbuf(gpointer key, gpointer value, gpointer pixbuf);
+void release_image_png(gchar *png);
+GdkPixbuf *share_image_pixbuf(StoredImage *img, GdkPixbuf *pixbuf);
+GdkPixbuf *stored_image_pixbuf(const gchar *png, gsize png_len);
+void store_image_pixbuf(struct Item *item, GdkPixbuf *pixbuf);
+gboolean encode_image_png(struct Item *item);
+GList *find_shared_images(void);
+void unmark_saved_shared(gpointer key, gpointer value, gpointer changed);
+void mark_shared_images(GList *shared, GHashTable *changed);
+GdkPixbuf *decode_image_png(const gchar *png, gsize png_len);
+void set_image_pixbuf(struct Item *item, GdkPixbuf *pixbuf);
+GdkPixbuf *item_image(struct Item *item);
+void image_decode_thread(gpointer data, gpointer user_data);
+gboolean image_decode_done(gpointer data);
+void queue_image_decodes(struct Page *pg);
+int page_undecoded_images(struct Page *pg);
+void cancel_image_decode(struct Item *item);
+void forget_image_decodes(void);
+void cancel_image_decode_request(gpointer key, gpointer value, gpointer data);
+void shutdown_image_decodes(void);
 void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt);
 void insert_image(GdkEvent *event);
 void rescale_images(void);
@@ -23,6 +23,7 @@
 #include <libgnomecanvas/libgnomecanvas.h>
 #include <gdk/gdkkeysyms.h>
 #include <time.h>
+#include <zlib.h>
 
 #include "xournal.h"
 #include "xo-interface.h"
@@ -89,6 +90,21 @@ gchar *candidate_save_filename(void)
 
 // some manipulation functions
 
+/* serial numbers for pages, layers and backgrounds: unlike their addresses,
+   these are never reused, so journal_structure() can't mistake a new page
+   for a freed one. Pages and layers may be created by the parse threads */
+
+volatile gint last_serial;
+
+int new_serial(void)
+{
+#if GLIB_CHECK_VERSION(2,30,0)
+  return g_atomic_int_add(&last_serial, 1) + 1;
+#else
+  return g_atomic_int_exchange_and_add(&last_serial, 1) + 1;
+#endif
+}
+
 struct Page *new_page(struct Page *template)
 {
   struct Page *pg = (struct Page *) g_memdup(template, sizeof(struct Page));
@@ -96,8 +112,14 @@ struct Page *new_page(struct Page *template)
   
   l->items = NULL;
   l->nitems = 0;
+  l->save_cache = NULL;
+  l->dirty = TRUE;
+  l->serial = new_serial();
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->lazy_chunk = -1;
+  pg->pdf_index_no = 0;
+  pg->serial = new_serial();
   if (template->bg->type != BG_SOLID && !ui.new_page_bg_from_pdf)
     pg->bg = (struct Background *)g_memdup(ui.default_page.bg, sizeof(struct Background));
   else 
@@ -128,8 +150,14 @@ struct Page *new_page_with_bg(struct Background *bg, double width, double height
   
   l->items = NULL;
   l->nitems = 0;
+  l->save_cache = NULL;
+  l->dirty = TRUE;
+  l->serial = new_serial();
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->lazy_chunk = -1;
+  pg->pdf_index_no = 0;
+  pg->serial = new_serial();
   pg->bg = bg;
   pg->bg->canvas_item = NULL;
   pg->height = height;
@@ -241,8 +269,9 @@ void clear_redo_stack(void)
       g_free(redo->item);
     }
     else if (redo->type == ITEM_IMAGE) {
-      g_object_unref(redo->item->image);
-      g_free(redo->item->image_png);
+      cancel_image_decode(redo->item);
+      if (redo->item->image != NULL) g_object_unref(redo->item->image);
+      release_image_png(redo->item->image_png);
       g_free(redo->item);
     }
     else if (redo->type == ITEM_ERASURE || redo->type == ITEM_RECOGNIZER) {
@@ -322,8 +351,9 @@ void clear_undo_stack(void)
         if (erasure->item->type == ITEM_TEXT)
           { g_free(erasure->item->text); g_free(erasure->item->font_name); }
         if (erasure->item->type == ITEM_IMAGE) {
-          g_object_unref(erasure->item->image);
-          g_free(erasure->item->image_png);
+          cancel_image_decode(erasure->item);
+          if (erasure->item->image != NULL) g_object_unref(erasure->item->image);
+          release_image_png(erasure->item->image_png);
         }
         g_free(erasure->item);
         g_list_free(erasure->replacement_items);
@@ -412,17 +442,92 @@ void delete_layer(struct Layer *l)
       g_free(item->font_name); g_free(item->text);
     }
     if (item->type == ITEM_IMAGE) {
-      g_object_unref(item->image);
-      g_free(item->image_png);
+      cancel_image_decode(item);
+      if (item->image != NULL) g_object_unref(item->image);
+      release_image_png(item->image_png);
     }
     // don't need to delete the canvas_item, as it's part of the group destroyed below
     g_free(item);
     l->items = g_list_delete_link(l->items, l->items);
   }
   if (l->group!= NULL) gtk_object_destroy(GTK_OBJECT(l->group));
+  free_save_cache(l->save_cache);
   g_free(l);
 }
 
+// a private copy of a layer's items, for saving in another thread.
+// Items that aren't complete yet (text being typed) are left out;
+// the copy should be freed with delete_layer()
+
+struct Layer *copy_layer_for_save(struct Layer *l)
+{
+  struct Layer *copy;
+  struct Item *item, *it;
+  GList *list;
+  
+  copy = g_new(struct Layer, 1);
+  copy->items = NULL;
+  copy->nitems = 0;
+  copy->group = NULL;
+  copy->save_cache = NULL;
+  copy->dirty = TRUE;
+  copy->serial = l->serial;
+  for (list = l->items; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
+    if (item->type == ITEM_TEXT && item->text == NULL) continue;
+    // the PNG is computed here so the other thread never needs the pixbuf
+    if (item->type == ITEM_IMAGE && !encode_image_png(item)) continue;
+    it = (struct Item *)g_memdup(item, sizeof(struct Item));
+    it->canvas_item = NULL;
+    it->widget = NULL;
+    if (it->type == ITEM_STROKE) {
+      it->path = gnome_canvas_points_new(item->path->num_points);
+      g_memmove(it->path->coords, item->path->coords, 
+                2*item->path->num_points*sizeof(double));
+      if (it->brush.variable_width)
+        it->widths = (gdouble *)g_memdup(item->widths, 
+                        (item->path->num_points-1)*sizeof(gdouble));
+    }
+    if (it->type == ITEM_TEXT) {
+      it->text = g_strdup(item->text);
+      it->font_name = g_strdup(item->font_name);
+    }
+    if (it->type == ITEM_IMAGE) {
+      if (it->image != NULL) g_object_ref(it->image);
+      it->image_png = ref_image_png(item->image_png);
+    }
+    copy->items = g_list_prepend(copy->items, it);
+    copy->nitems++;
+  }
+  copy->items = g_list_reverse(copy->items);
+  return copy;
+}
+
+// the saved copies of layers may be shared with an auto-save in progress
+
+void free_save_cache(GByteArray *cache)
+{
+  if (cache == NULL) return;
+#if GLIB_CHECK_VERSION(2,22,0)
+  g_byte_array_unref(cache);
+#else
+  g_byte_array_free(cache, TRUE);
+#endif
+}
+
+// incremental saving: called wherever a layer's items change (even while
+// it is off the journal, in the undo/redo stacks), so that it gets saved
+// again rather than copied from its save_cache
+
+void invalidate_save_cache(struct Layer *l)
+{
+  if (l == NULL) return;
+  l->dirty = TRUE;
+  if (l->save_cache == NULL) return;
+  free_save_cache(l->save_cache);
+  l->save_cache = NULL;
+}
+
 // referenced strings
 
 struct Refstring *new_refstring(const char *s)
@@ -695,29 +800,33 @@ void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
 
 void make_canvas_items(void)
 {
-  struct Page *pg;
+  GList *pagelist;
+  
+  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next)
+    make_page_canvas_items((struct Page *)pagelist->data);
+}
+
+void make_page_canvas_items(struct Page *pg)
+{
   struct Layer *l;
   struct Item *item;
-  GList *pagelist, *layerlist, *itemlist;
+  GList *layerlist, *itemlist;
   
-  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
-    pg = (struct Page *)pagelist->data;
-    if (pg->group == NULL) {
-      pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
-         gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
-      make_page_clipbox(pg);
-    }
-    if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
-    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
-      l = (struct Layer *)layerlist->data;
-      if (l->group == NULL)
-        l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
-           pg->group, gnome_canvas_group_get_type(), NULL);
-      for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
-        item = (struct Item *)itemlist->data;
-        if (item->canvas_item == NULL)
-          make_canvas_item_one(l->group, item);
-      }
+  if (pg->group == NULL) {
+    pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+       gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
+    make_page_clipbox(pg);
+  }
+  if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    if (l->group == NULL)
+      l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+         pg->group, gnome_canvas_group_get_type(), NULL);
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->canvas_item == NULL)
+        make_canvas_item_one(l->group, item);
     }
   }
 }
@@ -735,6 +844,7 @@ void update_canvas_bg(struct Page *pg)
   if (pg->bg->canvas_item != NULL)
     gtk_object_destroy(GTK_OBJECT(pg->bg->canvas_item));
   pg->bg->canvas_item = NULL;
+  if (pg->bg->type != BG_PDF) bgpdf_clear_tile_items(pg);
   
   if (pg->bg->type == BG_SOLID)
   {
@@ -841,6 +951,64 @@ gboolean is_visible(struct Page *pg)
   return FALSE;
 }
 
+/* in the continuous view modes, is the page before (-1), on (0) or
+   after (1) the visible part of the canvas? */
+
+int page_view_position(struct Page *pg)
+{
+  GtkAdjustment *adj;
+  double top, bottom, start, end;
+  
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
+    adj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+    start = pg->hoffset;
+    end = pg->hoffset + pg->width;
+  } else {
+    adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+    start = pg->voffset;
+    end = pg->voffset + pg->height;
+  }
+  top = adj->value/ui.zoom;
+  bottom = (adj->value + adj->page_size) / ui.zoom;
+  if (end <= top) return -1;
+  if (start >= bottom) return 1;
+  return 0;
+}
+
+/* read in the contents of the pages on screen, for lazily loaded journals,
+   and start decoding the images on them */
+
+void load_visible_pages(void)
+{
+  GList *pglist;
+  struct Page *pg;
+  
+  if (journal.lazy_pages == 0 && images_undecoded == 0) return;
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (!is_visible(pg)) continue;
+    if (pg->lazy_chunk >= 0) load_page_contents(pg);
+    queue_image_decodes(pg);
+  }
+}
+
+/* how urgently do we need the background of page number pageno?
+   visible pages come first, then the next few pages in the direction
+   the user is moving, then everything else by distance */
+
+int bgpdf_page_priority(int pageno, int first_visible, int last_visible)
+{
+  int ahead;
+  
+  if (pageno >= first_visible && pageno <= last_visible)
+    return BGPDF_PRIORITY_VISIBLE;
+  if (bgpdf.view_direction > 0) ahead = pageno - last_visible;
+  else ahead = first_visible - pageno;
+  if (ahead > 0 && ahead <= BGPDF_PREFETCH_PAGES) return ahead;
+  if (pageno < first_visible) return BGPDF_PRIORITY_OTHER + first_visible - pageno;
+  return BGPDF_PRIORITY_OTHER + pageno - last_visible;
+}
+
 void rescale_bg_pixmaps(void)
 {
   GList *pglist;
@@ -848,11 +1016,35 @@ void rescale_bg_pixmaps(void)
   GdkPixbuf *pix;
   gboolean is_well_scaled;
   gdouble zoom_to_request;
+  gboolean use_tiles;
+  int pageno, first_visible, last_visible, priority;
+  int old_first_visible, old_last_visible;
+  gsize planned_bytes, page_bytes;
   
-  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+  // find the visible pages, and which way the user is moving
+  first_visible = last_visible = -1;
+  for (pglist = journal.pages, pageno = 0; pglist!=NULL; pglist = pglist->next, pageno++)
+    if (is_visible((struct Page *)pglist->data)) {
+      if (first_visible < 0) first_visible = pageno;
+      last_visible = pageno;
+    }
+  if (first_visible < 0) first_visible = last_visible = ui.pageno;
+  old_first_visible = bgpdf.view_first_page;
+  old_last_visible = bgpdf.view_last_page;
+  if (first_visible != old_first_visible) 
+    bgpdf.view_direction = (first_visible > old_first_visible) ? 1 : -1;
+  bgpdf.cache_clock++;
+  bgpdf.view_first_page = first_visible;
+  bgpdf.view_last_page = last_visible;
+  bgpdf_update_request_priorities(first_visible, last_visible);
+  bgpdf_drop_tiles(72*ui.zoom); // the ones at other zoom levels
+  planned_bytes = bgpdf.cache_bytes;
+
+  for (pglist = journal.pages, pageno = 0; pglist!=NULL; pglist = pglist->next, pageno++) {
     pg = (struct Page *)pglist->data;
-    // in progressive mode we scale only visible pages
-    if (ui.progressive_bg && !is_visible(pg)) continue;
+    priority = bgpdf_page_priority(pageno, first_visible, last_visible);
+    // in progressive mode we scale only visible pages and those coming up next
+    if (ui.progressive_bg && priority >= BGPDF_PRIORITY_OTHER) continue;
 
     if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
       g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
@@ -861,6 +1053,9 @@ void rescale_bg_pixmaps(void)
       pg->bg->pixbuf_scale = 0;
     }
     if (pg->bg->type == BG_PDF) { 
+      // large pages get a lower resolution render, and tiles where visible
+      zoom_to_request = MIN(ui.zoom, bgpdf_max_page_zoom(pg));
+      use_tiles = (ui.zoom > zoom_to_request);
       // make pixmap scale to correct size if current one is wrong
       is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
                      && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
@@ -873,13 +1068,31 @@ void rescale_bg_pixmaps(void)
             "width-set", TRUE, "height-set", TRUE, 
             NULL);
       }
+      if (priority == BGPDF_PRIORITY_VISIBLE) {
+        bgpdf_touch_page(pg->bg->file_page_seq, 
+          pageno < old_first_visible || pageno > old_last_visible);
+        if (use_tiles) bgpdf_update_tiles(pg);
+      }
+      // pages dropped from the cache come back only when needed, and the
+      // pages far from the view only get rendered while the cache has room
+      else if (priority >= BGPDF_PRIORITY_OTHER && 
+               pg->bg->pixbuf_scale != zoom_to_request) {
+        if (bgpdf_page_evicted(pg->bg->file_page_seq)) continue;
+        page_bytes = (gsize)(3*pg->width*zoom_to_request*pg->height*zoom_to_request);
+        if (!bgpdf_cache_fits(planned_bytes + page_bytes)) continue;
+        planned_bytes += page_bytes;
+      }
       // request an asynchronous update to a better pixmap if needed
-      zoom_to_request = MIN(ui.zoom, MAX_SAFE_RENDER_DPI/72.0);
-      if (pg->bg->pixbuf_scale == zoom_to_request) continue;
-      if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request))
+      if (pg->bg->pixbuf_scale == zoom_to_request) {
+        // already queued or done: its priority was updated above
+        continue;
+      }
+      // the renderer looks in the disk cache before calling poppler
+      if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request, priority))
         pg->bg->pixbuf_scale = zoom_to_request;
     }
   }
+  bgpdf_cancel_stale_tile_requests();
 }
 
 gboolean have_intersect(struct BBox *a, struct BBox *b)
@@ -1414,6 +1627,7 @@ void do_switch_page(int pg, gboolean rescroll, gboolean refresh_all)
     }
   
   ui.cur_page = g_list_nth_data(journal.pages, ui.pageno);
+  load_page_contents(ui.cur_page);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   update_page_stuff();
@@ -1710,6 +1924,7 @@ void recolor_temp_text(int color_no, guint color_rgba)
   if (ui.cur_item->text!=NULL && ui.cur_item->brush.color_rgba != color_rgba) {
     prepare_new_undo();
     undo->type = ITEM_TEXT_ATTRIB;
+    undo->layer = ui.cur_layer;
     undo->item = ui.cur_item;
     undo->str = g_strdup(ui.cur_item->font_name);
     undo->val_x = ui.cur_item->font_size;
@@ -1717,6 +1932,7 @@ void recolor_temp_text(int color_no, guint color_rgba)
   }
   ui.cur_item->brush.color_no = color_no;
   ui.cur_item->brush.color_rgba = color_rgba;
+  invalidate_save_cache(ui.cur_layer);
   rgb_to_gdkcolor(color_rgba, &gdkcolor);
   gtk_widget_modify_text(ui.cur_item->widget, GTK_STATE_NORMAL, &gdkcolor);
   gtk_widget_grab_focus(ui.cur_item->widget);
@@ -1873,6 +2089,7 @@ void process_paperstyle_activate(GtkMenuItem *menuitem, int style)
         pg->bg->color_rgba = predef_bgcolors_rgba[COLOR_WHITE];
         pg->bg->filename = NULL;
         pg->bg->pixbuf = NULL;
+        bgpdf_index_page(pg);
         must_upd = TRUE;
       }
       pg->bg->ruling = style;
@@ -1949,6 +2166,8 @@ void move_journal_items_by(GList *itemlist, double dx, double dy,
   int i;
   double *pt;
   
+  invalidate_save_cache(l1);
+  invalidate_save_cache(l2);
   while (itemlist!=NULL) {
     item = (struct Item *)itemlist->data;
     if (item->type == ITEM_STROKE)
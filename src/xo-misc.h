@@ -18,6 +18,7 @@ gchar *candidate_save_filename(void);
 
 // data manipulation misc functions
 
+int new_serial(void);
 struct Page *new_page(struct Page *template);
 struct Page *new_page_with_bg(struct Background *bg, double width, double height);
 void set_current_page(gdouble *pt);
@@ -29,6 +30,9 @@ void prepare_new_undo(void);
 void delete_journal(struct Journal *j);
 void delete_page(struct Page *pg);
 void delete_layer(struct Layer *l);
+struct Layer *copy_layer_for_save(struct Layer *l);
+void free_save_cache(GByteArray *cache);
+void invalidate_save_cache(struct Layer *l);
 
 // referenced strings
 
@@ -47,9 +51,13 @@ void emergency_enable_xinput(GdkInputMode mode);
 void update_item_bbox(struct Item *item);
 void make_page_clipbox(struct Page *pg);
 void make_canvas_items(void);
+void make_page_canvas_items(struct Page *pg);
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item);
 void update_canvas_bg(struct Page *pg);
 gboolean is_visible(struct Page *pg);
+int page_view_position(struct Page *pg);
+void load_visible_pages(void);
+int bgpdf_page_priority(int pageno, int first_visible, int last_visible);
 void rescale_bg_pixmaps(void);
 
 gboolean have_intersect(struct BBox *a, struct BBox *b);
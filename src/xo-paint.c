@@ -346,6 +346,7 @@ void finalize_stroke(void)
   // store the item on top of the layer stack
   ui.cur_layer->items = g_list_append(ui.cur_layer->items, ui.cur_item);
   ui.cur_layer->nitems++;
+  invalidate_save_cache(ui.cur_layer);
   ui.cur_item = NULL;
   ui.cur_item_type = ITEM_NONE;
 }
@@ -502,6 +503,7 @@ void finalize_erasure(void)
       ui.cur_layer->items = g_list_insert_before(
                       ui.cur_layer->items, itemlist, partlist->data);
     ui.cur_layer->nitems += item->erasure->nrepl-1;
+    invalidate_save_cache(ui.cur_layer);
   }
     
   ui.cur_item = NULL;
@@ -662,6 +664,7 @@ void end_text(void)
     }
     ui.cur_layer->items = g_list_remove(ui.cur_layer->items, ui.cur_item);
     ui.cur_layer->nitems--;
+    invalidate_save_cache(ui.cur_layer);
     ui.cur_item = NULL;
     return;
   }
@@ -674,6 +677,7 @@ void end_text(void)
     undo->layer = ui.cur_layer;
     undo->item = ui.cur_item;
     undo->str = ui.cur_item->text;
+    invalidate_save_cache(ui.cur_layer);
   }
   else g_free(ui.cur_item->text);
 
@@ -749,12 +753,15 @@ struct Item *click_is_in_text_or_image(struct Layer *layer, double x, double y)
   return val;
 }
 
-void refont_text_item(struct Item *item, gchar *font_name, double font_size)
+void refont_text_item(struct Item *item, struct Layer *layer, 
+                      gchar *font_name, double font_size)
 {
   if (!strcmp(font_name, item->font_name) && font_size==item->font_size) return;
+  invalidate_save_cache(layer);
   if (item->text!=NULL) {
     prepare_new_undo();
     undo->type = ITEM_TEXT_ATTRIB;
+    undo->layer = layer;
     undo->item = item;
     undo->str = item->font_name;
     undo->val_x = item->font_size;
@@ -787,7 +794,7 @@ void process_font_sel(gchar *str)
   undo_cont = FALSE;   
   // if there's a current text item, re-font it
   if (ui.cur_item_type == ITEM_TEXT) {
-    refont_text_item(ui.cur_item, str, size);
+    refont_text_item(ui.cur_item, ui.cur_layer, str, size);
     undo_cont = (ui.cur_item->text!=NULL);   
   }
   // if there's a current selection, re-font it
@@ -796,7 +803,7 @@ void process_font_sel(gchar *str)
       it = (struct Item *)list->data;
       if (it->type == ITEM_TEXT) {   
         if (undo_cont) undo->multiop |= MULTIOP_CONT_REDO;
-        refont_text_item(it, str, size);
+        refont_text_item(it, ui.selection->layer, str, size);
         if (undo_cont) undo->multiop |= MULTIOP_CONT_UNDO;
         undo_cont = TRUE;
       }
@@ -44,6 +44,7 @@
 #include "xo-paint.h"
 #include "xo-print.h"
 #include "xo-file.h"
+#include "xo-image.h"
 
 #define RGBA_RED(rgba) (((rgba>>24)&0xff)/255.0)
 #define RGBA_GREEN(rgba) (((rgba>>16)&0xff)/255.0)
@@ -1107,6 +1108,11 @@ struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf
   GList *list;
   struct PdfImage *image;
   
+  // images from the image store share their pixbuf: embed those only once
+  for (list = *images; list!=NULL; list = list->next) {
+    image = (struct PdfImage *)list->data;
+    if (image->pixbuf == pixbuf) return image;
+  }
   image = g_malloc(sizeof(struct PdfImage));
   *images = g_list_append(*images, image);
   image->n_obj = xref->last+1;
@@ -1282,7 +1288,7 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
         g_object_unref(layout);
       }
       else if  (item->type == ITEM_IMAGE) {
-        cur_image = new_pdfimage(xref, pdfimages, item->image);
+        cur_image = new_pdfimage(xref, pdfimages, item_image(item));
 	cur_image->used_in_this_page = TRUE;
         g_string_append_printf(str, "\nq 1 0 0 1 %.2f %.2f cm %.2f 0 0 %.2f 0 %.2f cm /Im%d Do Q ",
            item->bbox.left, item->bbox.top, // translation
@@ -1321,6 +1327,8 @@ gboolean print_to_pdf(char *filename)
   char *tmpbuf;
   GList *last_layer;
   
+  // the PDF bg may be mapped in memory: replace the file, don't overwrite it
+  if (bgpdf_is_mapped_file(filename)) g_unlink(filename);
   f = g_fopen(filename, "wb");
   if (f == NULL) return FALSE;
   setlocale(LC_NUMERIC, "C");
@@ -1330,6 +1338,7 @@ gboolean print_to_pdf(char *filename)
   pdffonts = NULL;
   pdfimages = NULL;
   n_page = 0;
+  load_all_pages();
   for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
     pg = (struct Page *)pglist->data;
     if (pg->bg->type == BG_PDF) uses_pdf = TRUE;
@@ -1648,6 +1657,10 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
   int i;
   double *pt;
   PangoFontDescription *font_desc;
+#ifdef CAIRO_MIME_TYPE_UNIQUE_ID
+  cairo_surface_t *image_surface;
+  gchar *image_id;
+#endif
 
   scale = MIN(width/pg->width, height/pg->height);
   cairo_translate(cr, (width-scale*pg->width)/2, (height-scale*pg->height)/2);
@@ -1703,10 +1716,17 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
         pango_cairo_show_layout(cr, layout);
       }
       if (item->type == ITEM_IMAGE) {
-        double scalex = (item->bbox.right-item->bbox.left)/gdk_pixbuf_get_width(item->image);
+        double scalex = (item->bbox.right-item->bbox.left)/gdk_pixbuf_get_width(item_image(item));
         double scaley = (item->bbox.bottom-item->bbox.top)/gdk_pixbuf_get_height(item->image);
         cairo_scale(cr, scalex, scaley);
         gdk_cairo_set_source_pixbuf(cr,item->image, item->bbox.left/scalex, item->bbox.top/scaley);
+#ifdef CAIRO_MIME_TYPE_UNIQUE_ID
+        // the same pixbuf becomes the same image in the PDF
+        cairo_pattern_get_surface(cairo_get_source(cr), &image_surface);
+        image_id = g_strdup_printf("xournal-image-%p", (void *)item->image);
+        cairo_surface_set_mime_data(image_surface, CAIRO_MIME_TYPE_UNIQUE_ID,
+            (unsigned char *)image_id, strlen(image_id), g_free, image_id);
+#endif
         cairo_scale(cr, 1/scalex, 1/scaley);
         cairo_paint(cr);
         old_rgba = predef_colors_rgba[COLOR_BLACK];
@@ -1726,6 +1746,7 @@ void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, g
   PangoLayout *layout;
         
   pg = (struct Page *)g_list_nth_data(journal.pages, pageno);
+  load_page_contents(pg);
   cr = gtk_print_context_get_cairo_context(context);
   width = gtk_print_context_get_width(context);
   height = gtk_print_context_get_height(context);
@@ -1746,6 +1767,7 @@ gboolean print_to_pdf_cairo(char *filename)
   cairo_status_t retval;
   GList *last_layer;
  
+  load_all_pages();
   surface = cairo_pdf_surface_create(filename, ui.default_page.width, ui.default_page.height);
   for (list = journal.pages; list!=NULL; list = list->next) {
     pg = (struct Page *)list->data;
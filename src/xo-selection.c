@@ -24,12 +24,14 @@
 #include <libart_lgpl/art_vpath_dash.h>
 #include <libart_lgpl/art_svp_point.h>
 #include <libart_lgpl/art_svp_vpath.h>
+#include <zlib.h>
 
 #include "xournal.h"
 #include "xo-callbacks.h"
 #include "xo-interface.h"
 #include "xo-support.h"
 #include "xo-misc.h"
+#include "xo-file.h"
 #include "xo-paint.h"
 #include "xo-selection.h"
 
@@ -448,9 +450,10 @@ void continue_movesel(GdkEvent *event)
     ui.selection->move_pageno = tmppageno;
     if (tmppageno == ui.selection->orig_pageno)
       ui.selection->move_layer = ui.selection->layer;
-    else
-      ui.selection->move_layer = (struct Layer *)(g_list_last(
-        ((struct Page *)g_list_nth_data(journal.pages, tmppageno))->layers)->data);
+    else {
+      load_page_contents(tmppage);
+      ui.selection->move_layer = (struct Layer *)(g_list_last(tmppage->layers)->data);
+    }
     gnome_canvas_item_reparent(ui.selection->canvas_item, ui.selection->move_layer->group);
     for (list = ui.selection->items; list!=NULL; list = list->next) {
       item = (struct Item *)list->data;
@@ -573,6 +576,7 @@ void finalize_resizesel(void)
     // create the undo information
     prepare_new_undo();
     undo->type = ITEM_RESIZESEL;
+    undo->layer = ui.selection->layer;
     undo->itemlist = g_list_copy(ui.selection->items);
     undo->auxlist = NULL;
 
@@ -582,6 +586,7 @@ void finalize_resizesel(void)
     undo->val_y = offset_y;
 
     // actually do the resize operation
+    invalidate_save_cache(ui.selection->layer);
     resize_journal_items_by(ui.selection->items, scaling_x, scaling_y, offset_x, offset_y);
   }
 
@@ -627,6 +632,7 @@ void selection_delete(void)
     erasure->replacement_items = NULL;
     ui.selection->layer->items = g_list_remove(ui.selection->layer->items, item);
     ui.selection->layer->nitems--;
+    invalidate_save_cache(ui.selection->layer);
     undo->erasurelist = g_list_prepend(undo->erasurelist, erasure);
   }
   reset_selection();
@@ -649,8 +655,10 @@ void recolor_selection(int color_no, guint color_rgba)
   if (ui.selection == NULL) return;
   prepare_new_undo();
   undo->type = ITEM_REPAINTSEL;
+  undo->layer = ui.selection->layer;
   undo->itemlist = NULL;
   undo->auxlist = NULL;
+  invalidate_save_cache(ui.selection->layer);
   for (itemlist = ui.selection->items; itemlist!=NULL; itemlist = itemlist->next) {
     item = (struct Item *)itemlist->data;
     if (item->type != ITEM_STROKE && item->type != ITEM_TEXT) continue;
@@ -686,8 +694,10 @@ void rethicken_selection(int val)
   if (ui.selection == NULL) return;
   prepare_new_undo();
   undo->type = ITEM_REPAINTSEL;
+  undo->layer = ui.selection->layer;
   undo->itemlist = NULL;
   undo->auxlist = NULL;
+  invalidate_save_cache(ui.selection->layer);
   for (itemlist = ui.selection->items; itemlist!=NULL; itemlist = itemlist->next) {
     item = (struct Item *)itemlist->data;
     if (item->type != ITEM_STROKE || item->brush.tool_type!=TOOL_PEN) continue;
@@ -315,6 +315,7 @@ void remove_recognized_strokes(struct RecoSegment *rs, int num_old_items)
       gtk_object_destroy(GTK_OBJECT(old_item->canvas_item));
     ui.cur_layer->items = g_list_remove(ui.cur_layer->items, old_item);
     ui.cur_layer->nitems--;
+    invalidate_save_cache(ui.cur_layer);
   }
 }
 
@@ -340,6 +341,7 @@ struct Item *insert_recognized_curpath(void)
   erasure->replacement_items = g_list_append(erasure->replacement_items, item);
   ui.cur_layer->items = g_list_append(ui.cur_layer->items, item);
   ui.cur_layer->nitems++;
+  invalidate_save_cache(ui.cur_layer);
   make_canvas_item_one(ui.cur_layer->group, item);
   return item;
 }
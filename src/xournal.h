@@ -27,6 +27,10 @@
    XInput and want to try things differently. Especially useful on older
    distributions (up to around 2010). */
 
+// #define PERF_DEBUG
+/* uncomment this line to print performance statistics on the console
+   (time to first visible PDF background page, ...). */
+
 #define FILE_DIALOG_SIZE_BUGFIX
 /* ugly, but should help users with versions of GTK+ that suffer from the
    "tiny file dialog" syndrome, without hurting those with well-behaved
@@ -38,6 +42,7 @@
 #define MRU_FILE "recent-files"
 #define MRU_SIZE 8 
 #define CONFIG_FILE "config"
+#define PDFCACHE_DIR "pdf-cache"
 
 // apparently, not all Win32/64 compilers define WIN32 (?)
 
@@ -62,7 +67,9 @@
 #define DISPLAY_DPI_DEFAULT 96.0
 #define MIN_ZOOM 0.2
 #define RESIZE_MARGIN 6.0
-#define MAX_SAFE_RENDER_DPI 720 // max dpi at which PDF bg's get rendered
+#define BGPDF_TILE_SIZE 512 // PDF bg tiles are this many pixels wide and high
+#define BGPDF_MAX_PAGE_PIXELS (16*BGPDF_TILE_SIZE*BGPDF_TILE_SIZE) // max pixels in
+            // a whole PDF bg page render; above that, visible tiles get rendered
 
 #define VBOX_MAIN_NITEMS 5 // number of interface items in vboxMain
 
@@ -95,6 +102,7 @@ typedef struct Background {
   double pixbuf_scale; // for PIXMAP, this is the *current* zoom value
                        // for PDF, this is the *requested* zoom value
   int pixel_height, pixel_width; // PDF only: pixel size of current pixbuf
+  int serial; // see new_serial(); copies of a background keep it
 } Background;
 
 #define BG_SOLID 0
@@ -224,6 +232,10 @@ typedef struct Layer {
   GList *items; // the items on the layer, from bottom to top
   int nitems;
   GnomeCanvasGroup *group;
+  GByteArray *save_cache; // the layer as a gzip member from the last save, NULL if changed since
+  int save_cache_level; // the compression level of save_cache
+  gboolean dirty; // changed since it was last saved, see invalidate_save_cache()
+  int serial; // see new_serial()
 } Layer;
 
 typedef struct Page {
@@ -233,12 +245,18 @@ typedef struct Page {
   double hoffset, voffset; // offsets of canvas group rel. to canvas root
   struct Background *bg;
   GnomeCanvasGroup *group;
+  int lazy_chunk; // if >= 0, the layers are still in this chunk of journal.lazy_source
+  int pdf_index_no; // PDF page it is listed under in bgpdf.page_index, or 0
+  int serial; // see new_serial()
 } Page;
 
 typedef struct Journal {
   GList *pages;  // the pages in the journal
   int npages;
   int last_attach_no; // for naming of attached backgrounds
+  FILE *lazy_source; // binary journal file whose pages are read on demand
+  guint64 lazy_length; // its size when it was opened
+  int lazy_pages; // number of pages not read yet from it
 } Journal;
 
 typedef struct Selection {
@@ -309,7 +327,13 @@ typedef struct UIData {
   GdkPixbuf *pen_cursor_pix, *hiliter_cursor_pix;
   gboolean pen_cursor; // use pencil cursor (default is a dot in current color)
   gboolean progressive_bg; // update PDF bg's one at a time
+  int pdf_render_threads; // number of worker threads rendering PDF bg's (0 = main loop)
+  int pdf_cache_size; // memory budget for rendered PDF bg's, in MB (0 = unlimited)
+  int pdf_disk_cache_size; // same on disk, across sessions, in MB (0 = disabled)
+  gboolean pdf_preview; // show a low resolution PDF bg until the real one is ready
+  gboolean pdf_mmap; // map the bg PDF file in memory rather than copy it
   char *mrufile, *configfile; // file names for MRU & config
+  char *pdfcachedir; // where rendered PDF bg pages are kept across sessions
   char *mru[MRU_SIZE]; // MRU data
   GtkWidget *mrumenu[MRU_SIZE];
   gboolean bg_apply_all_pages;
@@ -324,11 +348,21 @@ typedef struct UIData {
   double zoom_step_factor; // the multiplicative factor in zoom in/out
   double startup_zoom;
   gboolean autoload_pdf_xoj;
+  gboolean lazy_load; // read the pages of binary journals only when needed
   gboolean autocreate_new_xoj;
   gboolean autosave_enabled, autosave_loop_running, autosave_need_catchup;
   GList *autosave_filename_list;
   int autosave_delay;
   gboolean need_autosave;
+  gchar *autosave_snapshot; // the last full auto-save, which the log builds on
+  GByteArray *autosave_structure; // pages and layers at the time, see journal_structure()
+  gsize autosave_log_size;
+  gboolean autosave_threaded; // write full auto-saves in a worker thread
+  int compression_level, autosave_compression_level; // zlib levels for saving
+  int compression_threads; // worker threads compressing saved files (0 = none)
+  gboolean share_images; // save repeated images once, in <imagedata> (not 0.4.8-compatible)
+  gboolean autosave_running; // the worker thread is writing one
+  int autosave_generation; // changes whenever the auto-save snapshot is forgotten
 #if GLIB_CHECK_VERSION(2,6,0)
   GKeyFile *config_data;
 #endif
@@ -365,7 +399,7 @@ typedef struct UndoErasureData {
 typedef struct UndoItem {
   int type;
   struct Item *item; // for ITEM_STROKE, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_TEXT_ATTRIB, ITEM_IMAGE
-  struct Layer *layer; // for ITEM_STROKE, ITEM_ERASURE, ITEM_PASTE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_MOVESEL, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_RECOGNIZER, ITEM_IMAGE
+  struct Layer *layer; // for ITEM_STROKE, ITEM_ERASURE, ITEM_PASTE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_MOVESEL, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_TEXT_ATTRIB, ITEM_RECOGNIZER, ITEM_IMAGE, ITEM_REPAINTSEL, ITEM_RESIZESEL
   struct Layer *layer2; // for ITEM_DELETE_LAYER with val=-1, ITEM_MOVESEL
   struct Page *page;  // for ITEM_NEW_BG_ONE/RESIZE, ITEM_NEW_PAGE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_DELETE_PAGE
   GList *erasurelist; // for ITEM_ERASURE, ITEM_RECOGNIZER
@@ -388,14 +422,41 @@ typedef struct UndoItem {
 typedef struct BgPdfRequest {
   int pageno;
   double dpi;
+  int tile_x, tile_y; // the tile to render, or -1 for the whole page
+  gboolean preview; // a quick low resolution render, until the real one is done
+  gboolean from_disk; // read from the disk cache by bgpdf.disk_pool, not rendered
+  int priority; // lower values get rendered first, see BGPDF_PRIORITY_*
+  gint cancelled; // superseded while being rendered: stop, discard the result
+                  // (set from the main loop, use g_atomic_int_get/set)
+  GdkPixbuf *pixbuf; // the rendered page, filled in by the renderer
+  int pixel_height, pixel_width; // pixel size of the whole page
 } BgPdfRequest;
 
 typedef struct BgPdfPage {
   double dpi;
   GdkPixbuf *pixbuf;
   int pixel_height, pixel_width; // pixel size of pixbuf
+  gsize bytes; // memory used by pixbuf
+  gboolean evicted; // pixbuf was dropped from the cache, render again when needed
+  unsigned long last_used; // value of bgpdf.cache_clock when last displayed
 } BgPdfPage;
 
+typedef struct BgPdfTile {
+  int pageno;
+  double dpi;
+  int tile_x, tile_y; // position in the page, in units of BGPDF_TILE_SIZE pixels
+  GdkPixbuf *pixbuf;
+  int page_pixel_height, page_pixel_width; // pixel size of the whole page
+  gsize bytes; // memory used by pixbuf
+  unsigned long last_used; // value of bgpdf.cache_clock when last displayed
+} BgPdfTile;
+
+typedef struct BgPdfTileItem {
+  struct Page *page;
+  struct BgPdfTile *tile;
+  GnomeCanvasItem *canvas_item; // goes away with the page's canvas group
+} BgPdfTileItem;
+
 typedef struct BgPdf {
   int status; // the rest only makes sense if this is not STATUS_NOT_INIT
   guint pid; // the identifier of the idle callback
@@ -403,13 +464,43 @@ typedef struct BgPdf {
   int file_domain;
   gchar *file_contents; // buffer containing a copy of file data
   gsize file_length;  // size of above buffer
+  GMappedFile *file_mapping; // if not NULL, file_contents is this mapping of the file
+  gchar *file_path; // the file that was read
+  int file_serial; // different for each PDF file loaded
+  gchar *checksum; // of the file's path, size and date, to find its pages in the disk cache
   int npages;
   GList *pages; // a list of BgPdfPage structures
   GList *requests; // a list of BgPdfRequest structures
+  GList *tiles; // a list of BgPdfTile structures, when zoomed in a lot
+  GList *tile_items; // a list of BgPdfTileItem structures, one per tile on a page
+  GList **page_index; // journal pages using each PDF page, see bgpdf_index_page()
+  int page_index_size;
+  gboolean page_index_valid;
+  int update_count; // statistics on bgpdf_update_bg()
+  double update_time;
   gboolean has_failed; // has failed in the past...
   PopplerDocument *document; // the poppler document
+  gchar *uri; // the uri of the document, for the render threads
+  GThreadPool *render_pool; // threads rendering requests, or NULL if none
+  GAsyncQueue *render_docs; // idle poppler documents, one per render thread
+  GThreadPool *disk_pool; // thread reading pages from the disk cache, or NULL
+  GList *rendering; // the requests currently handed to the render or disk threads
+  int view_first_page, view_direction; // to prefetch in the scroll direction
+  GTimer *view_timer; // started when a visible page gets requested
+  gboolean view_pending; // waiting for the first visible page to be rendered
+  int view_count; // statistics on time to first visible page
+  double view_last_time, view_total_time;
+  int view_last_page; // last visible page, to detect when pages come into view
+  gsize cache_bytes; // memory used by the pixbufs in pages
+  unsigned long cache_clock; // ticks every time the backgrounds get rescaled
+  int cache_hits, cache_misses; // pages that came into view with/without a render
 } BgPdf;
 
+#define BGPDF_PRIORITY_VISIBLE 0  // on screen
+#define BGPDF_PREVIEW_DPI 48      // resolution of quick previews
+#define BGPDF_PREFETCH_PAGES 2    // next pages in scroll direction get priority 1, 2...
+#define BGPDF_PRIORITY_OTHER 1000 // all other pages, by distance to the view
+
 #define STATUS_NOT_INIT 0
 #define STATUS_READY    1  // things are initialized and can work
 // there used to be more possible values, things got streamlined...